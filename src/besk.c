@@ -4,25 +4,18 @@
 //
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <memory.h>
 #include <math.h>
+#include <time.h>
 
 #include "besk.h"
+#include "besk_ops.h"
 #include "telex.h"
 
-#ifdef SIMULATOR
-extern void simulator_init(int argc, char** argv, besk_t* st);
-extern void simulator_run(besk_t* st);
-#define SIMULATOR_INIT(ac,av,st) simulator_init((ac),(av),(st))
-#define SIMULATOR_RUN(st)  simulator_run(st)
-#else
-#define SIMULATOR_INIT(ac,av,st)
-#define SIMULATOR_RUN(st)
-#endif
-
 #define FMT_IND  0x0001   // indirect addressing mode
 #define FMT_DEC  0x0002   // immediate addressing mode
 #define FMT_HEX  0x0004   // immediate addressing mode
@@ -84,87 +77,6 @@ static struct {
 };
 
 
-// Helord layout - 64 bit ord as 2 32-bit half words
-// using 20 bit in each half only, Vs,Hs are only used
-// as sign extension when possible.
-// 
-//        even                 odd
-// +-------------------+-------------------+
-// | Vs:12,Vw:12,Vop:8 | Hs:12,Hw:12,Hop:8 |
-// +-------------------+-------------------+
-// when return as helord (and as stored in registers)
-// +---------------------------------------+
-// |      s:24,Vw:12,Vop:8,Hw:12,Hop:8     |
-// +---------------------------------------+
-//
-
-// reading left halvord (even address) is reading into upper helord,
-// while lower (right) is set to zero.
-// read right halvord (odd address) is reading into lower helord
-// while upper (left) s set to zero
-// 
-helord_t halvord_read(unsigned addr, halvord_t* mem)
-{
-     if (addr & 1) // read hhao (right half)
-	 return (helord_t) (mem[addr] & HALVORD_MASK);
-     else  // read vhao (left half)
-	 return ((helord_t) ((mem[addr] & HALVORD_MASK))) << 20;
-}
-
-// read halv ord (H=0) | or hel ord (H=1)
-helord_t ord_read(int H, unsigned addr, halvord_t* mem)
-{
-    helord_t value;
-    addr &= 0x7ff; // ignore top bit! (cyclic memory!)
-    if (H)
-	value = helord_read(addr, mem);
-    else
-	value = halvord_read(addr, mem);
-    return value;
-}
-
-
-void halvord_write(unsigned addr, halvord_t* mem, helord_t value)
-{
-    addr &= 0x7ff; // ignore top bit! (cyclic memory!)
-    if (addr & 1) { // hhao only to hhac
-	mem[addr] = value & HALVORD_MASK;
-    }
-    else { // vhao only to vhac! ?
-	// mem[addr] = value & HALVORD_MASK;
-	mem[addr] = (value >> 20);
-    }
-}
-
-// write halv ord (H=0) or hel ord (H=1)
-void ord_write(int H, unsigned addr, halvord_t* mem, helord_t value)
-{
-    if (H)
-	helord_write(addr, mem, value);
-    else
-	halvord_write(addr, mem, value);
-}
-
-// write address part of addr
-void addr_write(int H, unsigned addr, halvord_t* mem, helord_t value)
-{
-    addr &= 0x7ff; // ignore top bit! (cyclic memory!)
-    if (H) {  // both cells
-	mem[addr]   = (mem[addr] & ~HALVORD_OP)|((value >> 20) & HALVORD_ADDR);
-	mem[addr+1] = (mem[addr+1] & ~HALVORD_OP) | (value & HALVORD_ADDR);
-
-    }
-    else if (addr & 1) { // write hha0 (right half)
-    	mem[addr] = (mem[addr] & ~HALVORD_OP) | (value & HALVORD_ADDR);
-
-
-    }
-    else {
-	// mem[addr] = (mem[addr] & ~0x000FF) | (value & 0xFFF00);
-	mem[addr] = (mem[addr] & ~HALVORD_OP) | ((value >> 20) & HALVORD_ADDR);
-    }
-}
-
 //int xdigit(int c)
 //{
 //    return (c & 0x10) ? (c & 0xF) : (c & 0xF) + 9;
@@ -182,82 +94,85 @@ void addr_write(int H, unsigned addr, halvord_t* mem, helord_t value)
 // ins5x = <hex digit> <hex digit> <hex digit> <hex digit> <hex digit>
 // w3x   = <hex digit> <hex digit> <hex digit>
 //
-#define MAX_NUM_LABELS  (1024)
-#define MAX_NUM_PATCHES (1024)
-#define UNRESOLVED (-1)
+// debug output from the assembler
+#define ASM_LOG(as, ...) do { if ((as)->verbose) printf(__VA_ARGS__); } while(0)
 
-static int num_labels = 0;
-static struct {
-    char* name;  // label name (without ':')
-    int   len;   // length of label name
-    halvord_t addr;  // address (0..2047)
-} label_table[MAX_NUM_LABELS];
+void besk_asm_init(besk_asm_t* as, int verbose)
+{
+    as->verbose = verbose;
+    as->num_labels = 0;
+    as->num_patches = 0;
+}
 
-static int num_patches = 0;
-static struct {
-    int lbl;  // label index with unresolved label
-    int addr; // address of unresolved label
-} patch_table[MAX_NUM_PATCHES];
+void besk_asm_free(besk_asm_t* as)
+{
+    int i;
+    for (i = 0; i < as->num_labels; i++)
+	free(as->label[i].name);
+    as->num_labels = 0;
+    as->num_patches = 0;
+}
 
-int find_label(char* name, size_t nl)
+int find_label(besk_asm_t* as, char* name, size_t nl)
 {
     int i;
-    for (i = 0; i < num_labels; i++) {
-	if ((label_table[i].len == nl) &&
-	    (strncmp(label_table[i].name, name, nl) == 0))
+    for (i = 0; i < as->num_labels; i++) {
+	if ((as->label[i].len == nl) &&
+	    (strncmp(as->label[i].name, name, nl) == 0))
 	    return i;
     }
     return -1;
 }
 
-int add_label(char* name, size_t nl, halvord_t addr)
+int add_label(besk_asm_t* as, char* name, size_t nl, halvord_t addr)
 {
     int i;
-    if ((i=num_labels) >= MAX_NUM_LABELS) {
+    if ((i=as->num_labels) >= MAX_NUM_LABELS) {
 	fprintf(stderr, "Too many labels\n");
 	return -1;
     }
-    label_table[i].name = malloc(nl+1);
-    label_table[i].len = nl;
-    memcpy(label_table[i].name, name, nl);
-    label_table[i].name[nl] = '\0';
-    label_table[i].addr = addr;
-    printf("add label[%d] '%s' addr=%03X\n",
-	   i, label_table[i].name, label_table[i].addr);
-    num_labels++;
+    as->label[i].name = malloc(nl+1);
+    as->label[i].len = nl;
+    memcpy(as->label[i].name, name, nl);
+    as->label[i].name[nl] = '\0';
+    as->label[i].addr = addr;
+    ASM_LOG(as, "add label[%d] '%s' addr=%03X\n",
+	    i, as->label[i].name, as->label[i].addr);
+    as->num_labels++;
     return i;
 }
 
-int add_patch(int lbl, int addr)
+int add_patch(besk_asm_t* as, int lbl, int addr)
 {
     int i;
-    if ((i=num_patches) >= MAX_NUM_PATCHES) {
+    if ((i=as->num_patches) >= MAX_NUM_PATCHES) {
 	fprintf(stderr, "Too many patches\n");
 	return -1;
     }
-    patch_table[i].lbl = lbl;
-    patch_table[i].addr = addr;
-    printf("add patch[%d] lbl=%d addr=%03X\n",
-	   i, patch_table[i].lbl, patch_table[i].addr);
-    num_patches++;    
+    as->patch[i].lbl = lbl;
+    as->patch[i].addr = addr;
+    ASM_LOG(as, "add patch[%d] lbl=%d addr=%03X\n",
+	    i, as->patch[i].lbl, as->patch[i].addr);
+    as->num_patches++;
     return i;
 }
 
-halvord_t find_or_patch_address(char* name, size_t nl, halvord_t addr)
+halvord_t find_or_patch_address(besk_asm_t* as, char* name, size_t nl,
+				 halvord_t addr)
 {
     int ix;
-    if ((ix = find_label(name, nl)) >= 0) {
-	if (label_table[ix].addr == UNRESOLVED) {
-	    if (add_patch(ix, addr) < 0)
+    if ((ix = find_label(as, name, nl)) >= 0) {
+	if (as->label[ix].addr == UNRESOLVED) {
+	    if (add_patch(as, ix, addr) < 0)
 		return -1;
 	    return 0;
 	}
-	return label_table[ix].addr;
+	return as->label[ix].addr;
     }
     else {
-	if ((ix = add_label(name, nl, UNRESOLVED)) < 0)
+	if ((ix = add_label(as, name, nl, UNRESOLVED)) < 0)
 	    return -1;
-	if (add_patch(ix, addr) < 0)
+	if (add_patch(as, ix, addr) < 0)
 	    return -1;
 	return 0;
     }
@@ -311,8 +226,8 @@ halvord_t digits_to_halvord(char* ds, int n, int b)
     return val;
 }
 
-halvord_t load_code(FILE* f, char* filename, int ln, halvord_t addr,
-		    halvord_t* mem)
+halvord_t load_code(besk_asm_t* as, FILE* f, char* filename, int ln,
+		    halvord_t addr, besk_mem_t* mem)
 {
     char line[MAX_LINE+1];
     char* ts[MAX_TOKENS];   // token start
@@ -396,17 +311,18 @@ halvord_t load_code(FILE* f, char* filename, int ln, halvord_t addr,
 	    continue;  // empty line
 	if (IS_ID(tt[j]) && (tt[j+1] == ':')) { // label
 	    int ix;
-	    if ((ix = find_label(ts[j], tl[j])) >= 0) {
-		if (label_table[ix].addr != UNRESOLVED) {
+	    if ((ix = find_label(as, ts[j], tl[j])) >= 0) {
+		if (as->label[ix].addr != UNRESOLVED) {
 		    fprintf(stderr, "%s:%d: label '%.*s' already defined\n",
 			    filename, ln, tl[j], ts[j]);
 		    return -1;
 		}
-		fprintf(stderr, "%s:%d: label '%.*s' = %03X resolved\n",
-			filename, ln, tl[j], ts[j], addr);
-		label_table[ix].addr = addr;  // resolved!
+		if (as->verbose)
+		    fprintf(stderr, "%s:%d: label '%.*s' = %03X resolved\n",
+			    filename, ln, tl[j], ts[j], addr);
+		as->label[ix].addr = addr;  // resolved!
 	    }
-	    else if (add_label(ts[j], tl[j], addr) < 0) {
+	    else if (add_label(as, ts[j], tl[j], addr) < 0) {
 		fprintf(stderr, "%s:%d: too many labels\n", filename, ln);
 		return -1;
 	    }
@@ -425,7 +341,7 @@ halvord_t load_code(FILE* f, char* filename, int ln, halvord_t addr,
 
 	if (IS_NUM(tt[j]) && (tl[j] == 5)) { // ins5x
 	    halvord_t word = digits_to_halvord(ts[j], 5, 16);
-	    mem[addr & 0x7ff] = word;
+	    mem_set(mem, addr & 0x7ff, word);
 	    addr++;
 	}
 	else if (IS_ID(tt[j]) && (tl[j] >= 1)) {
@@ -435,8 +351,8 @@ halvord_t load_code(FILE* f, char* filename, int ln, halvord_t addr,
 	    oktet_t op;
 	    int ix;
 	    // lookup opcode from name
-	    printf("lookup '%.*s' len=%d\n", nlen, nptr, nlen);
-		   
+	    ASM_LOG(as, "lookup '%.*s' len=%d\n", nlen, nptr, nlen);
+
 	    if ((ix = lookup_opcode(nptr, nlen, &op, &fmt)) >= 0) {
 		halvord_t ins = 0;
 		j++;
@@ -444,8 +360,8 @@ halvord_t load_code(FILE* f, char* filename, int ln, halvord_t addr,
 		nptr += strlen(op_table[ix].mnem);
 		nlen -= strlen(op_table[ix].mnem);
 
-		printf("#op index = %d, opcode=%02x, fmt=%04X name=%.*s\n",
-		       ix, op, fmt, nlen, nptr);
+		ASM_LOG(as, "#op index = %d, opcode=%02x, fmt=%04X name=%.*s\n",
+			ix, op, fmt, nlen, nptr);
 
 		// check for .h | .z suffix
 		if (fmt & FMT_H) {
@@ -463,17 +379,17 @@ halvord_t load_code(FILE* f, char* filename, int ln, halvord_t addr,
 		    if ((tt[j] == '[') &&
 			(IS_NUM(tt[j+1]) && (tl[j+1]==3)) &&
 			tt[j+2] == ']') {
-			halvord_t as;
-			as = digits_to_halvord(ts[j+1], 3, 16);
-			ins |= (as << 8);
+			halvord_t a;
+			a = digits_to_halvord(ts[j+1], 3, 16);
+			ins |= (a << 8);
 		    }
 		    else if ((tt[j] == '[') &&
 			     (IS_ID(tt[j+1]) && (tl[j+1] >= 1)) &&
 			     tt[j+2] == ']') {
-			halvord_t as;
-			printf("lookup '%.*s' len=%d\n",tl[j+1],ts[j+1],tl[j+1]);
-			if ((as = find_or_patch_address(ts[j+1],tl[j+1],addr)) >= 0)
-			    ins |= ((as & 0x7ff) << 8);
+			halvord_t a;
+			ASM_LOG(as, "lookup '%.*s' len=%d\n",tl[j+1],ts[j+1],tl[j+1]);
+			if ((a = find_or_patch_address(as,ts[j+1],tl[j+1],addr)) >= 0)
+			    ins |= ((a & 0x7ff) << 8);
 			else
 			    goto syntax_error;
 			
@@ -504,10 +420,10 @@ halvord_t load_code(FILE* f, char* filename, int ln, halvord_t addr,
 		    else if (IS_ID(tt[j])) {
 			char* nptr = ts[j];
 			int nlen = tl[j];
-			halvord_t as;
-			printf("lookup '%.*s' len=%d\n", nlen, nptr, nlen);
-			if ((as = find_or_patch_address(nptr, nlen, addr)) >= 0)
-			    ins |= ((as & 0x7ff) << 8);
+			halvord_t a;
+			ASM_LOG(as, "lookup '%.*s' len=%d\n", nlen, nptr, nlen);
+			if ((a = find_or_patch_address(as, nptr, nlen, addr)) >= 0)
+			    ins |= ((a & 0x7ff) << 8);
 			else
 			    goto syntax_error;
 		    }
@@ -515,7 +431,7 @@ halvord_t load_code(FILE* f, char* filename, int ln, halvord_t addr,
 			goto syntax_error;		    
 		}
 		else if (fmt & FMT_XYCD) {
-		    halvord_t as = 0;
+		    halvord_t a = 0;
 		    if (IS_ID(tt[j])) { // x|xc|xd|y|yc|yd
 			nptr = ts[j];
 			nlen = tl[j];
@@ -526,26 +442,26 @@ halvord_t load_code(FILE* f, char* filename, int ln, halvord_t addr,
 			// printf("F code %c\n", *nptr);
 			switch(*nptr++) {
 			case '.': break;
-			case 'x': as |= (0 << 3); break;
-			case 'y': as |= (1 << 3); break;
-			case 'd': as |= 0x4; break;  // Punkt
-			case 'c': as |= 0x6; break;  // Cirkel
+			case 'x': a |= (0 << 3); break;
+			case 'y': a |= (1 << 3); break;
+			case 'd': a |= 0x4; break;  // Punkt
+			case 'c': a |= 0x6; break;  // Cirkel
 			default: goto syntax_error;
 			}
 			nlen--;
 		    }
 		    // 0x0 form is used! not 0x2 form
-		    // if ((as & 0x6) == 0)
-		    //   as |= 0x2;
-		    ins |= ((as & 0x7ff) << 8);
+		    // if ((a & 0x6) == 0)
+		    //   a |= 0x2;
+		    ins |= ((a & 0x7ff) << 8);
 		}
 		
-		mem[addr & 0x7ff] = ins;
+		mem_set(mem, addr & 0x7ff, ins);
 		addr++;
 	    }
 	    else if (strncmp(".org", ts[j], tl[j]) == 0) {
 		j++;
-		printf("org %d %.*s\n", tt[j], tl[j], ts[j]);
+		ASM_LOG(as, "org %d %.*s\n", tt[j], tl[j], ts[j]);
 		if (IS_NUM(tt[j]) && (tl[j] == 3)) {
 		    addr = digits_to_halvord(ts[j], 3, 16);
 		    if (addr0 == -1) addr0 = addr;
@@ -557,11 +473,12 @@ halvord_t load_code(FILE* f, char* filename, int ln, halvord_t addr,
 	    else
 		goto syntax_error;
 	}
-	fprintf(stdout, "> %03X %05X\n", addr-1, mem[addr-1]);
+	ASM_LOG(as, "> %03X %05X\n", addr-1, mem_get(mem, (addr-1) & 0x7ff));
     }
-    for (i = 0; i < num_patches; i++) {
-	mem[patch_table[i].addr] |= (label_table[patch_table[i].lbl].addr<<8);
-	fprintf(stdout, ">> %03X %05X\n", patch_table[i].addr, mem[patch_table[i].addr]);
+    for (i = 0; i < as->num_patches; i++) {
+	unsigned a = as->patch[i].addr;
+	mem_set(mem, a, mem_get(mem, a) | (as->label[as->patch[i].lbl].addr<<8));
+	ASM_LOG(as, ">> %03X %05X\n", a, mem_get(mem, a));
     }
     return addr0;
 
@@ -580,8 +497,12 @@ helord_t read_drum_memory(besk_t* st, halvord_t INS, helord_t MR)
 
     n = W(MR) & 0x1FE;  // channel number, even numbered
     offset = (n>>1)*DRUM_CHANNEL_BYTES;
-    fseek(st->drum, offset, SEEK_SET);
-    fread(data, 1, DRUM_CHANNEL_BYTES, st->drum);
+    if (!io_drum_get(st, n>>1, data)) {
+	fseek(st->drum, offset, SEEK_SET);
+	memset(data, 0, sizeof(data));  // past the end of the drum file
+	fread(data, 1, DRUM_CHANNEL_BYTES, st->drum);
+	io_drum_put(st, n>>1, data);
+    }
 
     // unpack the data helord into memory
     addr = W(INS) & 0x7FE;
@@ -591,6 +512,7 @@ helord_t read_drum_memory(besk_t* st, halvord_t INS, helord_t MR)
 	AR = ((helord_t)ptr[4]<<32) | ((helord_t)ptr[3]<<24) |
 	    ((helord_t)ptr[2]<<16) | ((helord_t)ptr[1]<<8) | (helord_t)ptr[0];
 	ord_write(H(INS), addr, st->MEM, AR);
+	decode_invalidate(st, H(INS), addr);
 	addr += 2;
 	ptr  += 5;  // 40 bit helord
     }
@@ -607,7 +529,8 @@ helord_t write_drum_memory(besk_t* st, halvord_t INS, helord_t MR)
 
     n = W(MR) & 0x1FE;  // channel number, even numbered
     offset = (n>>1)*DRUM_CHANNEL_BYTES;
-    fseek(st->drum, offset, SEEK_SET);
+    if (!io_replaying(st))
+	fseek(st->drum, offset, SEEK_SET);
     // unpack the data helord into memory
     addr = W(INS) & 0x7FE;
     ptr  = data;
@@ -621,13 +544,14 @@ helord_t write_drum_memory(besk_t* st, halvord_t INS, helord_t MR)
 	addr += 2;
 	ptr  += 5;  // 40 bit helord
     }
-    fwrite(data, 1, DRUM_CHANNEL_BYTES, st->drum);
+    if (!io_replaying(st))  // drum writes are dropped in replay
+	fwrite(data, 1, DRUM_CHANNEL_BYTES, st->drum);
     return AR;
 }
 
 
 // read n rows from 4 channel data
-helord_t read_4_channel_remsa(besk_t* st, int n)
+static helord_t read_4_channel_file(FILE* in, int n)
 {
     char line[81];
     char* ptr;    
@@ -638,7 +562,7 @@ helord_t read_4_channel_remsa(besk_t* st, int n)
     next:
 	y = 0;
 	memset(line, ' ', 5);
-	ptr = fgets(line, sizeof(line), st->in);
+	ptr = fgets(line, sizeof(line), in);
 	if (ptr == NULL) return 0; // fixme: error?
 	if (ptr[4] != 'o') goto next; // skip blank in position 5
 	// read hex digit
@@ -651,8 +575,50 @@ helord_t read_4_channel_remsa(besk_t* st, int n)
     return x;
 }
 
+// read n rows from 4 channel data, from the io log when replaying
+helord_t read_4_channel_remsa(besk_t* st, int n)
+{
+    helord_t x;
+
+    if (io_word_get(st, IO_READ4, &x))
+	return x;
+    x = read_4_channel_file(st->in, n);
+    io_word_put(st, IO_READ4, x);
+    return x;
+}
+
+// read n 5 channel codes, from the io log when replaying
+helord_t read_5_channel_remsa(besk_t* st, int n)
+{
+    helord_t x;
+
+    if (io_word_get(st, IO_READ5, &x))
+	return x;
+    x = telex_read_remsa(st->in, n);
+    io_word_put(st, IO_READ5, x);
+    return x;
+}
+
+// check punched code against the io log when replaying, return 1 when
+// replayed (nothing is punched)
+static int punch_replay(besk_t* st, int kind, uint8_t code)
+{
+    uint8_t logged;
+
+    if (!io_get(st, kind, &logged))
+	return 0;
+    if (st->running && (logged != code)) {
+	printf("%03X | IO REPLAY DIVERGED at #%lu\n", st->KR, st->count);
+	st->running = 0;
+    }
+    return 1;
+}
+
 void write_4_channel_remsa(besk_t* st, uint8_t code)
 {
+    if (punch_replay(st, IO_PUNCH4, code))
+	return;
+    io_put(st, IO_PUNCH4, &code);
     if (st->ut == NULL)
 	return;
     fprintf(st->ut, "%c%c%c%co\n", 
@@ -664,6 +630,9 @@ void write_4_channel_remsa(besk_t* st, uint8_t code)
 
 void write_tecken_remsa(besk_t* st, uint8_t code)
 {
+    if (punch_replay(st, IO_PUNCH, code))
+	return;
+    io_put(st, IO_PUNCH, &code);
     if (st->ut == NULL)
 	return;
     fprintf(st->ut, "%c%c%c%c-\n", 
@@ -790,26 +759,80 @@ void besk_trace(FILE* f, besk_t* state)
     fprintf(f, "\n");
 }
 
-static void trace_addr(FILE* f, halvord_t addr, halvord_t INS, halvord_t* mem)
+// allocate flight recorder for the last size instructions (rounded up
+// to a power of two), size=0 turns it off
+int besk_rec_init(besk_t* state, uint32_t size)
+{
+    uint32_t n = 1;
+
+    free(state->rec);
+    state->rec = NULL;
+    state->rec_mask = 0;
+    state->rec_pos = 0;
+    if (size == 0)
+	return 0;
+    while(n < size)
+	n <<= 1;
+    if ((state->rec = malloc(n*sizeof(besk_rec_t))) == NULL)
+	return -1;
+    state->rec_mask = n-1;
+    return 0;
+}
+
+// print recorded instructions, oldest first, in besk_trace format
+void besk_rec_dump(FILE* f, besk_t* state)
+{
+    uint64_t n = state->rec_pos;
+    uint64_t i;
+
+    if (state->rec == NULL)
+	return;
+    if (n > (uint64_t)state->rec_mask+1)
+	n = (uint64_t)state->rec_mask+1;
+    for (i = state->rec_pos - n; i < state->rec_pos; i++) {
+	besk_rec_t* r = &state->rec[i & state->rec_mask];
+	fprintf(f, "%03X | %05X | ", r->KR, r->INS);
+	besk_emit_instruction(f, O(r->INS), W(r->INS));
+	fprintf(f, " | AR=%010lX MR=%010lX SI=%d\n", r->AR, r->MR, r->SI);
+    }
+}
+
+// write flight recorder to state->rec_name
+int besk_rec_save(besk_t* state)
+{
+    FILE* f;
+
+    if ((state->rec == NULL) || (state->rec_name == NULL))
+	return 0;
+    if ((f = fopen(state->rec_name, "w")) == NULL) {
+	fprintf(stderr, "unable to open recorder file %s\n", state->rec_name);
+	return -1;
+    }
+    besk_rec_dump(f, state);
+    fclose(f);
+    return 0;
+}
+
+void trace_addr(FILE* f, halvord_t addr, halvord_t INS, besk_mem_t* mem)
 {
     if (H(INS))
 	fprintf(f, "    || sta [%03X] %05X%05X\n",
-		addr, mem[addr], mem[addr+1]);
+		addr, mem_get(mem, addr), mem_get(mem, addr+1));
     else if (addr & 1)
 	fprintf(f, "    || sta.h [%03X] %05X\n",
-		addr, mem[addr]);
+		addr, mem_get(mem, addr));
     else
 	fprintf(f, "    || sta.l [%03X] %05X\n",
-		addr, mem[addr]);
+		addr, mem_get(mem, addr));
 }
 
-static void trace_read(FILE* f, halvord_t addr, helord_t value)
+void trace_read(FILE* f, halvord_t addr, helord_t value)
 {
     fprintf(f, "    || rd [%03X] = %010lX (%f)\n",
 	    addr, value, helord_to_double(value));
 }
 
-static void trace_write(FILE* f, halvord_t addr, halvord_t INS, helord_t value)
+void trace_write(FILE* f, halvord_t addr, halvord_t INS, helord_t value)
 {
     if (H(INS))
 	fprintf(f, "    || wr %03X %010lX (%f)\n",
@@ -833,24 +856,25 @@ static void trace_write(FILE* f, halvord_t addr, halvord_t INS, helord_t value)
 // 44444 55555
 // 66666 -----
 //
-void dump_mem(FILE* f, halvord_t addr0, halvord_t addr1, halvord_t* mem)
+void dump_mem(FILE* f, halvord_t addr0, halvord_t addr1, besk_mem_t* mem)
 {
     if (addr0 == -1) addr0 = 0;
     if (addr1 == -1) addr1 = NUM_HALF_CELLS-1;
     addr0 &= 0x7FE;  // ignore top bit and make even
     while(addr0 <= addr1) { // 
-	fprintf(f, "%03X %05X %05X\n", addr0, mem[addr0], mem[addr0+1]);
+	fprintf(f, "%03X %05X %05X\n", addr0, mem_get(mem, addr0),
+		mem_get(mem, addr0+1));
 	addr0 += 2;
     }
 }
 
-void dump_prog(FILE* f, halvord_t addr0, halvord_t addr1, halvord_t* mem)
+void dump_prog(FILE* f, halvord_t addr0, halvord_t addr1, besk_mem_t* mem)
 {
     if (addr0 == -1) addr0 = 0;
     if (addr1 == -1) addr1 = NUM_HALF_CELLS-1;
     addr0 &= 0x7FE;  // ignore top bit and make even
     while(addr0 <= addr1) { //
-	halvord_t ins = mem[addr0];
+	halvord_t ins = mem_get(mem, addr0);
 	char buf[80];
 	format_instruction(O(ins), W(ins), buf, sizeof(buf));	
 	fprintf(f, "%03X %05X : %s\n", addr0, ins, buf);
@@ -867,6 +891,16 @@ void dump_registers(FILE* f, besk_t* besk)
     fprintf(f, "KR=%03X\n", besk->KR);
 }
 
+void dump_speed(FILE* f, besk_t* besk,
+		struct timespec* t0, struct timespec* t1)
+{
+    double t = (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec)*1e-9;
+    fprintf(f, "instructions=%lu, time=%.3fs", besk->count, t);
+    if (t > 0.0)
+	fprintf(f, ", %.2f MIPS", (besk->count / t) * 1e-6);
+    fprintf(f, "\n");
+}
+
 void dump_state(FILE* f, besk_t* besk)
 {
     dump_registers(f, besk);
@@ -874,20 +908,232 @@ void dump_state(FILE* f, besk_t* besk)
 }
 
 
+// profile kind of each N(INS): operand read, operand write, SI set,
+// jump (a backward jump closes a loop)
+#define PROF_READ  0x01
+#define PROF_WRITE 0x02
+#define PROF_SI    0x04
+#define PROF_JUMP  0x08
+static const uint8_t prof_kind[32] = {
+    [0x00] = PROF_READ|PROF_SI, [0x02] = PROF_READ|PROF_SI,
+    [0x03] = PROF_READ|PROF_SI, [0x04] = PROF_SI, [0x05] = PROF_SI,
+    [0x06] = PROF_READ|PROF_WRITE|PROF_SI, [0x07] = PROF_WRITE,
+    [0x08] = PROF_READ|PROF_SI, [0x09] = PROF_READ|PROF_SI,
+    [0x0A] = PROF_JUMP, [0x0B] = PROF_READ|PROF_SI, [0x0C] = PROF_JUMP,
+    [0x0D] = PROF_READ|PROF_SI, [0x0E] = PROF_JUMP,
+    [0x0F] = PROF_READ|PROF_SI, [0x10] = PROF_READ|PROF_SI,
+    [0x11] = PROF_WRITE, [0x12] = PROF_READ, [0x19] = PROF_WRITE,
+};
+
+// next host timing sample in period/2..3*period/2 instructions, varied
+// so a loop is not always sampled at the same instruction
+static uint32_t prof_next(besk_prof_t* prof)
+{
+    prof->seed = prof->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return prof->period/2 + 1 + (uint32_t)((prof->seed >> 33) % prof->period);
+}
+
+// start timing the next instruction, or count the one timed for KR0
+static void __attribute__((noinline))
+prof_sample(besk_prof_t* prof, halvord_t KR0, halvord_t INS)
+{
+    uint64_t t = besk_ticks();
+
+    if (prof->tick == 0) {
+	prof->tick = t;
+	prof->sample = 1;
+	return;
+    }
+    prof->ticks[KR0] += (t - prof->tick) * prof->period;
+    prof->op_ticks[O(INS)] += (t - prof->tick) * prof->period;
+    prof->tick = 0;
+    prof->sample = prof_next(prof);
+}
+
+// update profile after instruction INS at KR0 was executed, KR is the
+// next instruction. Counters are flat increments. Host time is sampled,
+// the instruction after a sample is timed and counted for period.
+static inline void prof_step(besk_prof_t* prof, halvord_t KR0,
+			     halvord_t INS, halvord_t KR, oktet_t SI)
+{
+    unsigned a = W(INS) & 0x7ff;
+    unsigned k = prof_kind[N(INS)];
+
+    KR0 &= 0x7ff;
+    prof->exec[KR0]++;
+    prof->op_exec[O(INS)]++;
+    if (k & PROF_SI)
+	prof->si[KR0] += (SI != 0);
+    if (k & PROF_READ) {
+	prof->read[a]++;
+	prof->read[(a+1) & 0x7ff] += (H(INS) != 0);
+    }
+    if (k & PROF_WRITE) {
+	prof->write[a]++;
+	prof->write[(a+1) & 0x7ff] += (H(INS) != 0);
+    }
+    if (k & PROF_JUMP)
+	prof->back[KR0] += ((KR & 0x7ff) <= KR0);
+    if (prof->period && (--prof->sample == 0))
+	prof_sample(prof, KR0, INS);
+}
+
+besk_prof_t* prof_create(uint32_t period)
+{
+    besk_prof_t* prof;
+    if ((prof = calloc(1, sizeof(besk_prof_t))) == NULL)
+	return NULL;
+    prof->ns0   = besk_ns();
+    prof->tick0 = besk_ticks();
+    prof->period = period;
+    prof->seed  = 1;
+    if (period)
+	prof->sample = prof_next(prof);
+    return prof;
+}
+
+static int prof_cmp_exec(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a >> 11;
+    uint64_t y = *(const uint64_t*)b >> 11;
+    return (x < y) ? 1 : ((x > y) ? -1 : 0);
+}
+
+#define PROF_TOP   20  // number of hot addresses and loops shown
+
+// mnemonic of (full 8 bit) OP, without address
+static void prof_mnemonic(oktet_t op, char* buf, size_t buflen)
+{
+    char* ptr;
+    format_instruction(op, 0, buf, buflen);
+    if ((ptr = strchr(buf, ' ')) != NULL)
+	*ptr = '\0';
+}
+
+// print opcode histogram as CSV, op,mnemonic,count,ticks,mean ticks
+void dump_prof_csv(FILE* f, besk_t* besk)
+{
+    besk_prof_t* prof = besk->prof;
+    char buf[80];
+    int op;
+
+    fprintf(f, "op,mnemonic,count,ticks,mean\n");
+    for (op = 0; op < 256; op++) {
+	if (prof->op_exec[op] == 0)
+	    continue;
+	prof_mnemonic(op, buf, sizeof(buf));
+	fprintf(f, "%02X,%s,%lu,%lu,%.1f\n", op, buf,
+		prof->op_exec[op], prof->op_ticks[op],
+		(double)prof->op_ticks[op] / prof->op_exec[op]);
+    }
+}
+
+// print program with profile counts, the hottest addresses and loops
+void dump_prof(FILE* f, besk_t* besk)
+{
+    besk_prof_t* prof = besk->prof;
+    uint64_t sort[NUM_HALF_CELLS];  // count<<11 | addr
+    uint64_t total = 0, cum = 0;
+    double ns_tick;
+    int i, j, n;
+
+    for (i = 0; i < NUM_HALF_CELLS; i++)
+	total += prof->exec[i];
+    if (total == 0)
+	return;
+    ns_tick = (double)(besk_ns() - prof->ns0) / (besk_ticks() - prof->tick0);
+
+    fprintf(f, "ADR INS   : %-16s %12s %6s %12s %12s %12s %8s\n",
+	    "INSTRUCTION", "EXEC", "%", "READ", "WRITE", "SI", "NS");
+    for (i = 0; i < NUM_HALF_CELLS; i++) {
+	halvord_t ins = mem_get(besk->MEM, i);
+	char buf[80];
+	if (!prof->exec[i] && !prof->read[i] && !prof->write[i])
+	    continue;
+	format_instruction(O(ins), W(ins), buf, sizeof(buf));
+	fprintf(f, "%03X %05X : %-16s %12lu %6.2f %12lu %12lu %12lu %8.1f\n",
+		i, ins, buf, prof->exec[i], (100.0*prof->exec[i])/total,
+		prof->read[i], prof->write[i], prof->si[i],
+		prof->exec[i] ? (prof->ticks[i]*ns_tick)/prof->exec[i] : 0.0);
+    }
+
+    fprintf(f, "\nhot addresses\n");
+    for (i = 0, n = 0; i < NUM_HALF_CELLS; i++)
+	if (prof->exec[i])
+	    sort[n++] = (prof->exec[i] << 11) | i;
+    qsort(sort, n, sizeof(uint64_t), prof_cmp_exec);
+    for (i = 0; (i < n) && (i < PROF_TOP); i++) {
+	unsigned a = sort[i] & 0x7ff;
+	cum += prof->exec[a];
+	fprintf(f, "%03X %12lu %6.2f%% %6.2f%% %10.0fns\n", a, prof->exec[a],
+		(100.0*prof->exec[a])/total, (100.0*cum)/total,
+		prof->ticks[a]*ns_tick);
+    }
+
+    // opcode variants by total time, ticks are cpu cycles on x86-64
+    // estimated from the sampled instructions
+    fprintf(f, "\nopcodes\n");
+    fprintf(f, "OP %-10s %12s %16s %6s %10s\n",
+	    "MNEMONIC", "EXEC", "TICKS", "%", "MEAN");
+    for (i = 0, n = 0, cum = 0; i < 256; i++) {
+	if (prof->op_exec[i]) {
+	    sort[n++] = (prof->op_ticks[i] << 11) | i;
+	    cum += prof->op_ticks[i];
+	}
+    }
+    qsort(sort, n, sizeof(uint64_t), prof_cmp_exec);
+    for (i = 0; i < n; i++) {
+	unsigned op = sort[i] & 0xff;
+	char buf[80];
+	prof_mnemonic(op, buf, sizeof(buf));
+	fprintf(f, "%02X %-10s %12lu %16lu %6.2f %10.1f\n", op, buf,
+		prof->op_exec[op], prof->op_ticks[op],
+		cum ? (100.0*prof->op_ticks[op])/cum : 0.0,
+		(double)prof->op_ticks[op] / prof->op_exec[op]);
+    }
+
+    // a backward jump at KR to W closes the loop W..KR
+    fprintf(f, "\nhot loops\n");
+    for (i = 0, n = 0; i < NUM_HALF_CELLS; i++) {
+	if (prof->back[i]) {
+	    unsigned w = W(mem_get(besk->MEM, i)) & 0x7ff;
+	    uint64_t body = 0;
+	    for (j = w; j <= i; j++)
+		body += prof->exec[j];
+	    sort[n++] = (body << 11) | i;
+	}
+    }
+    qsort(sort, n, sizeof(uint64_t), prof_cmp_exec);
+    for (i = 0, cum = 0; (i < n) && (i < PROF_TOP); i++) {
+	unsigned a = sort[i] & 0x7ff;
+	unsigned w = W(mem_get(besk->MEM, a)) & 0x7ff;
+	uint64_t body = sort[i] >> 11;
+	double t = 0.0;
+	for (j = w; j <= (int)a; j++)
+	    t += prof->ticks[j]*ns_tick;
+	fprintf(f, "%03X-%03X %12lu iterations %12lu %6.2f%% %10.0fns\n",
+		w, a, prof->back[a], body, (100.0*body)/total, t);
+    }
+}
+
 // initailize step
 // load INS and check for STOP condition
 void besk_step0(besk_t* state)
 {
-    halvord_t INS = state->MEM[state->KR];
+    besk_decode_t* d;
 
-    if (H(INS) && (W(INS) & 1)) { // odd address and helord operation = STOP
+    if (state->tt)
+	tt_record(state);
+    d = besk_decode(state, state->KR);
+    if (d->flags & DECODE_STOP) {
 	// FIXME: OP must be updated to halvord operation in case of RE-START!
-	INS ^= HELORD_BIT;  // make halvord operation
 	state->running = 0; // force stop
     }
-    state->INS  = INS;
+    state->INS  = d->ins;
     state->ARP  = state->AR;
-    if (Z(INS)) { state->AR00=0; state->AR40=0; state->AR=0; state->SI=0; }
+    if (d->flags & DECODE_Z) {
+	state->AR00=0; state->AR40=0; state->AR=0; state->SI=0;
+    }
 }
 
 void besk_step(besk_t* state)
@@ -902,6 +1148,8 @@ void besk_step(besk_t* state)
     halvord_t AS;
     oktet_t   OP;
     oktet_t   SI;
+    besk_decode_t* d;
+    besk_decode_t  dtmp;
 
     // swap in
     MD   = state->MD;
@@ -914,7 +1162,13 @@ void besk_step(besk_t* state)
     ARP  = state->ARP; // previous AR (befor zero) when for operations
     SI   = state->SI;
     
-    AS = W(INS);
+    // INS may have been changed from the panel after besk_step0
+    d = &state->DEC[KR & 0x7ff];
+    if (!(d->flags & DECODE_VALID) || (d->ins != INS)) {
+	decode_instruction(&dtmp, INS, 0);
+	d = &dtmp;
+    }
+    AS = d->w;
     OP = O(INS);
 
     if ((OP & KONTROLL_BIT) &&
@@ -922,9 +1176,9 @@ void besk_step(besk_t* state)
 	// FIXME: kontrol utskrift
     }
     
-    switch(N(INS)) { // 00 - 1F
+    switch(d->n) { // 00 - 1F
     case OP_BAND:  // 0x00 - Bitwise AND. AR = (MD+AR) & MR
-	MD = ord_read(H(INS), AS, state->MEM);
+	MD = decode_read(d, state->MEM);
 	if (state->trace) trace_read(stdout, INS, MD);
 	AR = (MD+AR) & MR;
 	SI = 0;
@@ -938,7 +1192,7 @@ void besk_step(besk_t* state)
 	
     case OP_MUL: {  // 0x02 (AR,MR) = W*MR + AR*2^-39
 	helord_t H, L;
-	MD = ord_read(H(INS), AS, state->MEM);
+	MD = decode_read(d, state->MEM);
 	if (state->trace) trace_read(stdout, INS, MD);	
 	H = helord_muladd(MD, MR, 0, helord_sign_bit(AR), &L);
 
@@ -956,7 +1210,7 @@ void besk_step(besk_t* state)
 
     case OP_MULR: {  // 0x03: (AR,MR) = W*MR + 2^-40
 	helord_t H, L;
-	MD = ord_read(H(INS), AS, state->MEM);
+	MD = decode_read(d, state->MEM);
 	if (state->trace) trace_read(stdout, INS, MD);
 	H = helord_muladd(MD, MR, 0, HELORD_SIGN, &L);
 
@@ -976,7 +1230,7 @@ void besk_step(besk_t* state)
     case OP_ASHR: { // 0x04 | 0x44 OP_SHR
 	int k = AS & 0x3F;
 	if (k > 0) {  // k=0 == NOP!
-	    if (Z(INS)) // 0x44 undoes zeroing of AR using ARP
+	    if (d->flags & DECODE_Z) // 0x44 undoes zeroing of AR using ARP
 		AR = helord_shr40(ARP, AS, &AR40);
 	    else
 		AR = helord_ashr40(AR, AS, &AR40);
@@ -988,7 +1242,7 @@ void besk_step(besk_t* state)
     case OP_SHL: { // 0x05 | (0x45 OP_SHL40) Shift bits left (with AR40)
 	int k = AS & 0x3F;
 	if (k > 0) {  // k=0 == NOP!
-	    if (Z(INS)) { // 45 undoes zeroing of AR using ARP
+	    if (d->flags & DECODE_Z) { // 45 undoes zeroing of AR using ARP
 		AR = helord_shl00(ARP,1,&AR00) | AR40;
 		k--;
 		AR40 = 0;
@@ -1001,25 +1255,27 @@ void besk_step(besk_t* state)
     }
 
     case OP_ADDST:  // 0x06|0x26|0x46 OP_INCST (FIXME: write before STOP?)
-	MD = ord_read(H(INS), AS, state->MEM);
+	MD = decode_read(d, state->MEM);
 	if (state->trace) trace_read(stdout, INS, MD);	
-	if (Z(INS))
+	if (d->flags & DECODE_Z)
 	    SI = helord_add_oflw(MD, 0x0020000200, &AR);
 	else
 	    SI = helord_add_oflw(MD, AR, &AR);
 	// SI = AR00 != helord_sign_bit(AR);
 	ord_write(H(INS), AS, state->MEM, AR);
+	decode_invalidate(state, H(INS), AS);
 	if (state->trace) trace_write(stdout, AS, INS, AR);
 	break;
 	
     case OP_STORA:  // 0x07 [AS] &= addr(AR) ...
 	addr_write(H(INS), AS, state->MEM, AR);
+	decode_invalidate(state, H(INS), AS);
 	if (state->trace)
 	    trace_addr(stdout, AS, INS, state->MEM);
 	break;
 
     case OP_ADDMR:  // 0x08 AR += [AS]; MR = AR;
-	MD = ord_read(H(INS), AS, state->MEM);
+	MD = decode_read(d, state->MEM);
 	if (state->trace) trace_read(stdout, INS, MD);	
 	SI = helord_add_oflw(MD, AR, &AR);
 	// SI = AR00 != helord_sign_bit(AR);	
@@ -1027,7 +1283,7 @@ void besk_step(besk_t* state)
 	break;
 	
     case OP_SUBMR:  // 0x09 AR -= [AS]; MR = AR;
-	MD = ord_read(H(INS), AS, state->MEM);
+	MD = decode_read(d, state->MEM);
 	if (state->trace) trace_read(stdout, INS, MD);
 	SI = helord_add_oflw(helord_neg(MD), AR, &AR);
 	// SI = AR00 != helord_sign_bit(AR);
@@ -1042,7 +1298,7 @@ void besk_step(besk_t* state)
 	break;
 
     case OP_SUB:  // 0x0B AR -= W(AS)
-	MD = ord_read(H(INS), AS, state->MEM);
+	MD = decode_read(d, state->MEM);
 	if (state->trace) trace_read(stdout, INS, MD);
 	SI = helord_add_oflw(helord_neg(MD), AR, &AR);
 	// SI = AR00 != helord_sign_bit(AR);
@@ -1053,14 +1309,14 @@ void besk_step(besk_t* state)
 	goto swapout;
 	
     case OP_AADD:  // 0x0D AR += |[AS]|
-	MD = ord_read(H(INS), AS, state->MEM);
+	MD = decode_read(d, state->MEM);
 	if (state->trace) trace_read(stdout, INS, MD);
 	SI = helord_add_oflw(helord_abs(MD), AR, &AR);
 	// SI = AR00 != helord_sign_bit(AR);	
 	break;	
 
     case OP_JGE:  // 0x0E | 0x4E, JGE | JLT AS
-	if (Z(INS)) {
+	if (d->flags & DECODE_Z) {
 	    AR = ARP; // undo zeroing of AR
 	    if (AR < 0) {
 		KR = AS;
@@ -1076,14 +1332,14 @@ void besk_step(besk_t* state)
 	break;
 
     case OP_ASUB:  // 0x0F, AR -= |[AS]|
-	MD = ord_read(H(INS), AS, state->MEM);
+	MD = decode_read(d, state->MEM);
 	if (state->trace) trace_read(stdout, INS, MD);	
 	SI = helord_add_oflw(helord_neg(helord_abs(MD)), AR, &AR);
 	// SI = AR00 != helord_sign_bit(AR);	
 	break;	
 
     case OP_ADD:  // 0x10, AR += [AS], OP_LOAD = OP_ADD+ARZERO_BIT
-	MD = ord_read(H(INS), AS, state->MEM);
+	MD = decode_read(d, state->MEM);
 	if (state->trace) trace_read(stdout, INS, MD);
 	SI = helord_add_oflw(MD, AR, &AR);
 	// SI = AR00 != helord_sign_bit(AR);	
@@ -1091,12 +1347,13 @@ void besk_step(besk_t* state)
 
     case OP_STORE:  // 0x11, [AS] = AR
 	ord_write(H(INS), AS, state->MEM, AR);
+	decode_invalidate(state, H(INS), AS);
 	if (state->trace) trace_write(stdout, AS, INS, AR);
 	break;
 
     case OP_DIV: {   // 0x12, AR/[AS] Q=rev(MR), R=AR
 	helord_t q;
-	MD = ord_read(H(INS), AS, state->MEM);
+	MD = decode_read(d, state->MEM);
 	if (state->trace) trace_read(stdout, INS, MD);
 	q = helord_divrem(AR, MD, &AR);
 	MR = helord_reverse(q);
@@ -1110,30 +1367,19 @@ void besk_step(besk_t* state)
 	break;
 	
     case OP_READ5: // ONLY 0x74!!!: Read 5 channel paper tape
-	MD = telex_read_remsa(state->in, 1);
+	MD = read_5_channel_remsa(state, 1);
 	AR = MD;
 	ord_write(H(INS), AS, state->MEM, AR);
+	decode_invalidate(state, H(INS), AS);
 	if (state->trace) trace_write(stdout, AS, INS, AR);
 	SI = 0;
 	break;
 	
     case OP_NORM:  // NORM|NORM40 0x15|0x35  Normalize AR 
-	if (Z(INS)) {
+	if (d->flags & DECODE_Z) {
 	    AR = ARP;  // undo zeroing of AR
 	}
-    next:
-	if (AR != 0) {
-	    switch((AR >> 38) & 0x3) {
-	    case 1: case 2: break;  // done AR0 != AR1
-	    case 0: case 3:
-		AR <<= 1;
-		if (Z(INS)) {
-		    AR |= AR40;
-		    AR40 = 0;
-		}
-		goto next; // AR0 == AR1
-	    }
-	}
+	AR = helord_norm(AR, (d->flags & DECODE_Z) != 0, &AR40);
 	SI = 0;
 	break;
 
@@ -1167,13 +1413,14 @@ void besk_step(besk_t* state)
 	break;
 	
     case  OP_READ4x10: // 0x19|0x39 OP_READ4x1, read 10 hex rows
-	if (Z(INS))
+	if (d->flags & DECODE_Z)
 	    MD = read_4_channel_remsa(state, 1);
 	else
 	    MD = read_4_channel_remsa(state, 10);
 	AR = MD;
 	SI = 0;
 	ord_write(H(INS), AS, state->MEM, AR);
+	decode_invalidate(state, H(INS), AS);
 	if (state->trace) trace_write(stdout, AS, INS, AR);
 	break;
 
@@ -1201,6 +1448,10 @@ void besk_step(besk_t* state)
     }
     KR++;
 swapout:
+    if (state->rec)
+	besk_rec(state, state->KR, INS, AR, MR, SI);
+    if (state->prof)
+	prof_step(state->prof, state->KR, INS, KR, SI);
     // swapout
     state->MD   = MD;
     state->MR   = MR;
@@ -1209,202 +1460,444 @@ swapout:
     state->AR40 = AR40;
     state->KR   = KR;
     state->SI   = SI;
+    state->count++;
 }
 
-void usage()
-{
-    fprintf(stderr, "usage: besk [options] [file]\n");
-    fprintf(stderr, "OPTIONS\n");
-    fprintf(stderr, "  -a <addr>  start address\n");
-    fprintf(stderr, "  -e <addr>  end address\n");    
-    fprintf(stderr, "  -i <filename> of input  (INREMSA)\n");
-    fprintf(stderr, "  -u <filename> of output (UTREMSA)\n");
-    fprintf(stderr, "  -d <filename> of drum   (DRUM.dat)\n");    
-    fprintf(stderr, "  -s         single step\n");
-    fprintf(stderr, "  -t         trace instruction\n");    
-    fprintf(stderr, "  -S         Simulator\n");
-    fprintf(stderr, "  -q         do not run\n");
-    fprintf(stderr, "  -m r       dump registers\n");    
-    fprintf(stderr, "  -m m       dump memory\n");
-    fprintf(stderr, "  -m p       dump program\n");    
-    exit(1);
-}
+//
+// Threaded interpreter core
+//
+// Direct threaded (computed goto) version of besk_step0/besk_step,
+// running a burst of instructions with the registers kept in locals.
+// Each opcode is described once in besk_ops.h as OPC_<n>(HF,ZF,TF) where
+// HF, ZF and TF are the compile time H, Z and trace flags, the handlers for
+// all op/H/Z combinations (times trace on/off) are generated from that
+// description. The switch in besk_step is the reference implementation.
+//
 
-int clamp(int x, int a, int b)
-{
-    if (x < a) return a;
-    if (x > b) return b;
-    return x;
-}
+// dispatch index is INS & 0x7F = Z:1,H:1,N:5
+#define OPC_LABEL(n,h,z,t) &&L_##n##_##h##z##t,
+#define OPC_LABELS(t)				\
+    OPC_FOREACH(OPC_LABEL, 0, 0, t)		\
+    OPC_FOREACH(OPC_LABEL, 1, 0, t)		\
+    OPC_FOREACH(OPC_LABEL, 0, 1, t)		\
+    OPC_FOREACH(OPC_LABEL, 1, 1, t)
+
+// fetch instruction (besk_step0) and jump to its handler
+#define OPC_FETCH() do {						\
+	d = besk_decode(state, KR);					\
+	if (!(d->flags & DECODE_OP))					\
+	    dispatch_decode(state, d, KR);				\
+	stop = d->flags & DECODE_STOP;					\
+	INS = d->ins;							\
+	AS  = d->w;							\
+	ARP = AR;							\
+	goto *dispatch[d->op];						\
+    } while(0)
+
+// record executed instruction d in flight recorder and profile
+#define OPC_RECORD() do {						\
+	if (rec) {							\
+	    besk_rec_t* r_ = &rec[rec_pos++ & rec_mask];		\
+	    r_->KR = d - state->DEC; r_->INS = INS;			\
+	    r_->AR = AR; r_->MR = MR; r_->SI = SI;			\
+	}								\
+	if (prof)							\
+	    prof_step(prof, d - state->DEC, INS, KR, SI);		\
+    } while(0)
+
+#define OPC_DISPATCH() do {						\
+	OPC_RECORD();							\
+	if ((++count >= n) || stop) goto done;				\
+	OPC_FETCH();							\
+    } while(0)
+
+#define OPC_HANDLER(n,h,z,t)						\
+    L_##n##_##h##z##t:							\
+    if (z) { AR00 = 0; AR40 = 0; AR = 0; SI = 0; }			\
+    OPC_##n(h,z,t);							\
+    KR++;								\
+    OPC_DISPATCH();
+
+#define OPC_HANDLERS(t)				\
+    OPC_FOREACH(OPC_HANDLER, 0, 0, t)		\
+    OPC_FOREACH(OPC_HANDLER, 1, 0, t)		\
+    OPC_FOREACH(OPC_HANDLER, 0, 1, t)		\
+    OPC_FOREACH(OPC_HANDLER, 1, 1, t)
+
+//
+// Superinstructions
+//
+// Instruction sequences that are frequent in BESK programs are run as
+// one handler without going through the dispatch table between the
+// parts. The sequence is matched when the first instruction is
+// fetched (dispatch_decode) and d->op is set to FUSE_BASE+pattern. Each
+// part still counts as one instruction and advances KR, the budget is
+// checked between parts so single stepping stops on every instruction.
+// The following parts are checked again before they are run (the
+// first part may have modified them), if they no longer match the
+// handler continues with a normal fetch. Not used when tracing.
+//
+// FUSEn_FOREACH(X) name and N,H,Z of each part
+#define FUSE2_FOREACH(X)						\
+    X(MULR_ADDMR,    03,1,1, 08,0,0)  /* mulr.zh  addmr    */		\
+    X(ADDMR_MULR,    08,0,0, 03,1,1)  /* addmr    mulr.zh  */		\
+    X(ADDMR_MULR_HZ, 08,1,1, 03,1,1)  /* addmr.hz mulr.zh  */		\
+    X(LOAD_STORE_H,  10,1,1, 11,1,0)  /* load.h   store.h  */		\
+    X(LOAD_STORE,    10,0,1, 11,0,0)  /* load     store    */
+
+#define FUSE3_FOREACH(X)						\
+    X(LOAD_ADDST_JC, 10,1,1, 06,1,0, 0A,0,0) /* load.h addst.h jc */
+
+#define FUSE_BASE 0x80
+
+#define FUSE_INDEX(n,h,z) (((z)<<6)|((h)<<5)|0x##n)
+
+#define FUSE2_ENUM(name,n1,h1,z1,n2,h2,z2) FUSE_##name,
+#define FUSE3_ENUM(name,n1,h1,z1,n2,h2,z2,n3,h3,z3) FUSE_##name,
+enum {
+    FUSE3_FOREACH(FUSE3_ENUM)
+    FUSE2_FOREACH(FUSE2_ENUM)
+    FUSE_NUM
+};
 
-int main(int argc, char** argv)
+#define FUSE2_PATTERN(name,n1,h1,z1,n2,h2,z2)			\
+    { FUSE_INDEX(n1,h1,z1), FUSE_INDEX(n2,h2,z2), 0xFF },
+#define FUSE3_PATTERN(name,n1,h1,z1,n2,h2,z2,n3,h3,z3)		\
+    { FUSE_INDEX(n1,h1,z1), FUSE_INDEX(n2,h2,z2), FUSE_INDEX(n3,h3,z3) },
+static const uint8_t fuse_pattern[FUSE_NUM][3] = {
+    FUSE3_FOREACH(FUSE3_PATTERN)
+    FUSE2_FOREACH(FUSE2_PATTERN)
+};
+
+#define FUSE2_NAME(name,n1,h1,z1,n2,h2,z2) #name,
+#define FUSE3_NAME(name,n1,h1,z1,n2,h2,z2,n3,h3,z3) #name,
+static const char* fuse_name[FUSE_NUM] = {
+    FUSE3_FOREACH(FUSE3_NAME)
+    FUSE2_FOREACH(FUSE2_NAME)
+};
+
+// dispatch index for breakpoints and I/O instructions (return from besk_run)
+#define RUN_OP_BREAK (FUSE_BASE+FUSE_NUM)
+#define RUN_OP_IO    (FUSE_BASE+FUSE_NUM+1)
+
+// set dispatch index d->op for instruction at addr, a breakpoint, an I/O
+// instruction, the start of a superinstruction or the plain handler
+static void dispatch_decode(besk_t* state, besk_decode_t* d, unsigned addr)
 {
-    besk_t state;
-    FILE* f;
-    FILE* fin;
-    FILE* fut;
-    FILE* fdrum;
-    char* filename = "*stdin*";
-    char* utremsa_name = "UTREMSA";
-    char* inremsa_name = "INREMSA";
-    char* drum_name = "DRUM.dat";
-    halvord_t addr = 0x008;
-    halvord_t start = -1;
-    halvord_t end = -1;
-    int sim = 0;
-    int step = 0;
-    int quit = 0;
-    char* mdump = "";
-    int trace = 0;
-    int opt;
-    int xpos = 1, ypos = 1;
-    
-    while ((opt = getopt(argc, argv, "tSsqi:u:d:a:e:x:y:m:")) != -1) {
-	switch(opt) {
-	case 'a': {
-	    char* eptr;
-	    start = strtol(optarg, &eptr, 0);
-	    if (*eptr != '\0') usage();
-	    break;
+    int i, j;
+
+    d->flags |= DECODE_OP;
+    if (state->BRK[addr & 0x7ff]) {
+	d->op = RUN_OP_BREAK;
+	return;
+    }
+    switch(d->n) {
+    case 0x19:  // read4x10 | read4x1
+    case 0x1B:  // rd
+    case 0x1C:  // write4
+    case 0x1D:  // write
+    case 0x1F:  // wd
+	d->op = RUN_OP_IO;
+	return;
+    default:
+	break;
+    }
+    for (i = 0; i < FUSE_NUM; i++) {
+	for (j = 0; (j < 3) && (fuse_pattern[i][j] != 0xFF); j++) {
+	    besk_decode_t* dj = besk_decode(state, addr+j);
+	    if ((dj->flags & DECODE_STOP) || state->BRK[(addr+j) & 0x7ff] ||
+		((dj->ins & 0x7F) != fuse_pattern[i][j]))
+		break;
 	}
-	case 'e': {
-	    char* eptr;
-	    end = strtol(optarg, &eptr, 0);
-	    if (*eptr != '\0') usage();
-	    break;
-	}	    
-	case 'S':
-	    sim = 1;
-	    break;
-	case 's':
-	    step = 1;
-	    break;
-	case 'm':
-	    mdump = optarg;
-	    break;
-	case 't':
-	    trace = 1;
-	    break;
-	case 'i': // set inremsa
-	    inremsa_name = optarg;
-	    break;
-	case 'u': // set utremsa
-	    utremsa_name = optarg;
-	    break;
-	case 'd': // set drum memory file name
-	    drum_name = optarg;
-	    break;	    
-	case 'x':
-	    xpos = atoi(optarg);
-	    xpos = clamp(xpos, 1, 8);
-	    break;
-	case 'y':
-	    ypos = atoi(optarg);
-	    ypos = clamp(ypos, 1, 8);
-	    break;
-	case 'q':
-	    quit = 1;
-	    break;
-	default:
-	    usage();
+	if ((j == 3) || (fuse_pattern[i][j] == 0xFF)) {
+	    d->op = FUSE_BASE + i;
+	    return;
 	}
     }
+}
 
-    if (optind >= argc) {
-	f = stdin;
-	filename = "*stdin*";
+void dump_fused(FILE* f, besk_t* besk)
+{
+    int i;
+    for (i = 0; i < FUSE_NUM; i++) {
+	fprintf(f, "%-14s %lu", fuse_name[i], besk->fused[i]);
+	if (besk->count > 0)  // share of executed instructions
+	    fprintf(f, " (%.2f%%)", (100.0 * besk->fused[i] *
+				     ((fuse_pattern[i][2] == 0xFF) ? 2 : 3)) /
+		    besk->count);
+	fprintf(f, "\n");
     }
-    else {
-	if ((f = fopen(argv[optind], "r")) == NULL) {
-	    fprintf(stderr, "unable to open file %s\n", argv[optind]);
-	    usage();
+}
+
+// run one part of a superinstruction
+#define FUSE_PART(n,h,z) do {						\
+	if (z) { AR00 = 0; AR40 = 0; AR = 0; SI = 0; }			\
+	OPC_##n(h,z,0);							\
+	KR++;								\
+    } while(0)
+
+// fetch the next part, fall back to normal dispatch if it changed
+#define FUSE_NEXT(n2,h2,z2) do {					\
+	OPC_RECORD();							\
+	if (++count >= n) goto done;					\
+	d = &state->DEC[KR & 0x7ff];					\
+	if (((d->flags & (DECODE_VALID|DECODE_STOP)) != DECODE_VALID) ||	\
+	    ((d->ins & 0x7F) != FUSE_INDEX(n2,h2,z2)))			\
+	    OPC_FETCH();						\
+	INS = d->ins;							\
+	AS  = d->w;							\
+	ARP = AR;							\
+    } while(0)
+
+#define FUSE2_HANDLER(name,n1,h1,z1,n2,h2,z2)				\
+    F_##name:								\
+    state->fused[FUSE_##name]++;					\
+    FUSE_PART(n1,h1,z1);						\
+    FUSE_NEXT(n2,h2,z2);						\
+    FUSE_PART(n2,h2,z2);						\
+    OPC_DISPATCH();
+
+#define FUSE3_HANDLER(name,n1,h1,z1,n2,h2,z2,n3,h3,z3)			\
+    F_##name:								\
+    state->fused[FUSE_##name]++;					\
+    FUSE_PART(n1,h1,z1);						\
+    FUSE_NEXT(n2,h2,z2);						\
+    FUSE_PART(n2,h2,z2);						\
+    FUSE_NEXT(n3,h3,z3);						\
+    FUSE_PART(n3,h3,z3);						\
+    OPC_DISPATCH();
+
+// set or clear breakpoint at addr, superinstructions covering addr
+// are matched again on next fetch
+void besk_break(besk_t* state, unsigned addr, int on)
+{
+    int i;
+    state->BRK[addr & 0x7ff] = (on != 0);
+    for (i = 0; i < 3; i++) {
+	besk_decode_t* d = &state->DEC[(addr - i) & 0x7ff];
+	if (d->flags & DECODE_OP) {
+	    d->flags &= ~DECODE_OP;
+	    d->op = d->ins & 0x7F;
 	}
-	filename = argv[optind];
-    }
-    if ((fin = fopen(inremsa_name, "r")) == NULL) {
-	fprintf(stderr, "unable to open input paper tape file %s\n",
-		inremsa_name);
-	exit(1);
     }
-    if ((fut = fopen(utremsa_name, "w")) == NULL) {
-	fprintf(stderr, "unable to open output paper tape file %s\n",
-		utremsa_name);
-	exit(1);
+}
+
+// superinstruction labels, when tracing the first part is run alone
+#define FUSE2_LABEL(name,n1,h1,z1,n2,h2,z2) &&F_##name,
+#define FUSE3_LABEL(name,n1,h1,z1,n2,h2,z2,n3,h3,z3) &&F_##name,
+#define FUSE2_TLABEL(name,n1,h1,z1,n2,h2,z2) &&L_##n1##_##h1##z1##1,
+#define FUSE3_TLABEL(name,n1,h1,z1,n2,h2,z2,n3,h3,z3) &&L_##n1##_##h1##z1##1,
+
+// registers saved at the last taken jump (idle loop detection)
+#define IDLE_SAVE() do {						\
+	idle_kr = KR; idle_side = side;					\
+	iMD = MD; iMR = MR; iAR = AR; iAR00 = AR00; iAR40 = AR40; iSI = SI; \
+    } while(0)
+
+#define IDLE_SAME()							\
+    ((side == idle_side) && (AR == iAR) && (MR == iMR) && (MD == iMD) && \
+     (AR00 == iAR00) && (AR40 == iAR40) && (SI == iSI))
+
+// Execute at most max_instructions (> 0) starting at KR with the
+// registers kept in locals. Returns after a STOP instruction or an
+// error (running = 0), when the budget is used up or before executing
+// an I/O instruction or an instruction at a breakpoint. The caller runs
+// those with besk_step0/besk_step.
+// A jump back to the target of the previous taken jump with the same
+// registers and without any store or f instruction in between repeats
+// forever, besk_run returns BESK_RUN_IDLE with KR at the jump target.
+besk_run_t besk_run(besk_t* state, uint64_t max_instructions)
+{
+    static void* const dispatch_tab[2][RUN_OP_IO+1] = {
+	{ OPC_LABELS(0)
+	  FUSE3_FOREACH(FUSE3_LABEL) FUSE2_FOREACH(FUSE2_LABEL)
+	  &&brk, &&io },
+	{ OPC_LABELS(1)
+	  FUSE3_FOREACH(FUSE3_TLABEL) FUSE2_FOREACH(FUSE2_TLABEL)
+	  &&brk, &&io }
+    };
+    besk_run_t r;
+    uint64_t n = max_instructions;
+    void* const* dispatch = dispatch_tab[state->trace != 0];
+    besk_mem_t* MEM = state->MEM;
+    helord_t MD   = state->MD;
+    helord_t MR   = state->MR;
+    helord_t AR   = state->AR;
+    helord_t ARP  = state->ARP;
+    oktet_t  AR00 = state->AR00;
+    oktet_t  AR40 = state->AR40;
+    oktet_t  SI   = state->SI;
+    halvord_t KR  = state->KR;
+    halvord_t INS = state->INS;
+    halvord_t AS;
+    besk_decode_t* d;
+    uint64_t count = 0;
+    int stop = 0;
+    int reason = BESK_RUN_BUDGET;
+    uint64_t side = 0;  // stores and f instructions
+    uint64_t idle_side = 0;
+    halvord_t idle_kr = -1;
+    besk_rec_t* rec = state->rec;
+    uint32_t rec_mask = state->rec_mask;
+    uint64_t rec_pos = state->rec_pos;
+    besk_prof_t* prof = state->prof;
+    helord_t iMD = 0, iMR = 0, iAR = 0;
+    oktet_t  iAR00 = 0, iAR40 = 0, iSI = 0;
+
+    OPC_FETCH();
+
+    OPC_HANDLERS(0)
+    OPC_HANDLERS(1)
+    FUSE3_FOREACH(FUSE3_HANDLER)
+    FUSE2_FOREACH(FUSE2_HANDLER)
+
+jump:
+    OPC_RECORD();
+    if ((++count >= n) || stop) goto done;
+    if ((KR == idle_kr) && IDLE_SAME()) {
+	reason = BESK_RUN_IDLE;
+	goto done;
     }
-    if ((fdrum = fopen(drum_name, "rw")) == NULL) {
-	fprintf(stderr, "unable to open output drum file %s\n",
-		drum_name);
-	exit(1);
+    IDLE_SAVE();
+    OPC_FETCH();
+
+brk:
+    reason = BESK_RUN_BREAK;
+    stop = 0;
+    goto done;
+io:
+    reason = BESK_RUN_IO;
+    stop = 0;
+done:
+    if (stop && (reason == BESK_RUN_BUDGET)) {
+	state->running = 0;
+	reason = BESK_RUN_STOP;
     }
-    
-    memset(&state, 0, sizeof(state));
-    state.Fpos_x = xpos;
-    state.Fpos_y = ypos;
-    state.quit = quit;
-    // state.page = TELEX_PAGE_LTR; // do we start here?
+    state->MD   = MD;
+    state->MR   = MR;
+    state->AR   = AR;
+    state->ARP  = ARP;
+    state->AR00 = AR00;
+    state->AR40 = AR40;
+    state->SI   = SI;
+    state->KR   = KR;
+    state->INS  = INS;
+    state->count += count;
+    state->rec_pos = rec_pos;
+    r.reason = reason;
+    r.count  = count;
+    return r;
+}
+
+// Clear registers, memory and devices and load the constants at
+// 0x000-0x007, the machine is stopped. The recorder buffer is kept
+// (emptied), translated code and profile are released.
+void besk_reset(besk_t* state)
+{
+    besk_rec_t* rec = state->rec;
+    uint32_t rec_mask = state->rec_mask;
+    char* rec_name = state->rec_name;
+
+    jit_destroy(state);
+    tt_destroy(state);
+    io_destroy(state);
+    free(state->prof);
+    memset(state, 0, sizeof(besk_t));
+    state->rec = rec;
+    state->rec_mask = rec_mask;
+    state->rec_name = rec_name;
+    state->Fpos_x = 1;
+    state->Fpos_y = 1;
+    state->gang_pos = GANG_RUN;
+    state->kontroll_utskrift_pos = KONTROLL_UTSKRIFT_OFF;
     // load constants (should be from paper tape? | drum memory?)
-    helord_write(0x000, state.MEM, 0x0020000200);
-    helord_write(0x002, state.MEM, 0x0010000100);
-    helord_write(0x004, state.MEM, 0x8000000001);
-    helord_write(0x006, state.MEM, 0x0000000839);
-
-    addr = load_code(f, filename, 0, addr, state.MEM);
-    if ((addr < 0) && (start < 0)) {
-	fprintf(stderr, "neither program or start address is given\n");
-	usage();
-    }
-    if (f != stdin)
-	fclose(f);
-    state.in = fin;
-    state.ut = fut;
-    state.drum = fdrum;
-
-    if (sim) {
-	SIMULATOR_INIT(argc, argv, &state);
-    }
-    if (step)
-	state.gang_pos = GANG_STEP;
-    else
-	state.gang_pos = GANG_RUN;
-    state.kontroll_utskrift_pos = KONTROLL_UTSKRIFT_OFF;
+    mem_helord_write(0x000, state->MEM, 0x0020000200);
+    mem_helord_write(0x002, state->MEM, 0x0010000100);
+    mem_helord_write(0x004, state->MEM, 0x8000000001);
+    mem_helord_write(0x006, state->MEM, 0x0000000839);
+}
 
-    state.trace = trace;
-    
-    state.running = 1;
-    state.KR = (start<0) ? addr : start;
-
-    while(!state.quit) {
-	if (state.running) {
-	    besk_step0(&state);
-	    if (abs(state.gang_pos) == GANG_STEP) {
-		if (sim) { SIMULATOR_RUN(&state); }
-		if (abs(state.kontroll_utskrift_pos) == KONTROLL_UTSKRIFT_STEGVIS) {
-		    state.trace = 1; // memory trace as well
-		    besk_trace(stdout, &state);
-		}
-		besk_step(&state);
-		state.running = 0;
-		state.trace = 0;		
-	    }
-	    else {
-		besk_step(&state);
-		if (sim) { SIMULATOR_RUN(&state); }
+// hot core in the first cache line, hooks in the second
+_Static_assert(offsetof(besk_t, trace) < 64, "besk_t hot core");
+_Static_assert(offsetof(besk_t, tt) == 64, "besk_t hooks");
+
+// Create a reset machine without recorder or profile, cache line
+// aligned. The caller sets in, ut and drum.
+besk_t* besk_create(void)
+{
+    besk_t* state;
+
+    if ((state = aligned_alloc(64, sizeof(besk_t))) == NULL)
+	return NULL;
+    memset(state, 0, sizeof(besk_t));
+    besk_reset(state);
+    return state;
+}
+
+// Assemble program from f into memory, return the first address
+// given in the program or -1 on error.
+halvord_t besk_load(besk_t* state, FILE* f, char* filename, int verbose)
+{
+    besk_asm_t* as;
+    halvord_t addr;
+    int i;
+
+    if ((as = malloc(sizeof(besk_asm_t))) == NULL)
+	return -1;
+    besk_asm_init(as, verbose);
+    addr = load_code(as, f, filename, 0, 0x008, state->MEM);
+    besk_asm_free(as);
+    free(as);
+    // memory is rewritten behind the decode cache and translated code
+    jit_destroy(state);
+    for (i = 0; i < NUM_HALF_CELLS; i++)
+	state->DEC[i].flags = 0;
+    return addr;
+}
+
+// Run at most max_instructions on core until STOP, error, an idle loop,
+// a breakpoint or a full function display queue. The threaded core
+// leaves I/O instructions to besk_step, a breakpoint at KR when called
+// is passed. Returns the reason and number of executed instructions.
+besk_run_t besk_exec(besk_t* state, int core, uint64_t max_instructions)
+{
+    besk_run_t r = { BESK_RUN_BUDGET, 0 };
+    uint64_t count0 = state->count;
+
+    while (state->running && ((state->count - count0) < max_instructions)) {
+	uint64_t n = max_instructions - (state->count - count0);
+	if (core == BESK_CORE_THREADED) {
+	    r = besk_run(state, n);
+	    if ((r.reason == BESK_RUN_IO) ||
+		((r.reason == BESK_RUN_BREAK) && (state->count == count0))) {
+		besk_step0(state);
+		besk_step(state);
 	    }
+	    else if (r.reason != BESK_RUN_BUDGET)
+		break;
 	}
+	else if (core == BESK_CORE_JIT)
+	    jit_run(state, n);
 	else {
-	    if (sim) { SIMULATOR_RUN(&state); }
-	    else { state.quit = 1; }
+	    besk_step0(state);
+	    besk_step(state);
 	}
     }
-    if (mdump) {
-	while(*mdump) {
-	    switch(*mdump) {
-	    case 'r': dump_registers(stdout, &state); break;
-	    case 'm': dump_mem(stdout, start, end, state.MEM); break;
-	    case 'p': dump_prog(stdout, start, end, state.MEM); break;
-	    }
-	    mdump++;
-	}
-    }
-    exit(0);
+    if (!state->running && (r.reason == BESK_RUN_BUDGET))
+	r.reason = BESK_RUN_STOP;
+    r.count = state->count - count0;
+    return r;
+}
+
+// release machine, the caller closes in, ut and drum
+void besk_destroy(besk_t* state)
+{
+    if (state == NULL)
+	return;
+    jit_destroy(state);
+    tt_destroy(state);
+    io_destroy(state);
+    free(state->prof);
+    free(state->rec);
+    free(state);
 }
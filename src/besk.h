@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "helord.h"
 #include "halvord.h"
@@ -11,6 +12,22 @@ typedef uint8_t oktet_t;    // 8-bit
 
 #define NUM_HALF_CELLS (2048)      // number of halfcells in core memory
 
+// Core memory layout. By default MEM is one halvord_t per cell. With
+// BESK_PACKED_MEM each even/odd cell pair is one 64 bit word, the pair
+// as helord_read returns it: the even cell sign extended from bit 51
+// down to bit 20 (a stored helord with bits above 39 leaves more than
+// 20 bits in the even cell) and the odd cell in bits 19..0, odd cells
+// never hold more than 20 bits. The extra last word takes the odd half
+// of a helord written at 0x7ff. Cells are accessed with mem_get and
+// mem_set, helords with mem_helord_read and mem_helord_write.
+#ifdef BESK_PACKED_MEM
+typedef helord_t besk_mem_t;
+#define NUM_MEM_WORDS (NUM_HALF_CELLS/2+1)
+#else
+typedef halvord_t besk_mem_t;
+#define NUM_MEM_WORDS NUM_HALF_CELLS
+#endif
+
 #define KONTROLL_BIT 0x80          // kontroll utskrift if switch is set
 #define ARZERO_BIT   0x40
 #define HELORD_BIT   0x20
@@ -24,47 +41,297 @@ typedef uint8_t oktet_t;    // 8-bit
 
 #define MAKE_OP(W,Z,H,N) (((W)<<8)|(((Z)&1)<<6)|(((H)&1)<<5)|((N)&0x1F))
 
+// predecoded instruction, one per MEM cell, filled lazily by besk_step0
+// and invalidated when the cell is written.
+#define DECODE_VALID 0x01
+#define DECODE_H     0x02  // H(ins)
+#define DECODE_Z     0x04  // Z(ins)
+#define DECODE_STOP  0x08  // odd address helord operation (H bit removed)
+#define DECODE_JIT   0x10  // cell is part of translated code (besk_jit.c)
+#define DECODE_OP    0x20  // op set for besk_run (dispatch_decode)
+
+#define FQUEUE_SIZE  4096  // function display points queued by besk_run
+
+// function display point
+typedef struct
+{
+    helord_t x;
+    helord_t y;
+    uint8_t  op;      // 1=dot, 2=circle
+} besk_fpoint_t;
+
+// per address profile, enabled with -p (besk_step and besk_run). Host
+// ticks are sampled, one instruction in about period is timed and its
+// ticks are counted period times.
+typedef struct
+{
+    uint64_t exec[NUM_HALF_CELLS];   // executed instructions at KR
+    uint64_t ticks[NUM_HALF_CELLS];  // host ticks spent at KR (sampled)
+    uint64_t read[NUM_HALF_CELLS];   // operand reads of cell
+    uint64_t write[NUM_HALF_CELLS];  // operand writes of cell
+    uint64_t si[NUM_HALF_CELLS];     // instructions at KR setting SI
+    uint64_t back[NUM_HALF_CELLS];   // backward jumps taken at KR (loop end)
+    uint64_t op_exec[256];           // executed instructions per O(INS)
+    uint64_t op_ticks[256];          // host ticks per O(INS) (sampled)
+    uint64_t tick0;                  // ticks and ns at start
+    uint64_t ns0;
+    uint64_t tick;                   // start of the timed instruction or 0
+    uint64_t seed;                   // sample interval generator
+    uint32_t period;                 // mean sample interval, 0 no timing
+    uint32_t sample;                 // instructions to next sample
+} besk_prof_t;
+
+// flight recorder entry, registers after the instruction at KR
+typedef struct
+{
+    halvord_t KR;
+    halvord_t INS;
+    helord_t  AR;
+    helord_t  MR;
+    oktet_t   SI;
+} besk_rec_t;
+
+#define REC_SIZE     65536  // default number of recorded instructions
+
+#define TT_MAX_SIZE  (1u << 31)  // max time travel keyframes and deltas
+
+#define FUSE_MAX     8     // max number of superinstruction patterns (FUSE_NUM)
+
 typedef struct
 {
-    helord_t  MD;     // multiplikand. MDV+MDH, MD0,MD1...MD39
-    helord_t  MR;     // multiplikator    
-    helord_t  AR;     // ackumulator.  ARV+ARH  AR0,AR1,....,AR39 (spill)
-    helord_t  ARP;    // previous AR (used when AR may be set=0 by op)
-    oktet_t   AR00;   // store in AR?
-    oktet_t   AR40;   // store in AR?
-    oktet_t   SI;     // spillindikation
-
-    halvord_t KR;     // Kontrollregister
-    halvord_t INS;    // Instruktion AS + OP
-    helord_t  BR;     // Binärräknare (???)
+    halvord_t ins;    // instruction as executed
+    uint16_t  w;      // W(ins)
+    uint16_t  addr;   // W(ins) & 0x7ff (cyclic memory)
+    uint8_t   n;      // N(ins) handler index
+    uint8_t   flags;  // DECODE_xxx
+    uint8_t   op;     // besk_run dispatch index, INS & 0x7F, I/O, break..
+} besk_decode_t;
+
+// Machine state. The registers and the run state used by every step
+// (besk_step0, besk_step, besk_run) form a hot core at the start, in
+// the first cache line, followed by the per step hooks. Devices,
+// function display, knobs and tool state are kept apart (cold) and MEM
+// starts on its own cache line. Allocate with besk_create (64 byte
+// aligned).
+typedef struct
+{
+    // hot core
+    struct {
+	helord_t  MD;     // multiplikand. MDV+MDH, MD0,MD1...MD39
+	helord_t  MR;     // multiplikator
+	helord_t  AR;     // ackumulator.  ARV+ARH  AR0,AR1,....,AR39 (spill)
+	helord_t  ARP;    // previous AR (used when AR may be set=0 by op)
+	halvord_t KR;     // Kontrollregister
+	halvord_t INS;    // Instruktion AS + OP
+	oktet_t   AR00;   // store in AR?
+	oktet_t   AR40;   // store in AR?
+	oktet_t   SI;     // spillindikation
+	int       running; // 0 = stopped, 1 = runnnig
+	uint64_t  count;  // number of executed instructions
+	int       trace;  // instruction trace output
+	// per step hooks, second cache line
+	void*     tt;     // time travel log (besk_tt.c)
+	besk_rec_t* rec;  // flight recorder ring or NULL
+	uint32_t  rec_mask; // ring size-1 (power of two)
+	uint64_t  rec_pos;  // number of recorded instructions
+	besk_prof_t* prof; // profile or NULL
+	void*     jit;    // translated code (besk_jit.c)
+	void*     io;     // device record or replay log (besk_io.c)
+    } __attribute__((aligned(64)));
+    // cold, devices, display, knobs and tools
+    struct {
+	helord_t  BR;     // Binärräknare (???)
+	void* user_data;  // emulator etc
+	char* rec_name;   // dump file
+	// paper tape / printer
+	FILE* in;         // inremsa
+	FILE* ut;         // utremsa
+	int page;         // telex page code (0=undefined)
+	// drum memory
+	FILE* drum;
+	// Function display
+	uint8_t  Fpos_x;  // 1,2,3,4,5,6,8 (scale factor x)
+	uint8_t  Fpos_y;  // 1,2,3,4,5,6,8 (scale factor y)
+	helord_t Fx;
+	helord_t Fy;
+	helord_t Fop;  // 0=no ouput, 1=dot, 2=circle
+	int fq_on;        // queue points instead of waiting for the display
+	unsigned fq_len;  // number of queued points
+	besk_fpoint_t fq[FQUEUE_SIZE];
+	int utmatning_pos;          // 0...35 = 0,10,20...,350 degree
+	int kontroll_utskrift_pos;  // 0..35
+	int gang_pos;               // 0..35
+	int quit;         // terminate
+	uint64_t fused[FUSE_MAX]; // superinstruction counts (besk_run)
+    };
     // 2048 halfword memory cells left cells vhac is located on even addresses
     // and hhac are located in odd addresses
-    void* user_data;  // emulator etc
-    // paper tape / printer
-    FILE* in;         // inremsa
-    FILE* ut;         // utremsa
-    int page;         // telex page code (0=undefined)    
-    // drum memory
-    FILE* drum;
-    // Function display
-    uint8_t  Fpos_x;   // 1,2,3,4,5,6,8 (scale factor x)
-    uint8_t  Fpos_y;   // 1,2,3,4,5,6,8 (scale factor y)
-    helord_t Fx;
-    helord_t Fy;
-    helord_t Fop;  // 0=no ouput, 1=dot, 2=circle
-    int utmatning_pos;          // 0...35 = 0,10,20...,350 degree
-    int kontroll_utskrift_pos;  // 0..35
-    int gang_pos;               // 0..35
-    int         running; // 0 = stopped, 1 = runnnig
-    int         trace;    // instruction trace output
-    int         quit;     // terminate
-    halvord_t   MEM[NUM_HALF_CELLS];
+    besk_mem_t  MEM[NUM_MEM_WORDS] __attribute__((aligned(64)));
+    besk_decode_t DEC[NUM_HALF_CELLS];  // predecoded MEM
+    uint8_t     BRK[NUM_HALF_CELLS];    // breakpoints (besk_run)
 } besk_t;
 
+#define MAX_NUM_LABELS  (1024)
+#define MAX_NUM_PATCHES (1024)
+#define UNRESOLVED (-1)
+
+// assembler context, labels and forward references of one load_code
+typedef struct
+{
+    int verbose;      // print assembler debug output on stdout
+    int num_labels;
+    struct {
+	char* name;   // label name (without ':')
+	int   len;    // length of label name
+	halvord_t addr;  // address (0..2047) or UNRESOLVED
+    } label[MAX_NUM_LABELS];
+    int num_patches;
+    struct {
+	int lbl;      // label index with unresolved label
+	int addr;     // address of unresolved label
+    } patch[MAX_NUM_PATCHES];
+} besk_asm_t;
+
+// host time in ns
+static inline uint64_t besk_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*(uint64_t)1000000000 + t.tv_nsec;
+}
+
+// host time stamp counter, cpu cycles on x86-64 else ns
+static inline uint64_t besk_ticks(void)
+{
+#if defined(__x86_64__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    return besk_ns();
+#endif
+}
+
+// record instruction in flight recorder
+static inline void besk_rec(besk_t* state, halvord_t KR, halvord_t INS,
+			    helord_t AR, helord_t MR, oktet_t SI)
+{
+    besk_rec_t* r = &state->rec[state->rec_pos++ & state->rec_mask];
+    r->KR = KR; r->INS = INS; r->AR = AR; r->MR = MR; r->SI = SI;
+}
+
+// decode instruction word into predecoded form, fetch=1 applies the
+// STOP conversion done when besk_step0 fetches the instruction from MEM
+static inline void decode_instruction(besk_decode_t* d, halvord_t INS, int fetch)
+{
+    uint8_t flags = DECODE_VALID;
+
+    if (fetch && H(INS) && (W(INS) & 1)) { // odd address and helord operation = STOP
+	INS ^= HELORD_BIT;  // make halvord operation
+	flags |= DECODE_STOP;
+    }
+    if (H(INS)) flags |= DECODE_H;
+    if (Z(INS)) flags |= DECODE_Z;
+    d->ins   = INS;
+    d->w     = W(INS);
+    d->addr  = W(INS) & 0x7ff;
+    d->n     = N(INS);
+    d->flags = flags;
+    d->op    = INS & 0x7F;
+}
+
+// memory cell addr (0..0x7ff) as halvord
+static inline halvord_t mem_get(const besk_mem_t* mem, unsigned addr)
+{
+#ifdef BESK_PACKED_MEM
+    if (addr & 1)
+	return mem[addr>>1] & HALVORD_MASK;
+    return (halvord_t) (mem[addr>>1] >> 20);
+#else
+    return mem[addr];
+#endif
+}
+
+static inline void mem_set(besk_mem_t* mem, unsigned addr, halvord_t value)
+{
+#ifdef BESK_PACKED_MEM
+    helord_t* w = &mem[addr>>1];
+    if (addr & 1)
+	*w = (*w & ~(helord_t)HALVORD_MASK) | (value & HALVORD_MASK);
+    else
+	*w = ((helord_t)(int64_t) value << 20) | (*w & HALVORD_MASK);
+#else
+    mem[addr] = value;
+#endif
+}
+
+// helord_read and helord_write on MEM, addr is even for operands
+static inline helord_t mem_helord_read(unsigned addr, const besk_mem_t* mem)
+{
+#ifdef BESK_PACKED_MEM
+    if (addr & 1)
+	return ((helord_t)(int64_t) mem_get(mem, addr) << 20) |
+	    (mem[(addr+1)>>1] >> 20 & HALVORD_MASK);
+    return mem[addr>>1];
+#else
+    return helord_read(addr, (halvord_t*) mem);
+#endif
+}
+
+static inline void mem_helord_write(unsigned addr, besk_mem_t* mem,
+				    helord_t value)
+{
+#ifdef BESK_PACKED_MEM
+    addr &= 0x7ff; // ignore top bit! (cyclic memory!)
+    if (addr & 1) {
+	mem_set(mem, addr, (halvord_t)(value >> 20));
+	mem_set(mem, addr+1, (halvord_t)(value & HALVORD_MASK));
+    }
+    else  // even cell keeps bits 51..20 as the halvord_t did
+	mem[addr>>1] = (helord_t)((int64_t)(value << 12) >> 12);
+#else
+    helord_write(addr, mem, value);
+#endif
+}
+
+// return predecoded instruction at addr, decode if needed
+static inline besk_decode_t* besk_decode(besk_t* state, unsigned addr)
+{
+    besk_decode_t* d = &state->DEC[addr & 0x7ff];
+    if (!(d->flags & DECODE_VALID))
+	decode_instruction(d, mem_get(state->MEM, addr & 0x7ff), 1);
+    return d;
+}
 #define GANG_STEP        7
+
 #define GANG_RUN         10
 #define GANG_VARIABLE    2
 
+// interpreter core
+#define BESK_CORE_SWITCH   0   // besk_step (reference)
+#define BESK_CORE_THREADED 1   // besk_run
+#define BESK_CORE_JIT      2   // jit_run (x86-64 only)
+#define BESK_CORE_SIMD     3   // simd_exec, lockstep over machines
+
+// besk_run return reason
+#define BESK_RUN_BUDGET    0   // max_instructions executed
+#define BESK_RUN_STOP      1   // STOP instruction executed (running=0)
+#define BESK_RUN_ERROR     2   // undefined instruction (running=0)
+#define BESK_RUN_IO        3   // KR at I/O instruction, not executed
+#define BESK_RUN_BREAK     4   // KR at breakpoint, not executed
+#define BESK_RUN_DISPLAY   5   // function display queue is full
+#define BESK_RUN_IDLE      6   // KR at head of a loop without side effects
+
+typedef struct
+{
+    int      reason;  // BESK_RUN_xxx
+    uint64_t count;   // number of executed instructions
+} besk_run_t;
+
+// run function of a program translated by besk2c, runs at most n
+// instructions and returns the number executed
+typedef uint64_t (*besk_aot_run_t)(besk_t* state, uint64_t n);
+
 #define KONTROLL_UTSKRIFT_OFF         2
 #define KONTROLL_UTSKRIFT_E2_UTSKRIFT 4
 #define KONTROLL_UTSKRIFT_STEGVIS     0
@@ -117,10 +384,79 @@ typedef struct
 #define OP_WD      0x1F
 
 
+// device log record kinds (besk_io.c)
+#define IO_READ5     1  // 5 channel tape word (telex_read_remsa)
+#define IO_READ4     2  // 4 channel tape word (read_4_channel_remsa)
+#define IO_DRUM      3  // drum channel read by RD
+#define IO_PUNCH4    4  // hex digit punched (write_4_channel_remsa)
+#define IO_PUNCH     5  // character punched (write_tecken_remsa)
+#define IO_DRUM_SAME 6  // drum channel read by RD, as last read
+#define IO_NUM_KINDS 7
+
 // drum memory size = 256 * 32 * 5 = 40960 bytes
 #define DRUM_CHANNEL_SIZE  0x40  // 64 halfwords per channel
 #define DRUM_CHANNEL_BYTES ((DRUM_CHANNEL_SIZE/2)*5)  // 32*5 = 160 bytes per channel
 #define DRUM_NUM_CHANNELS       0x100  // 256
 #define DRUM_MAX_CHANNEL_NUMBER 0x1FE  // 510
 
+// machine
+extern besk_t*  besk_create(void);
+extern void     besk_reset(besk_t* state);
+extern halvord_t besk_load(besk_t* state, FILE* f, char* filename, int verbose);
+extern besk_run_t besk_exec(besk_t* state, int core, uint64_t max_instructions);
+extern void     besk_destroy(besk_t* state);
+extern int      besk_save(besk_t* state, char* path);
+extern int      besk_restore(besk_t* state, char* path);
+extern int      besk_explore(besk_t* state, int core, FILE* f, char* filename,
+			     int jobs, uint64_t max_instructions, FILE* out);
+// assembler
+extern void     besk_asm_init(besk_asm_t* as, int verbose);
+extern void     besk_asm_free(besk_asm_t* as);
+extern halvord_t load_code(besk_asm_t* as, FILE* f, char* filename, int ln,
+			   halvord_t addr, besk_mem_t* mem);
+// dump
+extern void     besk_trace(FILE* f, besk_t* state);
+extern void     dump_mem(FILE* f, halvord_t addr0, halvord_t addr1, besk_mem_t* mem);
+extern void     dump_prog(FILE* f, halvord_t addr0, halvord_t addr1, besk_mem_t* mem);
+extern void     dump_registers(FILE* f, besk_t* besk);
+extern void     dump_speed(FILE* f, besk_t* besk,
+			   struct timespec* t0, struct timespec* t1);
+extern void     dump_state(FILE* f, besk_t* besk);
+extern void     dump_fused(FILE* f, besk_t* besk);
+extern char*    format_instruction(oktet_t OP, halvord_t AS, char* buf,
+				   size_t buflen);
+// cores
+extern void     besk_step0(besk_t* state);
+extern void     besk_step(besk_t* state);
+extern besk_run_t besk_run(besk_t* state, uint64_t max_instructions);
+extern void     besk_break(besk_t* state, unsigned addr, int on);
+extern besk_prof_t* prof_create(uint32_t period);
+extern void     dump_prof(FILE* f, besk_t* besk);
+extern void     dump_prof_csv(FILE* f, besk_t* besk);
+extern int      besk_rec_init(besk_t* state, uint32_t size);
+extern void     besk_rec_dump(FILE* f, besk_t* state);
+extern int      besk_rec_save(besk_t* state);
+extern uint64_t jit_run(besk_t* state, uint64_t n);
+extern void     jit_invalidate(besk_t* state, unsigned addr);
+extern int      besk_tt_init(besk_t* state, uint64_t interval,
+			     uint32_t keyframes, uint32_t deltas);
+extern int      besk_tt_seek(besk_t* state, uint64_t n);
+extern int64_t  besk_tt_last_write(besk_t* state, unsigned addr);
+extern void     tt_record(besk_t* state);
+extern void     tt_destroy(besk_t* state);
+extern void     jit_destroy(besk_t* state);
+extern int      besk_io_open(besk_t* state, char* path, int replay);
+extern void     io_destroy(besk_t* state);
+extern int      io_replaying(besk_t* state);
+extern int      io_get(besk_t* state, int kind, void* data);
+extern void     io_put(besk_t* state, int kind, const void* data);
+extern int      io_word_get(besk_t* state, int kind, helord_t* xp);
+extern void     io_word_put(besk_t* state, int kind, helord_t x);
+extern int      io_drum_get(besk_t* state, int channel, uint8_t* data);
+extern void     io_drum_put(besk_t* state, int channel, const uint8_t* data);
+extern int      besk_aot_main(int argc, char** argv, const halvord_t* image,
+			      halvord_t start, besk_aot_run_t run);
+extern uint64_t simd_exec(besk_t** lane, besk_run_t* r, int n, int core,
+			  uint64_t max_instructions);
+
 #endif
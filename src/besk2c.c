@@ -0,0 +1,373 @@
+//
+//  besk2c, ahead of time translation of a BESK program to C
+//
+//  The program is loaded as by besk and the code reachable from the
+//  start address is found by following the jumps, both ways of every
+//  jump (a jmp is often followed by the return point of a subroutine).
+//  Each straight line run of code from a jump target, or the cell after
+//  a jump, is emitted as a block of C using the OPC_<n> operations of
+//  besk_ops.h with the instruction word, H, Z and address constant. The
+//  blocks are chained with goto when the jump target is known, KR is
+//  dispatched through a switch otherwise.
+//
+//  Every instruction checks that its cell still holds the translated
+//  word, a changed cell (self modifying code, RD or a store) and any
+//  cell without a block is run by besk_step0/besk_step, as are I/O, f,
+//  undefined operations and STOP. The budget is checked on block entry.
+//
+//  The output is compiled with the headers of libbesk and linked with
+//  it, the program then runs as besk with the translated code as core:
+//
+//     besk2c -o prog.c prog.bsk
+//     gcc -O2 -I src -o prog prog.c bin/libbesk.a -lm
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "besk.h"
+
+#define CELL_CODE   0x01  // reached from the start address
+#define CELL_LEADER 0x02  // a block starts here
+
+static uint8_t cell[NUM_HALF_CELLS];
+
+void usage()
+{
+    fprintf(stderr, "usage: besk2c [options] [file]\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "  -a <addr>  start address\n");
+    fprintf(stderr, "  -o <file>  output C file (stdout)\n");
+    fprintf(stderr, "  -v         assembler debug output\n");
+    exit(1);
+}
+
+// left to besk_step: I/O, f, undefined operations and STOP
+static int is_step(besk_decode_t* d)
+{
+    if (d->flags & DECODE_STOP)
+	return 1;
+    switch(d->n) {
+    case OP_READ5_:
+    case OP_UNDEF16:
+    case OP_UNDEF17:
+    case OP_FUNC:
+    case OP_READ4x10:
+    case OP_UNDEF1A:
+    case OP_RD:
+    case OP_WRITE4:
+    case OP_WRITE:
+    case OP_UNDEF1E:
+    case OP_WD:
+	return 1;
+    default:
+	return 0;
+    }
+}
+
+static int is_jump(besk_decode_t* d)
+{
+    return (d->n == OP_JC) || (d->n == OP_JMP) || (d->n == OP_JGE);
+}
+
+// operations reading the operand at d->addr
+static int is_read(besk_decode_t* d)
+{
+    switch(d->n) {
+    case OP_BAND: case OP_MUL: case OP_MULR: case OP_ADDST:
+    case OP_ADDMR: case OP_SUBMR: case OP_SUB: case OP_AADD:
+    case OP_ASUB: case OP_ADD: case OP_DIV:
+	return 1;
+    default:
+	return 0;
+    }
+}
+
+// blocks are translated at leaders that are code and not left to step
+static int is_block(besk_t* state, unsigned addr)
+{
+    besk_decode_t d;
+
+    addr &= 0x7ff;
+    if ((cell[addr] & (CELL_CODE|CELL_LEADER)) != (CELL_CODE|CELL_LEADER))
+	return 0;
+    decode_instruction(&d, mem_get(state->MEM, addr), 1);
+    return !is_step(&d);
+}
+
+// mark code reachable from start and the block leaders
+static void find_code(besk_t* state, halvord_t start)
+{
+    unsigned work[2*NUM_HALF_CELLS+1];
+    int n = 0;
+
+    memset(cell, 0, sizeof(cell));
+    work[n++] = start & 0x7ff;
+    cell[start & 0x7ff] |= CELL_LEADER;
+    while (n > 0) {
+	unsigned addr = work[--n];
+	while (!(cell[addr] & CELL_CODE)) {
+	    besk_decode_t d;
+	    unsigned next = (addr+1) & 0x7ff;
+	    cell[addr] |= CELL_CODE;
+	    decode_instruction(&d, mem_get(state->MEM, addr), 1);
+	    if (is_jump(&d) && !(cell[d.addr] & CELL_LEADER)) {
+		cell[d.addr] |= CELL_LEADER;
+		work[n++] = d.addr;
+	    }
+	    if (is_jump(&d) || is_step(&d) || (next == 0)) {
+		if (!(cell[next] & CELL_LEADER)) {
+		    cell[next] |= CELL_LEADER;
+		    work[n++] = next;
+		}
+		break;
+	    }
+	    addr = next;
+	}
+    }
+}
+
+// number of instructions in block at addr, ends after a jump, at the
+// end of memory or before a leader or a cell left to step
+static int block_length(besk_t* state, unsigned addr)
+{
+    int len = 0;
+
+    for (;;) {
+	besk_decode_t d;
+	decode_instruction(&d, mem_get(state->MEM, addr), 1);
+	len++;
+	if (is_jump(&d) || (addr == 0x7ff))
+	    return len;
+	addr++;
+	decode_instruction(&d, mem_get(state->MEM, addr), 1);
+	if ((cell[addr] & CELL_LEADER) || is_step(&d))
+	    return len;
+    }
+}
+
+// continue at addr, KR is set
+static void emit_goto(FILE* f, besk_t* state, unsigned addr)
+{
+    if (is_block(state, addr))
+	fprintf(f, "goto B_%03X;", addr & 0x7ff);
+    else
+	fprintf(f, "goto next;");
+}
+
+// block of len instructions at addr
+static void emit_block(FILE* f, besk_t* state, unsigned addr, int len)
+{
+    int i;
+
+    fprintf(f, "B_%03X:\n", addr);
+    fprintf(f, "    if (end - count < %d) goto step;\n", len);
+    for (i = 0; i < len; i++, addr++) {
+	besk_decode_t d;
+	char buf[80];
+	int H, Z;
+
+	decode_instruction(&d, mem_get(state->MEM, addr), 1);
+	H = (d.flags & DECODE_H) != 0;
+	Z = (d.flags & DECODE_Z) != 0;
+	format_instruction(O(d.ins), d.w, buf, sizeof(buf));
+	fprintf(f, "    // %03X %05X : %s\n", addr, mem_get(state->MEM, addr), buf);
+	fprintf(f, "    if (mem_get(MEM, 0x%03X) != 0x%05X) BLOCK_EXIT(%d);\n",
+		addr, mem_get(state->MEM, addr), i);
+	fprintf(f, "    INS = 0x%05X; AS = 0x%03X; ARP = AR;\n", d.ins, d.w);
+	if (Z)
+	    fprintf(f, "    AR00 = 0; AR40 = 0; AR = 0; SI = 0;\n");
+	if (is_read(&d))
+	    fprintf(f, "    d = &dec[0x%03X];\n", addr);
+	switch(d.n) {
+	case OP_JC:
+	    fprintf(f, "    if (SI) { KR = AS; count += %d; ", i+1);
+	    emit_goto(f, state, d.addr);
+	    fprintf(f, " }\n");
+	    break;
+	case OP_JMP:
+	    fprintf(f, "    KR = AS; count += %d; ", i+1);
+	    emit_goto(f, state, d.addr);
+	    fprintf(f, "\n");
+	    return;
+	case OP_JGE:  // jge | jlt (see besk_step)
+	    if (Z)
+		fprintf(f, "    AR = ARP;\n    if (AR < 0) { KR = AS; count += %d; ",
+			i+1);
+	    else
+		fprintf(f, "    if (AR >= 0) { KR = AS; count += %d; ", i+1);
+	    emit_goto(f, state, d.addr);
+	    fprintf(f, " }\n");
+	    break;
+	default:
+	    fprintf(f, "    OPC_%02X(%d,%d,0);\n", d.n, H, Z);
+	    break;
+	}
+    }
+    fprintf(f, "    KR += %d; count += %d; ", len, len);
+    emit_goto(f, state, addr);
+    fprintf(f, "\n");
+}
+
+static const char* prelude =
+    "#include \"besk_ops.h\"\n"
+    "\n"
+    "#define SWAPIN() do {\t\t\t\t\t\t\t\\\n"
+    "\tMD = state->MD; MR = state->MR; AR = state->AR; ARP = state->ARP;\t\\\n"
+    "\tAR00 = state->AR00; AR40 = state->AR40; SI = state->SI;\t\t\\\n"
+    "\tKR = state->KR; INS = state->INS; count = state->count;\t\t\\\n"
+    "    } while(0)\n"
+    "\n"
+    "#define SWAPOUT() do {\t\t\t\t\t\t\t\\\n"
+    "\tstate->MD = MD; state->MR = MR; state->AR = AR; state->ARP = ARP;\t\\\n"
+    "\tstate->AR00 = AR00; state->AR40 = AR40; state->SI = SI;\t\t\\\n"
+    "\tstate->KR = KR; state->INS = INS; state->count = count;\t\t\\\n"
+    "    } while(0)\n"
+    "\n"
+    "// instruction i of the block has changed, run it by besk_step\n"
+    "#define BLOCK_EXIT(i) do { KR += (i); count += (i); goto step; } while(0)\n"
+    "\n";
+
+// translate the program in state from start to C on f
+static void translate(FILE* f, besk_t* state, halvord_t start, char* filename)
+{
+    int nblocks = 0, ncode = 0;
+    unsigned addr;
+
+    find_code(state, start);
+    fprintf(f, "//\n//  %s translated by besk2c\n//\n", filename);
+    fputs(prelude, f);
+
+    fprintf(f, "static const halvord_t image[NUM_HALF_CELLS] = {\n");
+    for (addr = 0; addr < NUM_HALF_CELLS; addr += 8) {
+	int i;
+	fprintf(f, "   ");
+	for (i = 0; i < 8; i++)
+	    fprintf(f, " 0x%05X,", mem_get(state->MEM, addr+i));
+	fprintf(f, "\n");
+    }
+    fprintf(f, "};\n\n");
+
+    fprintf(f, "static const besk_decode_t dec[NUM_HALF_CELLS] = {\n");
+    for (addr = 0; addr < NUM_HALF_CELLS; addr++) {
+	besk_decode_t d;
+	if (!(cell[addr] & CELL_CODE))
+	    continue;
+	ncode++;
+	decode_instruction(&d, mem_get(state->MEM, addr), 1);
+	fprintf(f, "    [0x%03X] = { 0x%05X, 0x%03X, 0x%03X, 0x%02X, 0x%02X, 0x%02X },\n",
+		addr, d.ins, d.w, d.addr, d.n, d.flags, d.op);
+    }
+    fprintf(f, "};\n\n");
+
+    fprintf(f, "static uint64_t run(besk_t* state, uint64_t n)\n{\n");
+    fprintf(f, "    helord_t  MD, MR, AR, ARP;\n");
+    fprintf(f, "    oktet_t   AR00, AR40, SI;\n");
+    fprintf(f, "    halvord_t KR, INS, AS;\n");
+    fprintf(f, "    besk_mem_t* MEM = state->MEM;\n");
+    fprintf(f, "    const besk_decode_t* d;\n");
+    fprintf(f, "    uint64_t count, count0 = state->count;\n");
+    fprintf(f, "    uint64_t end = (n > UINT64_MAX - count0) ? UINT64_MAX : count0 + n;\n");
+    fprintf(f, "    int side = 0;\n\n");
+    fprintf(f, "    SWAPIN();\n");
+    fprintf(f, "next:\n");
+    fprintf(f, "    if (!state->running || (count >= end)) goto done;\n");
+    fprintf(f, "    switch(KR & 0x7ff) {\n");
+    for (addr = 0; addr < NUM_HALF_CELLS; addr++) {
+	if (is_block(state, addr))
+	    fprintf(f, "    case 0x%03X: goto B_%03X;\n", addr, addr);
+    }
+    fprintf(f, "    default: break;\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "step:\n");
+    fprintf(f, "    if (count >= end) goto done;\n");
+    fprintf(f, "    SWAPOUT();\n");
+    fprintf(f, "    besk_step0(state);\n");
+    fprintf(f, "    besk_step(state);\n");
+    fprintf(f, "    SWAPIN();\n");
+    fprintf(f, "    goto next;\n\n");
+    for (addr = 0; addr < NUM_HALF_CELLS; addr++) {
+	if (is_block(state, addr)) {
+	    emit_block(f, state, addr, block_length(state, addr));
+	    nblocks++;
+	}
+    }
+    fprintf(f, "\ndone:\n");
+    fprintf(f, "    (void) d; (void) AS; (void) side;\n");
+    fprintf(f, "    SWAPOUT();\n");
+    fprintf(f, "    return count - count0;\n");
+    fprintf(f, "}\n\n");
+
+    fprintf(f, "int main(int argc, char** argv)\n{\n");
+    fprintf(f, "    return besk_aot_main(argc, argv, image, 0x%03X, run);\n",
+	    start);
+    fprintf(f, "}\n");
+    fprintf(stderr, "%s: %d code cells in %d blocks\n", filename, ncode, nblocks);
+}
+
+int main(int argc, char** argv)
+{
+    char* filename;
+    char* out_name = NULL;
+    halvord_t start = -1;
+    halvord_t addr;
+    int verbose = 0;
+    besk_t* state;
+    FILE* f;
+    FILE* out = stdout;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:o:v")) != -1) {
+	switch(opt) {
+	case 'a': {
+	    char* eptr;
+	    start = strtol(optarg, &eptr, 0);
+	    if (*eptr != '\0') usage();
+	    break;
+	}
+	case 'o':
+	    out_name = optarg;
+	    break;
+	case 'v':
+	    verbose = 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind >= argc) {
+	f = stdin;
+	filename = "*stdin*";
+    }
+    else {
+	if ((f = fopen(argv[optind], "r")) == NULL) {
+	    fprintf(stderr, "unable to open file %s\n", argv[optind]);
+	    usage();
+	}
+	filename = argv[optind];
+    }
+    if ((state = besk_create()) == NULL) {
+	fprintf(stderr, "unable to allocate machine\n");
+	exit(1);
+    }
+    addr = besk_load(state, f, filename, verbose);
+    if (f != stdin)
+	fclose(f);
+    if ((addr < 0) && (start < 0)) {
+	fprintf(stderr, "neither program or start address is given\n");
+	exit(1);
+    }
+    if (start < 0)
+	start = addr;
+    if (out_name && ((out = fopen(out_name, "w")) == NULL)) {
+	fprintf(stderr, "unable to open output file %s\n", out_name);
+	exit(1);
+    }
+    translate(out, state, start, filename);
+    if (out != stdout)
+	fclose(out);
+    besk_destroy(state);
+    exit(0);
+}
@@ -0,0 +1,124 @@
+//
+//  BESK runtime for programs translated to C by besk2c
+//
+//  The translated program calls besk_aot_main with its memory image,
+//  start address and run function. The machine is set up as by the
+//  besk command line emulator (INREMSA, UTREMSA and DRUM.dat) and run
+//  to STOP. The same image can be run on an interpreter core with -c,
+//  to check the translation against the interpreter.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "besk.h"
+
+static void aot_usage(char* prog)
+{
+    fprintf(stderr, "usage: %s [options]\n", prog);
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "  -i <filename> of input  (INREMSA)\n");
+    fprintf(stderr, "  -u <filename> of output (UTREMSA)\n");
+    fprintf(stderr, "  -d <filename> of drum   (DRUM.dat)\n");
+    fprintf(stderr, "  -c <core>  aot|switch|threaded|jit (default aot)\n");
+    fprintf(stderr, "  -n <n>     stop after n instructions\n");
+    fprintf(stderr, "  -m r       dump registers\n");
+    fprintf(stderr, "  -m m       dump memory\n");
+    fprintf(stderr, "  -m i       instruction count and speed\n");
+    exit(1);
+}
+
+// Run the translated program image from start with run, the core
+// given with -c runs the image on the interpreter instead. Return the
+// process exit status.
+int besk_aot_main(int argc, char** argv, const halvord_t* image,
+		  halvord_t start, besk_aot_run_t run)
+{
+    char* inremsa_name = "INREMSA";
+    char* utremsa_name = "UTREMSA";
+    char* drum_name = "DRUM.dat";
+    char* mdump = "";
+    uint64_t max_instructions = UINT64_MAX;
+    int core = -1;  // translated code
+    besk_t* state;
+    struct timespec t0, t1;
+    int opt, a;
+
+    while ((opt = getopt(argc, argv, "i:u:d:c:n:m:")) != -1) {
+	switch(opt) {
+	case 'i': inremsa_name = optarg; break;
+	case 'u': utremsa_name = optarg; break;
+	case 'd': drum_name = optarg; break;
+	case 'm': mdump = optarg; break;
+	case 'n': {
+	    char* eptr;
+	    max_instructions = strtoull(optarg, &eptr, 0);
+	    if (*eptr != '\0') aot_usage(argv[0]);
+	    break;
+	}
+	case 'c':
+	    if (strcmp(optarg, "aot") == 0)
+		core = -1;
+	    else if (strcmp(optarg, "switch") == 0)
+		core = BESK_CORE_SWITCH;
+	    else if (strcmp(optarg, "threaded") == 0)
+		core = BESK_CORE_THREADED;
+	    else if (strcmp(optarg, "jit") == 0)
+		core = BESK_CORE_JIT;
+	    else
+		aot_usage(argv[0]);
+	    break;
+	default:
+	    aot_usage(argv[0]);
+	}
+    }
+    if ((state = besk_create()) == NULL) {
+	fprintf(stderr, "unable to allocate machine\n");
+	return 1;
+    }
+    if ((state->in = fopen(inremsa_name, "r")) == NULL) {
+	fprintf(stderr, "unable to open input paper tape file %s\n",
+		inremsa_name);
+	return 1;
+    }
+    if ((state->ut = fopen(utremsa_name, "w")) == NULL) {
+	fprintf(stderr, "unable to open output paper tape file %s\n",
+		utremsa_name);
+	return 1;
+    }
+    // opened as by besk
+    if ((state->drum = fopen(drum_name, "rw")) == NULL) {
+	fprintf(stderr, "unable to open output drum file %s\n", drum_name);
+	return 1;
+    }
+    for (a = 0; a < NUM_HALF_CELLS; a++)
+	mem_set(state->MEM, a, image[a]);
+    state->running = 1;
+    state->KR = start;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (core >= 0)
+	besk_exec(state, core, max_instructions);
+    else {
+	while (state->running && (state->count < max_instructions))
+	    run(state, max_instructions - state->count);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fflush(state->ut);
+    while(*mdump) {
+	switch(*mdump) {
+	case 'r': dump_registers(stdout, state); break;
+	case 'm': dump_mem(stdout, -1, -1, state->MEM); break;
+	case 'i': dump_speed(stdout, state, &t0, &t1); break;
+	}
+	mdump++;
+    }
+    fclose(state->in);
+    fclose(state->ut);
+    fclose(state->drum);
+    besk_destroy(state);
+    return 0;
+}
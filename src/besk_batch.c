@@ -0,0 +1,399 @@
+//
+//  BESK batch runner, runs the jobs of a manifest on a pool of threads
+//
+//  manifest, one job per line, '#' starts a comment:
+//     <program> <inremsa> <drum> [<budget>]
+//  inremsa or drum '-' is an empty tape or a zero drum. budget is the
+//  max number of instructions, 0 or missing runs until STOP.
+//
+//  Each worker owns one besk_t and a deque of jobs, it takes jobs from
+//  the head of its own deque and when empty steals from the tail of
+//  the others. With -c simd a worker owns a group of machines and runs
+//  jobs with the same budget in lockstep (simd_exec). Output tapes and
+//  drum writes stay in memory, results are written in manifest order
+//  when all jobs are done.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "besk.h"
+
+#define MAX_WORKERS 256
+#define DRUM_BYTES  (DRUM_NUM_CHANNELS*DRUM_CHANNEL_BYTES)  // 40960
+#define SIMD_GROUP  64  // machines per worker with -c simd
+
+typedef struct
+{
+    char*    prog;      // program file
+    char*    in;        // INREMSA file or "-"
+    char*    drum;      // drum image or "-"
+    uint64_t budget;    // max instructions, 0 = no limit
+    char*    result;    // result text
+    size_t   result_len;
+    uint64_t count;     // executed instructions
+} job_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    int head;           // next own job
+    int tail;           // one past last job, thieves take tail-1
+    uint64_t steals;    // jobs stolen from others
+    pthread_t tid;
+    int id;
+    struct _batch* batch;
+} __attribute__((aligned(64))) worker_t;
+
+typedef struct _batch
+{
+    int      num_jobs;
+    job_t*   job;
+    int      core;      // BESK_CORE_xxx
+    int      num_workers;
+    worker_t worker[MAX_WORKERS];
+} batch_t;
+
+typedef struct
+{
+    int      j;         // job number
+    uint64_t t0;        // start time
+    FILE*    res;       // result stream
+    char*    ut;        // UTREMSA output
+    size_t   ut_len;
+} run_t;
+
+static const char* reason_name[] = {
+    "budget", "stop", "error", "io", "break", "display", "idle"
+};
+
+void usage()
+{
+    fprintf(stderr, "usage: besk_batch [options] [manifest]\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "  -j <n>     number of worker threads (default cores)\n");
+    fprintf(stderr, "  -c <core>  interpreter core: switch|threaded|jit|simd\n");
+    fprintf(stderr, "  -o <file>  results file (default stdout)\n");
+    exit(1);
+}
+
+// read manifest, return number of jobs or -1
+static int load_manifest(FILE* f, char* filename, job_t** jobs)
+{
+    char line[1024];
+    job_t* job = NULL;
+    int n = 0, size = 0;
+    int ln = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+	char* arg[4];
+	char* ptr = line;
+	char* eptr;
+	int i = 0;
+
+	ln++;
+	while ((i < 4) && *ptr) {
+	    while (isspace(*ptr)) ptr++;
+	    if ((*ptr == '\0') || (*ptr == '#'))
+		break;
+	    arg[i++] = ptr;
+	    while (*ptr && !isspace(*ptr)) ptr++;
+	    if (*ptr) *ptr++ = '\0';
+	}
+	if (i == 0)
+	    continue;
+	if (i < 3) {
+	    fprintf(stderr, "%s:%d: program inremsa drum expected\n",
+		    filename, ln);
+	    return -1;
+	}
+	if (n == size) {
+	    size = size ? 2*size : 64;
+	    if ((job = realloc(job, size*sizeof(job_t))) == NULL)
+		return -1;
+	}
+	memset(&job[n], 0, sizeof(job_t));
+	job[n].prog = strdup(arg[0]);
+	job[n].in   = strdup(arg[1]);
+	job[n].drum = strdup(arg[2]);
+	if (i > 3) {
+	    job[n].budget = strtoull(arg[3], &eptr, 0);
+	    if (*eptr != '\0') {
+		fprintf(stderr, "%s:%d: bad budget '%s'\n", filename, ln, arg[3]);
+		return -1;
+	    }
+	}
+	n++;
+    }
+    *jobs = job;
+    return n;
+}
+
+// private copy of drum image, zero filled when name is "-"
+static FILE* open_drum(char* name, uint8_t* buf)
+{
+    memset(buf, 0, DRUM_BYTES);
+    if (strcmp(name, "-") != 0) {
+	FILE* f;
+	if ((f = fopen(name, "r")) == NULL)
+	    return NULL;
+	fread(buf, 1, DRUM_BYTES, f);
+	fclose(f);
+    }
+    return fmemopen(buf, DRUM_BYTES, "r+");
+}
+
+// load job j into state, returns 0 and leaves the result open when
+// ready to run, -1 when the job failed and is done
+static int start_job(batch_t* batch, besk_t* state, int j, uint8_t* drum_buf,
+		     run_t* run)
+{
+    job_t* job = &batch->job[j];
+    FILE* f;
+    halvord_t addr;
+
+    run->j = j;
+    run->t0 = besk_ns();
+    run->ut = NULL;
+    run->ut_len = 0;
+    run->res = open_memstream(&job->result, &job->result_len);
+    fprintf(run->res, "job %d %s %s %s %lu\n", j, job->prog, job->in,
+	    job->drum, job->budget);
+    besk_reset(state);
+    if ((f = fopen(job->prog, "r")) == NULL) {
+	fprintf(run->res, "error unable to open program\nend\n");
+	goto error;
+    }
+    addr = besk_load(state, f, job->prog, 0);
+    fclose(f);
+    if (addr < 0) {
+	fprintf(run->res, "error syntax error\nend\n");
+	goto error;
+    }
+    state->in = fopen(strcmp(job->in, "-") ? job->in : "/dev/null", "r");
+    if (state->in == NULL) {
+	fprintf(run->res, "error unable to open input paper tape\nend\n");
+	goto error;
+    }
+    if ((state->drum = open_drum(job->drum, drum_buf)) == NULL) {
+	fprintf(run->res, "error unable to open drum\nend\n");
+	fclose(state->in);
+	goto error;
+    }
+    state->ut = open_memstream(&run->ut, &run->ut_len);
+    state->KR = addr;
+    state->running = 1;
+    return 0;
+error:
+    fclose(run->res);
+    return -1;
+}
+
+static void finish_job(batch_t* batch, besk_t* state, run_t* run,
+		       besk_run_t r)
+{
+    job_t* job = &batch->job[run->j];
+
+    job->count = r.count;
+    fclose(state->in);
+    fclose(state->drum);
+    fclose(state->ut);
+    fprintf(run->res, "reason=%s count=%lu time=%.6f\n",
+	    reason_name[r.reason], r.count, (besk_ns() - run->t0)*1e-9);
+    dump_registers(run->res, state);
+    fprintf(run->res, "utremsa %zu\n", run->ut_len);
+    fwrite(run->ut, 1, run->ut_len, run->res);
+    fprintf(run->res, "end\n");
+    free(run->ut);
+    fclose(run->res);
+}
+
+static uint64_t job_budget(job_t* job)
+{
+    return job->budget ? job->budget : UINT64_MAX;
+}
+
+// next job for worker w, own jobs first then steal, -1 when all taken
+static int next_job(batch_t* batch, worker_t* w)
+{
+    int i, j = -1;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail)
+	j = w->head++;
+    pthread_mutex_unlock(&w->lock);
+    for (i = 1; (j < 0) && (i < batch->num_workers); i++) {
+	worker_t* v = &batch->worker[(w->id + i) % batch->num_workers];
+	pthread_mutex_lock(&v->lock);
+	if (v->head < v->tail) {
+	    j = --v->tail;
+	    w->steals++;
+	}
+	pthread_mutex_unlock(&v->lock);
+    }
+    return j;
+}
+
+// run jobs in groups of up to SIMD_GROUP machines with the same budget
+static void worker_simd(batch_t* batch, worker_t* w, besk_t** state,
+			uint8_t* drum_buf)
+{
+    run_t run[SIMD_GROUP];
+    besk_run_t r[SIMD_GROUP];
+    int next = next_job(batch, w);
+
+    while (next >= 0) {
+	uint64_t budget = job_budget(&batch->job[next]);
+	int i, m = 0;
+
+	while ((next >= 0) && (m < SIMD_GROUP) &&
+	       (job_budget(&batch->job[next]) == budget)) {
+	    if (start_job(batch, state[m], next, drum_buf+m*DRUM_BYTES,
+			  &run[m]) == 0)
+		m++;
+	    next = next_job(batch, w);
+	}
+	if (m == 0)
+	    continue;
+	simd_exec(state, r, m, BESK_CORE_THREADED, budget);
+	for (i = 0; i < m; i++)
+	    finish_job(batch, state[i], &run[i], r[i]);
+    }
+}
+
+static void* worker_main(void* arg)
+{
+    worker_t* w = arg;
+    batch_t* batch = w->batch;
+    int n = (batch->core == BESK_CORE_SIMD) ? SIMD_GROUP : 1;
+    besk_t* state[SIMD_GROUP];
+    uint8_t* drum_buf;
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+	if ((state[i] = besk_create()) == NULL)
+	    goto done;
+    }
+    if ((drum_buf = malloc(n*DRUM_BYTES)) == NULL)
+	goto done;
+    if (batch->core == BESK_CORE_SIMD)
+	worker_simd(batch, w, state, drum_buf);
+    else {
+	while ((j = next_job(batch, w)) >= 0) {
+	    run_t run;
+	    if (start_job(batch, state[0], j, drum_buf, &run) == 0)
+		finish_job(batch, state[0], &run,
+			   besk_exec(state[0], batch->core,
+				     job_budget(&batch->job[j])));
+	}
+    }
+    free(drum_buf);
+done:
+    while (i--)
+	besk_destroy(state[i]);
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    static batch_t batch;
+    char* filename = "*stdin*";
+    char* result_name = NULL;
+    FILE* f = stdin;
+    FILE* fres = stdout;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int core = BESK_CORE_THREADED;
+    uint64_t count = 0, steals = 0;
+    uint64_t t0;
+    double t;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "j:c:o:")) != -1) {
+	switch(opt) {
+	case 'j':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'c':
+	    if (strcmp(optarg, "switch") == 0)
+		core = BESK_CORE_SWITCH;
+	    else if (strcmp(optarg, "threaded") == 0)
+		core = BESK_CORE_THREADED;
+	    else if (strcmp(optarg, "jit") == 0)
+		core = BESK_CORE_JIT;
+	    else if (strcmp(optarg, "simd") == 0)
+		core = BESK_CORE_SIMD;
+	    else
+		usage();
+	    break;
+	case 'o':
+	    result_name = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind < argc) {
+	filename = argv[optind];
+	if ((f = fopen(filename, "r")) == NULL) {
+	    fprintf(stderr, "unable to open manifest %s\n", filename);
+	    exit(1);
+	}
+    }
+    if ((batch.num_jobs = load_manifest(f, filename, &batch.job)) < 0)
+	exit(1);
+    if (f != stdin)
+	fclose(f);
+    if (result_name && ((fres = fopen(result_name, "w")) == NULL)) {
+	fprintf(stderr, "unable to open results file %s\n", result_name);
+	exit(1);
+    }
+    if (nthreads > MAX_WORKERS) nthreads = MAX_WORKERS;
+    if (nthreads > batch.num_jobs) nthreads = batch.num_jobs;
+    if (nthreads < 1) nthreads = 1;
+    batch.core = core;
+    batch.num_workers = nthreads;
+
+    // deal jobs in contiguous ranges
+    t0 = besk_ns();
+    for (i = 0; i < nthreads; i++) {
+	worker_t* w = &batch.worker[i];
+	pthread_mutex_init(&w->lock, NULL);
+	w->head  = (int)(((int64_t)batch.num_jobs * i) / nthreads);
+	w->tail  = (int)(((int64_t)batch.num_jobs * (i+1)) / nthreads);
+	w->id    = i;
+	w->batch = &batch;
+    }
+    for (i = 0; i < nthreads; i++) {
+	if (pthread_create(&batch.worker[i].tid, NULL, worker_main,
+			   &batch.worker[i]) != 0) {
+	    fprintf(stderr, "unable to create worker thread\n");
+	    exit(1);
+	}
+    }
+    for (i = 0; i < nthreads; i++) {
+	pthread_join(batch.worker[i].tid, NULL);
+	steals += batch.worker[i].steals;
+    }
+    t = (besk_ns() - t0)*1e-9;
+
+    for (i = 0; i < batch.num_jobs; i++) {
+	job_t* job = &batch.job[i];
+	if (job->result == NULL)
+	    fprintf(fres, "job %d %s\nerror not run\nend\n", i, job->prog);
+	else
+	    fwrite(job->result, 1, job->result_len, fres);
+	count += job->count;
+    }
+    if (fres != stdout)
+	fclose(fres);
+    fprintf(stderr, "jobs=%d, threads=%d, steals=%lu, instructions=%lu, "
+	    "time=%.3fs", batch.num_jobs, nthreads, steals, count, t);
+    if (t > 0.0)
+	fprintf(stderr, ", %.2f MIPS", (count / t) * 1e-6);
+    fprintf(stderr, "\n");
+    exit(0);
+}
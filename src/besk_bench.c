@@ -0,0 +1,190 @@
+//
+//  BESK benchmark, instructions per second of the interpreter cores
+//
+//  Each program is loaded into a fresh machine and run to STOP (or at
+//  most -n instructions) on each core, the best of -r runs is reported.
+//  The input tape is empty, output goes to /dev/null and the drum reads
+//  as zero.
+//
+//  With -k the helord array operations are measured instead, elements
+//  per second for each kernel and instruction set.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "besk.h"
+
+static const char* core_name[] = { "switch", "threaded", "jit" };
+
+void usage()
+{
+    fprintf(stderr, "usage: besk_bench [options] file...\n");
+    fprintf(stderr, "       besk_bench -k [-r <n>]\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "  -c <core>  switch|threaded|jit (default all)\n");
+    fprintf(stderr, "  -r <n>     runs per core, best is reported (default 5)\n");
+    fprintf(stderr, "  -n <n>     max instructions per run\n");
+    fprintf(stderr, "  -k         helord array kernels\n");
+    exit(1);
+}
+
+// run filename once on core, return ns or 0 on error
+static uint64_t bench_run(char* filename, int core, uint64_t max,
+			  uint64_t* count)
+{
+    besk_t* state;
+    halvord_t addr;
+    uint64_t t0, t1;
+    FILE* f;
+
+    if ((f = fopen(filename, "r")) == NULL) {
+	fprintf(stderr, "unable to open file %s\n", filename);
+	return 0;
+    }
+    if ((state = besk_create()) == NULL) {
+	fclose(f);
+	return 0;
+    }
+    addr = besk_load(state, f, filename, 0);
+    fclose(f);
+    if (addr < 0) {
+	fprintf(stderr, "%s: no start address\n", filename);
+	besk_destroy(state);
+	return 0;
+    }
+    state->in = fopen("/dev/null", "r");
+    state->ut = fopen("/dev/null", "w");
+    state->drum = fopen("/dev/null", "r");
+    state->KR = addr;
+    state->running = 1;
+    t0 = besk_ns();
+    besk_exec(state, core, max);
+    t1 = besk_ns();
+    *count = state->count;
+    fclose(state->in);
+    fclose(state->ut);
+    fclose(state->drum);
+    besk_destroy(state);
+    return (t1 > t0) ? t1 - t0 : 1;
+}
+
+#define KERNEL_N    4096
+#define KERNEL_REPS 4096
+
+enum { K_ADD, K_MUL, K_FROM_DOUBLE, K_TO_DOUBLE, K_REVERSE, K_NUM };
+static const char* kernel_name[K_NUM] = {
+    "helord_add_n", "helord_mul_n", "helord_from_double_n",
+    "helord_to_double_n", "helord_reverse_n"
+};
+
+// KERNEL_REPS calls of kernel on KERNEL_N elements, return ns
+static uint64_t kernel_run(int kernel)
+{
+    static helord_t a[KERNEL_N], b[KERNEL_N], r[KERNEL_N], lw[KERNEL_N];
+    static double y[KERNEL_N], d[KERNEL_N];
+    uint64_t t0, t1;
+    int i;
+
+    for (i = 0; i < KERNEL_N; i++) {
+	a[i] = (0x9E3779B97F4A7C15ULL * (i+1)) & HELORD_MASK;
+	b[i] = (0xC2B2AE3D27D4EB4FULL * (i+1)) & HELORD_MASK;
+	y[i] = (i - KERNEL_N/2) / (double)(KERNEL_N/2);
+    }
+    t0 = besk_ns();
+    for (i = 0; i < KERNEL_REPS; i++) {
+	switch(kernel) {
+	case K_ADD: helord_add_n(a, b, r, KERNEL_N); break;
+	case K_MUL: helord_mul_n(a, b, r, lw, KERNEL_N); break;
+	case K_FROM_DOUBLE: helord_from_double_n(y, r, KERNEL_N); break;
+	case K_TO_DOUBLE: helord_to_double_n(a, d, KERNEL_N); break;
+	case K_REVERSE: helord_reverse_n(a, r, KERNEL_N); break;
+	}
+    }
+    t1 = besk_ns();
+    return (t1 > t0) ? t1 - t0 : 1;
+}
+
+static void kernel_bench(int runs)
+{
+    static const char* isa[] = { "scalar", "avx2" };
+    uint64_t count = (uint64_t) KERNEL_N * KERNEL_REPS;
+    int i, k, r;
+
+    for (i = 0; i < 2; i++) {
+	if (helord_n_select(isa[i]) < 0)
+	    continue;
+	for (k = 0; k < K_NUM; k++) {
+	    uint64_t best = 0;
+	    for (r = 0; r < runs; r++) {
+		uint64_t t = kernel_run(k);
+		if ((best == 0) || (t < best))
+		    best = t;
+	    }
+	    printf("%s %s elements=%lu, time=%.3fs, %.2f M elements/s\n",
+		   kernel_name[k], isa[i], count, best*1e-9,
+		   (count*1e3) / best);
+	}
+    }
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t max = UINT64_MAX;
+    int runs = 5;
+    int core0 = BESK_CORE_SWITCH, core1 = BESK_CORE_JIT;
+    int kernels = 0;
+    int opt, i, core, r;
+
+    while ((opt = getopt(argc, argv, "c:r:n:k")) != -1) {
+	switch(opt) {
+	case 'k':
+	    kernels = 1;
+	    break;
+	case 'c':
+	    for (core = BESK_CORE_SWITCH; core <= BESK_CORE_JIT; core++)
+		if (strcmp(optarg, core_name[core]) == 0)
+		    break;
+	    if (core > BESK_CORE_JIT)
+		usage();
+	    core0 = core1 = core;
+	    break;
+	case 'r':
+	    if ((runs = atoi(optarg)) < 1)
+		usage();
+	    break;
+	case 'n': {
+	    char* eptr;
+	    max = strtoull(optarg, &eptr, 0);
+	    if (*eptr != '\0') usage();
+	    break;
+	}
+	default:
+	    usage();
+	}
+    }
+    if (kernels) {
+	kernel_bench(runs);
+	exit(0);
+    }
+    if (optind >= argc)
+	usage();
+    for (i = optind; i < argc; i++) {
+	for (core = core0; core <= core1; core++) {
+	    uint64_t best = 0, count = 0;
+	    for (r = 0; r < runs; r++) {
+		uint64_t t = bench_run(argv[i], core, max, &count);
+		if (t == 0)
+		    exit(1);
+		if ((best == 0) || (t < best))
+		    best = t;
+	    }
+	    printf("%s %s instructions=%lu, time=%.3fs, %.2f MIPS\n",
+		   argv[i], core_name[core], count, best*1e-9,
+		   (count*1e3) / best);
+	}
+    }
+    exit(0);
+}
@@ -0,0 +1,336 @@
+//
+//  BESK exploration, run variants of a machine in forked processes
+//
+//  variants file, one variant per line, '#' starts a comment:
+//     <patch> ...
+//  patch:
+//     MD|MR|AR|ARP|SI|KR=<value>   set register
+//     [<addr>]=<value>             set halvord at addr
+//     [<addr>].h=<value>           set helord at addr (addr, addr+1)
+//     in=<file>                    continue with another input tape
+//  An empty variant (a line with '-') runs the machine as is.
+//
+//  The machine is forked once per variant, the child gets a copy on
+//  write image of the parent so the setup cost is the patch list. The
+//  input tape rest and the drum are read into memory before forking
+//  and each child works on its own copy. A child runs to STOP and
+//  sends its result, registers and output tape, through a pipe, the
+//  parent writes the results in variant order.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "besk.h"
+
+#define DRUM_BYTES  (DRUM_NUM_CHANNELS*DRUM_CHANNEL_BYTES)  // 40960
+
+#define PATCH_REG   0  // register
+#define PATCH_HALF  1  // [addr]=value
+#define PATCH_FULL  2  // [addr].h=value
+#define PATCH_IN    3  // in=file
+
+#define REG_MD  0
+#define REG_MR  1
+#define REG_AR  2
+#define REG_ARP 3
+#define REG_SI  4
+#define REG_KR  5
+
+static const char* reg_name[] = { "MD", "MR", "AR", "ARP", "SI", "KR" };
+
+static const char* reason_name[] = {
+    "budget", "stop", "error", "io", "break", "display", "idle"
+};
+
+typedef struct
+{
+    int       kind;   // PATCH_xxx
+    int       reg;    // REG_xxx
+    halvord_t addr;
+    helord_t  value;
+    char*     file;   // input tape
+} patch_t;
+
+typedef struct
+{
+    int      ln;      // line in variants file
+    int      num_patches;
+    patch_t* patch;
+    pid_t    pid;     // child or 0
+    FILE*    res;     // read end of result pipe
+} variant_t;
+
+// parse one patch, return 0 or -1
+static int parse_patch(char* arg, patch_t* p)
+{
+    char* val;
+    char* eptr;
+    int i;
+
+    if ((val = strchr(arg, '=')) == NULL)
+	return -1;
+    *val++ = '\0';
+    if (strcmp(arg, "in") == 0) {
+	p->kind = PATCH_IN;
+	p->file = strdup(val);
+	return 0;
+    }
+    p->value = strtoull(val, &eptr, 0);
+    if ((*val == '\0') || (*eptr != '\0'))
+	return -1;
+    if (arg[0] == '[') {
+	p->addr = strtol(arg+1, &eptr, 0) & 0x7ff;
+	if (eptr[0] != ']')
+	    return -1;
+	if (eptr[1] == '\0') {
+	    p->kind = PATCH_HALF;
+	    p->value &= HALVORD_MASK;
+	    return 0;
+	}
+	if (strcmp(eptr+1, ".h") == 0) {
+	    p->kind = PATCH_FULL;
+	    p->value &= HELORD_MASK;
+	    return 0;
+	}
+	return -1;
+    }
+    for (i = 0; i < (int)(sizeof(reg_name)/sizeof(reg_name[0])); i++) {
+	if (strcmp(arg, reg_name[i]) == 0) {
+	    p->kind = PATCH_REG;
+	    p->reg = i;
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+// read variants, return number of variants or -1
+static int load_variants(FILE* f, char* filename, variant_t** variants)
+{
+    char line[1024];
+    variant_t* v = NULL;
+    int n = 0, size = 0;
+    int ln = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+	char* ptr = line;
+	patch_t p;
+	int empty = 1;
+
+	ln++;
+	while (*ptr) {
+	    char* arg;
+	    while (isspace(*ptr)) ptr++;
+	    if ((*ptr == '\0') || (*ptr == '#'))
+		break;
+	    arg = ptr;
+	    while (*ptr && !isspace(*ptr)) ptr++;
+	    if (*ptr) *ptr++ = '\0';
+	    if (empty) {
+		if (n == size) {
+		    size = size ? 2*size : 64;
+		    if ((v = realloc(v, size*sizeof(variant_t))) == NULL)
+			return -1;
+		}
+		memset(&v[n], 0, sizeof(variant_t));
+		v[n].ln = ln;
+		n++;
+		empty = 0;
+	    }
+	    if (strcmp(arg, "-") == 0)
+		continue;
+	    memset(&p, 0, sizeof(p));
+	    if (parse_patch(arg, &p) < 0) {
+		fprintf(stderr, "%s:%d: bad patch '%s'\n", filename, ln, arg);
+		return -1;
+	    }
+	    v[n-1].patch = realloc(v[n-1].patch,
+				   (v[n-1].num_patches+1)*sizeof(patch_t));
+	    if (v[n-1].patch == NULL)
+		return -1;
+	    v[n-1].patch[v[n-1].num_patches++] = p;
+	}
+    }
+    *variants = v;
+    return n;
+}
+
+// rest of a file in memory, *len is set to the number of bytes
+static uint8_t* read_rest(FILE* f, size_t* len)
+{
+    uint8_t* buf = NULL;
+    size_t size = 0, n;
+
+    *len = 0;
+    if (f == NULL)
+	return NULL;
+    do {
+	if (*len == size) {
+	    size = size ? 2*size : 4096;
+	    if ((buf = realloc(buf, size)) == NULL)
+		return NULL;
+	}
+	n = fread(buf + *len, 1, size - *len, f);
+	*len += n;
+    } while (n > 0);
+    return buf;
+}
+
+// child: apply the patches, run to STOP and write the result to fd
+static void run_variant(besk_t* state, int core, variant_t* v, int j,
+			uint8_t* tape, size_t tape_len, uint8_t* drum,
+			uint64_t max_instructions, int fd)
+{
+    FILE* res = fdopen(fd, "w");
+    char* ut = NULL;
+    size_t ut_len = 0;
+    besk_run_t r;
+    int i;
+
+    fprintf(res, "variant %d line %d\n", j, v->ln);
+    state->in = tape_len ? fmemopen(tape, tape_len, "r") : fopen("/dev/null", "r");
+    state->drum = fmemopen(drum, DRUM_BYTES, "r+");
+    state->ut = open_memstream(&ut, &ut_len);
+    for (i = 0; i < v->num_patches; i++) {
+	patch_t* p = &v->patch[i];
+	switch(p->kind) {
+	case PATCH_REG:
+	    switch(p->reg) {
+	    case REG_MD:  state->MD = p->value & HELORD_MASK; break;
+	    case REG_MR:  state->MR = p->value & HELORD_MASK; break;
+	    case REG_AR:  state->AR = p->value & HELORD_MASK; break;
+	    case REG_ARP: state->ARP = p->value & HELORD_MASK; break;
+	    case REG_SI:  state->SI = (p->value != 0); break;
+	    case REG_KR:  state->KR = p->value & 0x7ff; break;
+	    }
+	    break;
+	case PATCH_HALF:
+	    mem_set(state->MEM, p->addr, p->value);
+	    break;
+	case PATCH_FULL:
+	    mem_helord_write(p->addr, state->MEM, p->value);
+	    break;
+	case PATCH_IN:
+	    fclose(state->in);
+	    if ((state->in = fopen(p->file, "r")) == NULL) {
+		fprintf(res, "error unable to open input paper tape %s\nend\n",
+			p->file);
+		fclose(res);
+		_exit(1);
+	    }
+	    break;
+	}
+    }
+    // memory is patched behind the decode cache and translated code
+    jit_destroy(state);
+    for (i = 0; i < NUM_HALF_CELLS; i++)
+	state->DEC[i].flags = 0;
+
+    state->running = 1;
+    r = besk_exec(state, core, max_instructions);
+    fflush(state->ut);
+    fprintf(res, "reason=%s count=%lu\n", reason_name[r.reason], r.count);
+    dump_registers(res, state);
+    fprintf(res, "utremsa %zu\n", ut_len);
+    fwrite(ut, 1, ut_len, res);
+    fprintf(res, "end\n");
+    fclose(res);
+    _exit(0);
+}
+
+// fork child for variant j, return 0 or -1
+static int start_variant(besk_t* state, int core, variant_t* v, int j,
+			 uint8_t* tape, size_t tape_len, uint8_t* drum,
+			 uint64_t max_instructions)
+{
+    int fd[2];
+
+    if (pipe(fd) < 0)
+	return -1;
+    fflush(NULL);  // do not let the child flush parent buffers
+    if ((v->pid = fork()) < 0) {
+	close(fd[0]);
+	close(fd[1]);
+	return -1;
+    }
+    if (v->pid == 0) {
+	close(fd[0]);
+	run_variant(state, core, v, j, tape, tape_len, drum,
+		    max_instructions, fd[1]);
+    }
+    close(fd[1]);
+    v->res = fdopen(fd[0], "r");
+    return 0;
+}
+
+// copy result of variant j to out and reap the child
+static void finish_variant(variant_t* v, int j, FILE* out)
+{
+    char buf[4096];
+    size_t n;
+    int status;
+
+    if (v->res == NULL) {
+	fprintf(out, "variant %d line %d\nerror not run\nend\n", j, v->ln);
+	return;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), v->res)) > 0)
+	fwrite(buf, 1, n, out);
+    fclose(v->res);
+    waitpid(v->pid, &status, 0);
+    if (!WIFEXITED(status))
+	fprintf(out, "variant %d line %d\nerror child terminated\nend\n",
+		j, v->ln);
+}
+
+// Run the variants read from f on forked copies of state, at most jobs
+// children at a time, each for at most max_instructions on core.
+// Results are written to out in variant order. Return the number of
+// variants or -1 on error.
+int besk_explore(besk_t* state, int core, FILE* f, char* filename, int jobs,
+		 uint64_t max_instructions, FILE* out)
+{
+    variant_t* v;
+    uint8_t* tape;
+    uint8_t* drum;
+    size_t tape_len;
+    int n, i, j;
+
+    if ((n = load_variants(f, filename, &v)) < 0)
+	return -1;
+    if ((drum = calloc(1, DRUM_BYTES)) == NULL)
+	return -1;
+    if (state->drum != NULL) {
+	fseek(state->drum, 0, SEEK_SET);
+	if (fread(drum, 1, DRUM_BYTES, state->drum) == 0)
+	    fprintf(stderr, "%s: drum is empty\n", filename);
+    }
+    tape = read_rest(state->in, &tape_len);
+    if (jobs < 1)
+	jobs = 1;
+    for (i = 0, j = 0; j < n; j++) {
+	// keep jobs children running, results are taken in order
+	while ((i < n) && (i < j + jobs)) {
+	    if (start_variant(state, core, &v[i], i, tape, tape_len, drum,
+			      max_instructions) < 0)
+		fprintf(stderr, "%s:%d: unable to fork\n", filename, v[i].ln);
+	    i++;
+	}
+	finish_variant(&v[j], j, out);
+    }
+    for (j = 0; j < n; j++) {
+	for (i = 0; i < v[j].num_patches; i++)
+	    free(v[j].patch[i].file);
+	free(v[j].patch);
+    }
+    free(v);
+    free(tape);
+    free(drum);
+    return n;
+}
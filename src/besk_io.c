@@ -0,0 +1,226 @@
+//
+//  BESK device record and replay
+//
+//  In record mode every device interaction is appended to a binary
+//  log: words read from paper tape, drum channels read by RD and codes
+//  punched on UTREMSA. In replay mode the machine is fed from the log,
+//  no device file is touched, paper tape reads take the logged word,
+//  RD the logged channel and drum writes are dropped. Punched codes
+//  are checked against the log.
+//
+//  log:    header record*
+//  header: "BESKIO\0\0" version:32 0:32
+//  record: kind:8 data, data length is fixed per kind (io_len)
+//  Words are 5 bytes, least significant byte first. A drum channel read
+//  again without change is logged as IO_DRUM_SAME without data.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "besk.h"
+
+#define IO_MAGIC    "BESKIO\0\0"
+#define IO_VERSION  1
+#define IO_HEADER   16
+#define IO_BUFSIZE  (1 << 20)
+
+static const size_t io_len[IO_NUM_KINDS] = {
+    [IO_READ5]  = 5,
+    [IO_READ4]  = 5,
+    [IO_DRUM]   = DRUM_CHANNEL_BYTES,
+    [IO_DRUM_SAME] = 0,
+    [IO_PUNCH4] = 1,
+    [IO_PUNCH]  = 1,
+};
+
+typedef struct
+{
+    int      replay;  // 1 = replay, 0 = record
+    FILE*    f;       // log being recorded
+    uint8_t* data;    // mapped log being replayed
+    size_t   size;
+    size_t   pos;
+    uint8_t  seen[DRUM_NUM_CHANNELS];  // channel read before
+    uint8_t  drum[DRUM_NUM_CHANNELS][DRUM_CHANNEL_BYTES];  // as last read
+} io_t;
+
+// Record device interactions of state to path (replay=0) or feed state
+// from the log in path (replay=1). Return 0 or -1 on error.
+int besk_io_open(besk_t* state, char* path, int replay)
+{
+    io_t* io;
+    uint32_t hdr[2] = { IO_VERSION, 0 };
+
+    io_destroy(state);
+    if ((io = calloc(1, sizeof(io_t))) == NULL)
+	return -1;
+    io->replay = replay;
+    if (!replay) {
+	if ((io->f = fopen(path, "w")) == NULL) {
+	    fprintf(stderr, "unable to open io log %s\n", path);
+	    free(io);
+	    return -1;
+	}
+	setvbuf(io->f, NULL, _IOFBF, IO_BUFSIZE);
+	fwrite(IO_MAGIC, 1, 8, io->f);
+	fwrite(hdr, sizeof(uint32_t), 2, io->f);
+    }
+    else {
+	struct stat st;
+	int fd;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+	    fprintf(stderr, "unable to open io log %s\n", path);
+	    free(io);
+	    return -1;
+	}
+	if ((fstat(fd, &st) < 0) || (st.st_size < IO_HEADER)) {
+	    fprintf(stderr, "%s: not an io log\n", path);
+	    close(fd);
+	    free(io);
+	    return -1;
+	}
+	io->size = st.st_size;
+	io->data = mmap(NULL, io->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (io->data == MAP_FAILED) {
+	    fprintf(stderr, "unable to map io log %s\n", path);
+	    free(io);
+	    return -1;
+	}
+	memcpy(hdr, io->data+8, sizeof(hdr));
+	if ((memcmp(io->data, IO_MAGIC, 8) != 0) || (hdr[0] != IO_VERSION)) {
+	    fprintf(stderr, "%s: not an io log of this version\n", path);
+	    munmap(io->data, io->size);
+	    free(io);
+	    return -1;
+	}
+	io->pos = IO_HEADER;
+    }
+    state->io = io;
+    return 0;
+}
+
+// stop recording or replaying, the log is flushed
+void io_destroy(besk_t* state)
+{
+    io_t* io = state->io;
+
+    if (io == NULL)
+	return;
+    if (io->f)
+	fclose(io->f);
+    if (io->data)
+	munmap(io->data, io->size);
+    free(io);
+    state->io = NULL;
+}
+
+int io_replaying(besk_t* state)
+{
+    io_t* io = state->io;
+    return (io != NULL) && io->replay;
+}
+
+// When replaying take the next record, of kind, into data and return
+// 1. The machine is stopped when the log ends or has another kind.
+// Return 0 when not replaying.
+int io_get(besk_t* state, int kind, void* data)
+{
+    io_t* io = state->io;
+    size_t len = io_len[kind];
+
+    if ((io == NULL) || !io->replay)
+	return 0;
+    if ((io->pos + 1 + len > io->size) || (io->data[io->pos] != kind)) {
+	if (state->running)
+	    printf("%03X | IO REPLAY %s at #%lu\n", state->KR,
+		   (io->pos + 1 + len > io->size) ? "END" : "DIVERGED",
+		   state->count);
+	state->running = 0;
+	memset(data, 0, len);
+	return 1;
+    }
+    memcpy(data, io->data + io->pos + 1, len);
+    io->pos += 1 + len;
+    return 1;
+}
+
+// append record of kind when recording
+void io_put(besk_t* state, int kind, const void* data)
+{
+    io_t* io = state->io;
+
+    if ((io == NULL) || io->replay)
+	return;
+    putc(kind, io->f);
+    fwrite(data, 1, io_len[kind], io->f);
+}
+
+// word as logged, 5 bytes least significant first
+void io_word_put(besk_t* state, int kind, helord_t x)
+{
+    uint8_t b[5];
+    int i;
+
+    for (i = 0; i < 5; i++)
+	b[i] = x >> (8*i);
+    io_put(state, kind, b);
+}
+
+int io_word_get(besk_t* state, int kind, helord_t* xp)
+{
+    uint8_t b[5];
+    helord_t x = 0;
+    int i;
+
+    if (!io_get(state, kind, b))
+	return 0;
+    for (i = 4; i >= 0; i--)
+	x = (x << 8) | b[i];
+    *xp = x;
+    return 1;
+}
+
+// drum channel read by RD, from the log when replaying, return 1 when
+// replayed
+int io_drum_get(besk_t* state, int channel, uint8_t* data)
+{
+    io_t* io = state->io;
+
+    if ((io == NULL) || !io->replay)
+	return 0;
+    channel &= (DRUM_NUM_CHANNELS-1);
+    if ((io->pos < io->size) && (io->data[io->pos] == IO_DRUM_SAME) &&
+	io->seen[channel]) {
+	io->pos++;
+	memcpy(data, io->drum[channel], DRUM_CHANNEL_BYTES);
+	return 1;
+    }
+    io_get(state, IO_DRUM, data);
+    memcpy(io->drum[channel], data, DRUM_CHANNEL_BYTES);
+    io->seen[channel] = 1;
+    return 1;
+}
+
+void io_drum_put(besk_t* state, int channel, const uint8_t* data)
+{
+    io_t* io = state->io;
+
+    if ((io == NULL) || io->replay)
+	return;
+    channel &= (DRUM_NUM_CHANNELS-1);
+    if (io->seen[channel] &&
+	(memcmp(io->drum[channel], data, DRUM_CHANNEL_BYTES) == 0)) {
+	putc(IO_DRUM_SAME, io->f);
+	return;
+    }
+    memcpy(io->drum[channel], data, DRUM_CHANNEL_BYTES);
+    io->seen[channel] = 1;
+    io_put(state, IO_DRUM, data);
+}
@@ -0,0 +1,893 @@
+//
+//  BESK basic block translator (x86-64)
+//
+//  Straight line BESK code, from an entry KR up to and including the
+//  next jump, is translated into native code.  AR, MR, MD and ARP live
+//  in host registers (r12, r13, r14, r15) and rbx points to besk_t.
+//  Shifts, NORM, DIV and REV call besk_step, the I/O operations, STOP
+//  and undefined operations end the block and are run by the
+//  interpreter.
+//
+//  Translated cells are marked with DECODE_JIT in the predecode array.
+//  A store from translated code that hits a marked cell leaves the block
+//  right after the store, and decode_invalidate calls jit_invalidate
+//  for writes done by the interpreter.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <memory.h>
+
+#include "besk.h"
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE   (1024*1024)  // code buffer, flushed when full
+#define JIT_BLOCK_MAX   64           // max number of instructions in block
+#define JIT_INSTR_BYTES 256          // max code bytes per instruction
+#define JIT_NUM_KR      0x1000       // KR is 12 bit (AS), two aliases/cell
+
+#define JIT_EXIT_INVALIDATE 0x10000  // | addr, store hit translated code
+#define JIT_EXIT_HELORD     0x20000  // | addr+1 as well
+
+typedef uint32_t (*jit_fn_t)(besk_t* state);
+
+typedef struct {
+    jit_fn_t fn;    // translated code or NULL
+    uint16_t len;   // number of instructions
+} jit_block_t;
+
+// pending out of line exit
+typedef struct {
+    size_t    pos;    // position of rel32 to patch
+    halvord_t KR;     // next KR
+    halvord_t INS;    // last executed instruction
+    uint32_t  count;  // instructions executed inline
+    uint32_t  code;   // return code
+} jit_exit_t;
+
+typedef struct {
+    uint8_t*    code;
+    size_t      pos;
+    jit_block_t block[JIT_NUM_KR];
+    // block being translated
+    jit_exit_t  exit[2*JIT_BLOCK_MAX];   // out of line exits
+    int         num_exits;
+    size_t      ret[3*JIT_BLOCK_MAX+1];  // jumps to epilogue
+    int         num_rets;
+} jit_t;
+
+// x86-64 registers
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+#define REG_AR  R12
+#define REG_MR  R13
+#define REG_MD  R14
+#define REG_ARP R15
+
+// condition codes
+#define CC_C  0x2
+#define CC_Z  0x4
+#define CC_NZ 0x5
+
+// ALU /ext and opcodes
+#define ALU_ADD 0
+#define ALU_OR  1
+#define ALU_AND 4
+#define ALU_XOR 6
+#define SH_SHL  4
+#define SH_SHR  5
+#define SH_SAR  7
+
+#define OFF(field)       ((int32_t)offsetof(besk_t, field))
+#define OFF_MEM(a)       (OFF(MEM) + (int32_t)sizeof(halvord_t)*(a))
+#define OFF_MEMW(a)      (OFF(MEM) + (int32_t)sizeof(helord_t)*((a)>>1))
+#define OFF_DEC_FLAGS(a) (OFF(DEC) + (int32_t)sizeof(besk_decode_t)*(a) + \
+			  (int32_t)offsetof(besk_decode_t, flags))
+
+static inline void emit8(jit_t* jit, uint8_t b)
+{
+    jit->code[jit->pos++] = b;
+}
+
+static inline void emit32(jit_t* jit, uint32_t v)
+{
+    memcpy(jit->code + jit->pos, &v, 4);
+    jit->pos += 4;
+}
+
+static inline void emit64(jit_t* jit, uint64_t v)
+{
+    memcpy(jit->code + jit->pos, &v, 8);
+    jit->pos += 8;
+}
+
+static void emit_rex(jit_t* jit, int w, int reg, int rm)
+{
+    uint8_t rex = 0x40 | (w<<3) | ((reg>>3)<<2) | (rm>>3);
+    if (rex != 0x40)
+	emit8(jit, rex);
+}
+
+static void emit_op(jit_t* jit, int op)
+{
+    if (op > 0xFF)
+	emit8(jit, op >> 8);
+    emit8(jit, op);
+}
+
+// op reg, rm (register direct)
+static void emit_rr(jit_t* jit, int w, int op, int reg, int rm)
+{
+    emit_rex(jit, w, reg, rm);
+    emit_op(jit, op);
+    emit8(jit, 0xC0 | ((reg&7)<<3) | (rm&7));
+}
+
+// op reg, [rbx+disp32]
+static void emit_rm(jit_t* jit, int w, int op, int reg, int32_t disp)
+{
+    emit_rex(jit, w, reg, RBX);
+    emit_op(jit, op);
+    emit8(jit, 0x80 | ((reg&7)<<3) | RBX);
+    emit32(jit, disp);
+}
+
+static void mov_rr(jit_t* jit, int dst, int src)
+{
+    emit_rr(jit, 1, 0x89, src, dst);
+}
+
+static void load64(jit_t* jit, int dst, int32_t disp)
+{
+    emit_rm(jit, 1, 0x8B, dst, disp);
+}
+
+static void store64(jit_t* jit, int32_t disp, int src)
+{
+    emit_rm(jit, 1, 0x89, src, disp);
+}
+
+static void load32(jit_t* jit, int dst, int32_t disp)
+{
+    emit_rm(jit, 0, 0x8B, dst, disp);
+}
+
+#ifndef BESK_PACKED_MEM  // cells are read as words when packed
+static void load32s(jit_t* jit, int dst, int32_t disp)  // movsxd
+{
+    emit_rm(jit, 1, 0x63, dst, disp);
+}
+#endif
+
+static void store32(jit_t* jit, int32_t disp, int src)
+{
+    emit_rm(jit, 0, 0x89, src, disp);
+}
+
+static void store8(jit_t* jit, int32_t disp, int src)  // al, cl, dl
+{
+    emit_rm(jit, 0, 0x88, src, disp);
+}
+
+static void store8_imm(jit_t* jit, int32_t disp, uint8_t imm)
+{
+    emit_rm(jit, 0, 0xC6, 0, disp);
+    emit8(jit, imm);
+}
+
+static void store32_imm(jit_t* jit, int32_t disp, uint32_t imm)
+{
+    emit_rm(jit, 0, 0xC7, 0, disp);
+    emit32(jit, imm);
+}
+
+static void store64_imm(jit_t* jit, int32_t disp, int32_t imm)
+{
+    emit_rm(jit, 1, 0xC7, 0, disp);
+    emit32(jit, imm);
+}
+
+static void add64_mem_imm(jit_t* jit, int32_t disp, int32_t imm)
+{
+    emit_rm(jit, 1, 0x81, ALU_ADD, disp);
+    emit32(jit, imm);
+}
+
+// alu dst, src (0x01 add, 0x09 or, 0x21 and, 0x31 xor)
+static void alu_rr(jit_t* jit, int w, int op, int dst, int src)
+{
+    emit_rr(jit, w, op, src, dst);
+}
+
+// alu dst, imm32 (sign extended for w=1)
+static void alu_ri(jit_t* jit, int w, int ext, int dst, int32_t imm)
+{
+    emit_rr(jit, w, 0x81, ext, dst);
+    emit32(jit, imm);
+}
+
+static void shift_ri(jit_t* jit, int ext, int dst, uint8_t n)
+{
+    emit_rr(jit, 1, 0xC1, ext, dst);
+    emit8(jit, n);
+}
+
+static void mov_ri32(jit_t* jit, int dst, uint32_t imm)  // zero extends
+{
+    emit_rex(jit, 0, 0, dst);
+    emit8(jit, 0xB8 | (dst & 7));
+    emit32(jit, imm);
+}
+
+static void mov_ri64(jit_t* jit, int dst, uint64_t imm)
+{
+    emit_rex(jit, 1, 0, dst);
+    emit8(jit, 0xB8 | (dst & 7));
+    emit64(jit, imm);
+}
+
+static void setcc(jit_t* jit, int cc, int dst)  // al, cl, dl
+{
+    emit_rr(jit, 0, 0x0F90 | cc, 0, dst);
+}
+
+static void push(jit_t* jit, int r)
+{
+    emit_rex(jit, 0, 0, r);
+    emit8(jit, 0x50 | (r & 7));
+}
+
+static void pop(jit_t* jit, int r)
+{
+    emit_rex(jit, 0, 0, r);
+    emit8(jit, 0x58 | (r & 7));
+}
+
+// mask register to 40 bits
+static void mask40(jit_t* jit, int r)
+{
+    shift_ri(jit, SH_SHL, r, 24);
+    shift_ri(jit, SH_SHR, r, 24);
+}
+
+// sign extend 40 bit register
+static void sext40(jit_t* jit, int r)
+{
+    shift_ri(jit, SH_SHL, r, 24);
+    shift_ri(jit, SH_SAR, r, 24);
+}
+
+static size_t jcc32(jit_t* jit, int cc)
+{
+    emit8(jit, 0x0F);
+    emit8(jit, 0x80 | cc);
+    emit32(jit, 0);
+    return jit->pos - 4;
+}
+
+static size_t jmp32(jit_t* jit)
+{
+    emit8(jit, 0xE9);
+    emit32(jit, 0);
+    return jit->pos - 4;
+}
+
+static void patch32(jit_t* jit, size_t pos, size_t target)
+{
+    int32_t rel = (int32_t)(target - (pos + 4));
+    memcpy(jit->code + pos, &rel, 4);
+}
+
+static void call_abs(jit_t* jit, void* fn)
+{
+    mov_ri64(jit, RAX, (uint64_t)(uintptr_t)fn);
+    emit8(jit, 0xFF);
+    emit8(jit, 0xD0);  // call rax
+}
+
+// MD = operand of d
+static void emit_read(jit_t* jit, besk_decode_t* d)
+{
+    unsigned a = d->addr;
+#ifdef BESK_PACKED_MEM
+    if (d->flags & DECODE_H)  // helord_read, the word as stored
+	load64(jit, REG_MD, OFF_MEMW(a));
+    else if (a & 1) {  // halvord_read, low half of the word
+	load32(jit, REG_MD, OFF_MEMW(a));
+	alu_ri(jit, 0, ALU_AND, REG_MD, HALVORD_MASK);
+    }
+    else {
+	load64(jit, REG_MD, OFF_MEMW(a));
+	shift_ri(jit, SH_SHR, REG_MD, 20);
+	alu_ri(jit, 0, ALU_AND, REG_MD, HALVORD_MASK);
+	shift_ri(jit, SH_SHL, REG_MD, 20);
+    }
+#else
+    if (d->flags & DECODE_H) {  // helord_read
+	load32s(jit, REG_MD, OFF_MEM(a));
+	shift_ri(jit, SH_SHL, REG_MD, 20);
+	alu_ri(jit, 1, ALU_AND, REG_MD, (int32_t)0xFFF00000);
+	load32(jit, RAX, OFF_MEM(a+1));
+	alu_ri(jit, 0, ALU_AND, RAX, HALVORD_MASK);
+	alu_rr(jit, 1, 0x09, REG_MD, RAX);
+    }
+    else {  // halvord_read
+	load32(jit, REG_MD, OFF_MEM(a));
+	alu_ri(jit, 0, ALU_AND, REG_MD, HALVORD_MASK);
+	if (!(a & 1))
+	    shift_ri(jit, SH_SHL, REG_MD, 20);
+    }
+#endif
+}
+
+static void emit_exit_later(jit_t* jit, size_t pos, halvord_t KR,
+			    halvord_t INS, uint32_t count, uint32_t code)
+{
+    jit_exit_t* e = &jit->exit[jit->num_exits++];
+    e->pos = pos;
+    e->KR = KR;
+    e->INS = INS;
+    e->count = count;
+    e->code = code;
+}
+
+static void emit_exit(jit_t* jit, halvord_t KR, halvord_t INS,
+		      uint32_t count, uint32_t code)
+{
+    store32_imm(jit, OFF(KR), KR);
+    store32_imm(jit, OFF(INS), INS);
+    if (count)
+	add64_mem_imm(jit, OFF(count), count);
+    mov_ri32(jit, RAX, code);
+    jit->ret[jit->num_rets++] = jmp32(jit);  // jmp epilogue
+}
+
+// invalidate predecoded cells a (and a+1 for helord) after a store and
+// leave the block if the store hit translated code
+static void emit_store_check(jit_t* jit, besk_decode_t* d, halvord_t KR,
+			     uint32_t count)
+{
+    unsigned a = d->addr;
+    uint32_t code = JIT_EXIT_INVALIDATE | a;
+
+    emit_rm(jit, 0, 0x0FB6, RAX, OFF_DEC_FLAGS(a));  // movzx eax, flags
+    store8_imm(jit, OFF_DEC_FLAGS(a), 0);
+    if (d->flags & DECODE_H) {
+	emit_rm(jit, 0, 0x0A, RAX, OFF_DEC_FLAGS(a+1));  // or al, flags
+	store8_imm(jit, OFF_DEC_FLAGS(a+1), 0);
+	code |= JIT_EXIT_HELORD;
+    }
+    emit8(jit, 0xA8); emit8(jit, DECODE_JIT);  // test al, DECODE_JIT
+    emit_exit_later(jit, jcc32(jit, CC_NZ), KR, d->ins, count, code);
+}
+
+// [AS] = AR (ord_write)
+static void emit_write(jit_t* jit, besk_decode_t* d, halvord_t KR,
+		       uint32_t count)
+{
+    unsigned a = d->addr;
+
+#ifdef BESK_PACKED_MEM
+    if (!(d->flags & DECODE_H) && (a & 1)) {  // halvord_write, low half
+	load32(jit, RAX, OFF_MEMW(a));
+	alu_ri(jit, 0, ALU_AND, RAX, ~HALVORD_MASK);
+	mov_rr(jit, RCX, REG_AR);
+	alu_ri(jit, 0, ALU_AND, RCX, HALVORD_MASK);
+	alu_rr(jit, 0, 0x09, RAX, RCX);
+	store32(jit, OFF_MEMW(a), RAX);
+    }
+    else {  // AR bits 51..0 sign extended
+	mov_rr(jit, RAX, REG_AR);
+	shift_ri(jit, SH_SHL, RAX, 12);
+	shift_ri(jit, SH_SAR, RAX, 12);
+	if (!(d->flags & DECODE_H)) {  // halvord_write, keep the low half
+	    alu_ri(jit, 1, ALU_AND, RAX, ~HALVORD_MASK);
+	    load32(jit, RCX, OFF_MEMW(a));
+	    alu_ri(jit, 0, ALU_AND, RCX, HALVORD_MASK);
+	    alu_rr(jit, 1, 0x09, RAX, RCX);
+	}
+	store64(jit, OFF_MEMW(a), RAX);
+    }
+#else
+    if (d->flags & DECODE_H) {  // helord_write
+	mov_rr(jit, RAX, REG_AR);
+	shift_ri(jit, SH_SHR, RAX, 20);
+	store32(jit, OFF_MEM(a), RAX);
+	mov_rr(jit, RAX, REG_AR);
+	alu_ri(jit, 0, ALU_AND, RAX, HALVORD_MASK);
+	store32(jit, OFF_MEM(a+1), RAX);
+    }
+    else {  // halvord_write
+	mov_rr(jit, RAX, REG_AR);
+	if (a & 1)
+	    alu_ri(jit, 0, ALU_AND, RAX, HALVORD_MASK);
+	else
+	    shift_ri(jit, SH_SHR, RAX, 20);
+	store32(jit, OFF_MEM(a), RAX);
+    }
+#endif
+    emit_store_check(jit, d, KR, count);
+}
+
+// address part of [AS] = AR (addr_write)
+static void emit_addr_write(jit_t* jit, besk_decode_t* d, halvord_t KR,
+			    uint32_t count)
+{
+    unsigned a = d->addr;
+#ifdef BESK_PACKED_MEM
+    uint64_t m;
+
+    // [a] ^= ([a] ^ AR) & m, m the address bits of the cells written
+    if (d->flags & DECODE_H)
+	m = ((uint64_t)HALVORD_ADDR << 20) | HALVORD_ADDR;
+    else if (a & 1)
+	m = HALVORD_ADDR;
+    else
+	m = (uint64_t)HALVORD_ADDR << 20;
+    load64(jit, RAX, OFF_MEMW(a));
+    mov_rr(jit, RCX, REG_AR);
+    alu_rr(jit, 1, 0x31, RCX, RAX);
+    mov_ri64(jit, RDX, m);
+    alu_rr(jit, 1, 0x21, RCX, RDX);
+    alu_rr(jit, 1, 0x31, RAX, RCX);
+    store64(jit, OFF_MEMW(a), RAX);
+#else
+    int i;
+
+    for (i = 0; i < ((d->flags & DECODE_H) ? 2 : 1); i++) {
+	mov_rr(jit, RCX, REG_AR);
+	if (((d->flags & DECODE_H) && (i == 0)) ||
+	    (!(d->flags & DECODE_H) && !(a & 1)))
+	    shift_ri(jit, SH_SHR, RCX, 20);
+	alu_ri(jit, 0, ALU_AND, RCX, HALVORD_ADDR);
+	load32(jit, RAX, OFF_MEM(a+i));
+	alu_ri(jit, 0, ALU_AND, RAX, ~HALVORD_OP);
+	alu_rr(jit, 0, 0x09, RAX, RCX);
+	store32(jit, OFF_MEM(a+i), RAX);
+    }
+#endif
+    emit_store_check(jit, d, KR, count);
+}
+
+// AR = RAX + AR, SI = overflow (helord_add_oflw)
+static void emit_add_oflw(jit_t* jit)
+{
+    mov_rr(jit, RCX, RAX);
+    shift_ri(jit, SH_SHR, RCX, 39);
+    setcc(jit, CC_NZ, RCX);           // cl = a>>39 != 0
+    mov_rr(jit, RDX, REG_AR);
+    shift_ri(jit, SH_SHR, RDX, 39);
+    setcc(jit, CC_NZ, RDX);           // dl = b>>39 != 0
+    alu_rr(jit, 1, 0x01, REG_AR, RAX);
+    mask40(jit, REG_AR);
+    mov_rr(jit, RAX, REG_AR);
+    shift_ri(jit, SH_SHR, RAX, 39);   // al = r>>39
+    alu_rr(jit, 0, 0x30, RDX, RCX);   // xor dl,cl: sign(a) != sign(b)
+    alu_rr(jit, 0, 0x30, RAX, RCX);   // xor al,cl: sign(r) != sign(a)
+    emit8(jit, 0x80); emit8(jit, 0xF2); emit8(jit, 0x01);  // xor dl,1
+    alu_rr(jit, 0, 0x20, RAX, RDX);   // and al,dl
+    store8(jit, OFF(SI), RAX);
+}
+
+// RAX = helord_neg(RAX)
+static void emit_neg(jit_t* jit)
+{
+    emit_rr(jit, 1, 0xF7, 3, RAX);  // neg rax
+    mask40(jit, RAX);
+}
+
+// RAX = helord_abs(RAX)
+static void emit_abs(jit_t* jit)
+{
+    mov_rr(jit, RCX, RAX);
+    emit_rr(jit, 1, 0xF7, 3, RCX);          // neg rcx
+    mask40(jit, RCX);
+    emit_rr(jit, 1, 0x0FBA, 4, RAX);        // bt rax, 39
+    emit8(jit, 39);
+    emit_rr(jit, 1, 0x0F40 | CC_C, RAX, RCX);  // cmovc rax, rcx
+}
+
+// (AR,MR) = MD*MR + c0 (helord_muladd), c0 in RCX
+static void emit_muladd(jit_t* jit)
+{
+    mov_rr(jit, RSI, RCX);            // c0
+    mov_rr(jit, RAX, REG_MD);
+    sext40(jit, RAX);
+    mov_rr(jit, RCX, REG_MR);
+    sext40(jit, RCX);
+    emit_rr(jit, 1, 0xF7, 5, RCX);    // imul rcx: rdx:rax = p
+    mov_rr(jit, RCX, RAX);
+    mask40(jit, RCX);                 // p0
+    emit_rr(jit, 1, 0x0FAC, RDX, RAX);  // shrd rax, rdx, 39
+    emit8(jit, 39);
+    mask40(jit, RAX);                 // p1
+    alu_rr(jit, 1, 0x01, RCX, RSI);   // p0 + c0
+    mov_rr(jit, RDX, RCX);
+    shift_ri(jit, SH_SHR, RDX, 40);
+    alu_ri(jit, 0, ALU_AND, RDX, 1);  // carry
+    mask40(jit, RCX);                 // L
+    alu_rr(jit, 1, 0x01, RAX, RDX);
+    mask40(jit, RAX);                 // H
+    mov_rr(jit, REG_AR, RAX);
+    mov_rr(jit, RAX, RCX);
+    shift_ri(jit, SH_SHR, RAX, 39);
+    store8(jit, OFF(AR40), RAX);      // AR40 = sign(L)
+    mov_rr(jit, REG_MR, RCX);
+    shift_ri(jit, SH_SHR, REG_MR, 1); // MR = L >> 1
+    store8_imm(jit, OFF(SI), 0);
+}
+
+// run one instruction with besk_step, KR, INS and the zeroing by
+// besk_step0 are already done
+static void jit_step(besk_t* state, halvord_t KR, halvord_t INS)
+{
+    state->KR  = KR;
+    state->INS = INS;
+    besk_step(state);
+}
+
+static void emit_step(jit_t* jit, halvord_t KR, halvord_t INS)
+{
+    store64(jit, OFF(AR), REG_AR);
+    store64(jit, OFF(MR), REG_MR);
+    store64(jit, OFF(MD), REG_MD);
+    store64(jit, OFF(ARP), REG_ARP);
+    mov_rr(jit, RDI, RBX);
+    mov_ri32(jit, RSI, KR);
+    mov_ri32(jit, RDX, INS);
+    call_abs(jit, jit_step);
+    load64(jit, REG_AR, OFF(AR));
+    load64(jit, REG_MR, OFF(MR));
+    load64(jit, REG_MD, OFF(MD));
+}
+
+// operations run by the interpreter (end of block)
+static int jit_interpreted(halvord_t INS)
+{
+    switch(N(INS)) {
+    case OP_READ5_: case OP_UNDEF16: case OP_UNDEF17: case OP_READ4x10:
+    case OP_UNDEF1A: case OP_RD: case OP_WRITE4: case OP_WRITE:
+    case OP_UNDEF1E: case OP_WD:
+	return 1;
+    default:
+	return 0;
+    }
+}
+
+static void jit_flush(jit_t* jit, besk_t* state)
+{
+    int i;
+    for (i = 0; i < NUM_HALF_CELLS; i++)
+	state->DEC[i].flags &= ~DECODE_JIT;
+    memset(jit->block, 0, sizeof(jit->block));
+    jit->pos = 0;
+}
+
+// translate block starting at KR, return NULL if first instruction
+// must be interpreted
+static jit_block_t* jit_compile(jit_t* jit, besk_t* state, halvord_t KR0)
+{
+    size_t start;
+    halvord_t KR = KR0;
+    halvord_t last = 0;
+    uint32_t count = 0;  // instructions executed inline
+    int len = 0;
+    int done = 0;
+    int i;
+
+    if (JIT_CODE_SIZE - jit->pos < (JIT_BLOCK_MAX+4)*JIT_INSTR_BYTES)
+	jit_flush(jit, state);
+    start = jit->pos;
+    jit->num_exits = 0;
+    jit->num_rets = 0;
+
+    push(jit, RBX); push(jit, R12); push(jit, R13); push(jit, R14);
+    push(jit, R15);
+    mov_rr(jit, RBX, RDI);
+    load64(jit, REG_AR, OFF(AR));
+    load64(jit, REG_MR, OFF(MR));
+    load64(jit, REG_MD, OFF(MD));
+    load64(jit, REG_ARP, OFF(ARP));
+
+    while (!done && (len < JIT_BLOCK_MAX) && (KR < JIT_NUM_KR)) {
+	besk_decode_t* d = besk_decode(state, KR);
+	halvord_t INS = d->ins;
+	halvord_t AS = d->w;
+
+	if ((d->flags & DECODE_STOP) || jit_interpreted(INS))
+	    break;
+	d->flags |= DECODE_JIT;
+	len++;
+	last = INS;
+
+	// besk_step0
+	mov_rr(jit, REG_ARP, REG_AR);
+	if (d->flags & DECODE_Z) {
+	    alu_rr(jit, 0, 0x31, REG_AR, REG_AR);
+	    store8_imm(jit, OFF(AR00), 0);
+	    store8_imm(jit, OFF(AR40), 0);
+	    store8_imm(jit, OFF(SI), 0);
+	}
+
+	switch(d->n) {
+	case OP_BAND:
+	    emit_read(jit, d);
+	    alu_rr(jit, 1, 0x01, REG_AR, REG_MD);
+	    alu_rr(jit, 1, 0x21, REG_AR, REG_MR);
+	    store8_imm(jit, OFF(SI), 0);
+	    count++;
+	    break;
+
+	case OP_MOVMR:
+	    mov_rr(jit, REG_AR, REG_MR);
+	    alu_rr(jit, 0, 0x31, REG_MR, REG_MR);
+	    store8_imm(jit, OFF(SI), 0);
+	    count++;
+	    break;
+
+	case OP_MUL:
+	    emit_read(jit, d);
+	    mov_rr(jit, RCX, REG_AR);
+	    shift_ri(jit, SH_SHR, RCX, 39);
+	    alu_ri(jit, 0, ALU_AND, RCX, 1);
+	    emit_muladd(jit);
+	    count++;
+	    break;
+
+	case OP_MULR:
+	    emit_read(jit, d);
+	    mov_ri64(jit, RCX, HELORD_SIGN);
+	    emit_muladd(jit);
+	    count++;
+	    break;
+
+	case OP_ADDST:
+	    emit_read(jit, d);
+	    if (d->flags & DECODE_Z)
+		mov_ri32(jit, REG_AR, 0x0020000200);
+	    mov_rr(jit, RAX, REG_MD);
+	    emit_add_oflw(jit);
+	    count++;
+	    emit_write(jit, d, KR+1, count);
+	    break;
+
+	case OP_STORA:
+	    count++;
+	    emit_addr_write(jit, d, KR+1, count);
+	    break;
+
+	case OP_ADDMR:
+	case OP_ADD:
+	    emit_read(jit, d);
+	    mov_rr(jit, RAX, REG_MD);
+	    emit_add_oflw(jit);
+	    if (d->n == OP_ADDMR)
+		mov_rr(jit, REG_MR, REG_AR);
+	    count++;
+	    break;
+
+	case OP_SUBMR:
+	case OP_SUB:
+	case OP_AADD:
+	case OP_ASUB:
+	    emit_read(jit, d);
+	    mov_rr(jit, RAX, REG_MD);
+	    if ((d->n == OP_AADD) || (d->n == OP_ASUB))
+		emit_abs(jit);
+	    if (d->n != OP_AADD)
+		emit_neg(jit);
+	    emit_add_oflw(jit);
+	    if (d->n == OP_SUBMR)
+		mov_rr(jit, REG_MR, REG_AR);
+	    count++;
+	    break;
+
+	case OP_STORE:
+	    count++;
+	    emit_write(jit, d, KR+1, count);
+	    break;
+
+	case OP_JC:
+	    count++;
+	    emit_rm(jit, 0, 0x0FB6, RAX, OFF(SI));  // movzx eax, SI
+	    alu_rr(jit, 0, 0x85, RAX, RAX);
+	    emit_exit_later(jit, jcc32(jit, CC_NZ), AS, INS, count, 0);
+	    done = 1;
+	    break;
+
+	case OP_JMP:
+	    count++;
+	    emit_exit(jit, AS, INS, count, 0);
+	    done = 2;
+	    break;
+
+	case OP_JGE:  // see besk_step, AR is unsigned
+	    count++;
+	    if (d->flags & DECODE_Z) {
+		mov_rr(jit, REG_AR, REG_ARP);  // jlt, not taken
+		done = 1;
+	    }
+	    else {
+		emit_exit(jit, AS, INS, count, 0);  // jge, always taken
+		done = 2;
+	    }
+	    break;
+
+	case OP_FUNC: {
+	    static const int Fop[8] = { 0, 0, 0, 0, 1, 1, 2, 2 };
+	    if ((AS & ~0x00E) == 0) {
+		store64(jit, (AS & 0x008) ? OFF(Fy) : OFF(Fx), REG_AR);
+		store64_imm(jit, OFF(Fop), Fop[AS & 7]);
+	    }
+	    count++;
+	    break;
+	}
+
+	default:  // shifts, div, rev, norm
+	    emit_step(jit, KR, INS);
+	    break;
+	}
+	KR++;
+    }
+
+    if (len == 0) {
+	jit->pos = start;
+	return NULL;
+    }
+    if (done != 2)  // fall through to next instruction
+	emit_exit(jit, KR, last, count, 0);
+
+    // out of line exits
+    for (i = 0; i < jit->num_exits; i++) {
+	jit_exit_t* e = &jit->exit[i];
+	patch32(jit, e->pos, jit->pos);
+	emit_exit(jit, e->KR, e->INS, e->count, e->code);
+    }
+    // epilogue
+    for (i = 0; i < jit->num_rets; i++)
+	patch32(jit, jit->ret[i], jit->pos);
+    store64(jit, OFF(AR), REG_AR);
+    store64(jit, OFF(MR), REG_MR);
+    store64(jit, OFF(MD), REG_MD);
+    store64(jit, OFF(ARP), REG_ARP);
+    pop(jit, R15); pop(jit, R14); pop(jit, R13); pop(jit, R12);
+    pop(jit, RBX);
+    emit8(jit, 0xC3);  // ret
+
+    jit->block[KR0].fn  = (jit_fn_t) (jit->code + start);
+    jit->block[KR0].len = len;
+    return &jit->block[KR0];
+}
+
+static jit_t* jit_create(besk_t* state)
+{
+    jit_t* jit;
+    if ((jit = calloc(1, sizeof(jit_t))) == NULL)
+	return NULL;
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC,
+		     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+	fprintf(stderr, "besk_jit: unable to map code buffer\n");
+	free(jit);
+	return NULL;
+    }
+    state->jit = jit;
+    return jit;
+}
+
+// release translated code, jit_run creates it again when needed
+void jit_destroy(besk_t* state)
+{
+    jit_t* jit = state->jit;
+    int i;
+
+    if (jit == NULL)
+	return;
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+    state->jit = NULL;
+    for (i = 0; i < NUM_HALF_CELLS; i++)
+	state->DEC[i].flags &= ~DECODE_JIT;
+}
+
+// drop blocks covering cell addr
+void jit_invalidate(besk_t* state, unsigned addr)
+{
+    jit_t* jit = state->jit;
+    int base, kr;
+
+    if (jit == NULL)
+	return;
+    addr &= 0x7ff;
+    for (base = addr; base < JIT_NUM_KR; base += NUM_HALF_CELLS) {
+	for (kr = base; (kr >= 0) && (kr > base-JIT_BLOCK_MAX); kr--) {
+	    jit_block_t* b = &jit->block[kr];
+	    if (b->fn && (kr + b->len > base))
+		b->fn = NULL;
+	}
+    }
+    state->DEC[addr].flags &= ~DECODE_JIT;
+}
+
+// Execute at most n instructions, return number of instructions executed.
+// Stops after STOP or error (running = 0)
+uint64_t jit_run(besk_t* state, uint64_t n)
+{
+    jit_t* jit = state->jit;
+    uint64_t count0 = state->count;
+
+    if ((jit == NULL) && ((jit = jit_create(state)) == NULL))
+	goto interpret;
+
+    while (state->running && ((state->count - count0) < n)) {
+	halvord_t KR = state->KR;
+	jit_block_t* b = NULL;
+	uint32_t r;
+
+	if (!state->trace && ((unsigned)KR < JIT_NUM_KR)) {
+	    b = &jit->block[KR];
+	    if (b->fn == NULL)
+		b = jit_compile(jit, state, KR);
+	}
+	if ((b == NULL) || (b->len > n - (state->count - count0))) {
+	    besk_step0(state);
+	    besk_step(state);
+	    continue;
+	}
+	r = b->fn(state);
+	if (r & JIT_EXIT_INVALIDATE) {
+	    jit_invalidate(state, r & 0x7ff);
+	    if (r & JIT_EXIT_HELORD)
+		jit_invalidate(state, (r+1) & 0x7ff);
+	}
+    }
+    return state->count - count0;
+
+interpret:
+    while (state->running && ((state->count - count0) < n)) {
+	besk_step0(state);
+	besk_step(state);
+    }
+    return state->count - count0;
+}
+
+#else
+
+void jit_invalidate(besk_t* state, unsigned addr)
+{
+    (void) state;
+    (void) addr;
+}
+
+void jit_destroy(besk_t* state)
+{
+    (void) state;
+}
+
+// no translator for this host, run the interpreter
+uint64_t jit_run(besk_t* state, uint64_t n)
+{
+    uint64_t count0 = state->count;
+    while (state->running && ((state->count - count0) < n)) {
+	besk_step0(state);
+	besk_step(state);
+    }
+    return state->count - count0;
+}
+
+#endif
@@ -0,0 +1,651 @@
+//
+//  BESK command line emulator, runs one machine from libbesk
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+
+#include "besk.h"
+
+#ifdef SIMULATOR
+extern void simulator_init(int argc, char** argv, besk_t* st);
+extern void simulator_run(besk_t* st);
+#define SIMULATOR_INIT(ac,av,st) simulator_init((ac),(av),(st))
+#define SIMULATOR_RUN(st)  simulator_run(st)
+#else
+#define SIMULATOR_INIT(ac,av,st)
+#define SIMULATOR_RUN(st)
+#endif
+
+#define THREADED_BURST 1000000  // max instructions per call from main
+#define MAX_BREAK      16       // max number of -b options
+#define FAST_BURST     100000   // instructions per call with -F
+#define SIM_PERIOD     16000000 // ns between simulator updates with -F
+#define PROF_PERIOD    1000     // mean instructions between timed ones, -p
+#define EXPLORE_MAX    100000000 // instructions per variant, -E
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void sigint_handler(int sig)
+{
+    (void) sig;
+    interrupted = 1;
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: besk [options] [file]\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "  -a <addr>  start address\n");
+    fprintf(stderr, "  -e <addr>  end address\n");    
+    fprintf(stderr, "  -b <addr>  breakpoint (threaded core)\n");
+    fprintf(stderr, "  -i <filename> of input  (INREMSA)\n");
+    fprintf(stderr, "  -u <filename> of output (UTREMSA)\n");
+    fprintf(stderr, "  -d <filename> of drum   (DRUM.dat)\n");    
+    fprintf(stderr, "  -s         single step\n");
+    fprintf(stderr, "  -t         trace instruction\n");    
+    fprintf(stderr, "  -S         Simulator\n");
+    fprintf(stderr, "  -F         full speed, update simulator every 16ms\n");
+    fprintf(stderr, "  -c <core>  interpreter core: switch|threaded|jit\n");
+    fprintf(stderr, "  -q         do not run\n");
+    fprintf(stderr, "  -m r       dump registers\n");    
+    fprintf(stderr, "  -m m       dump memory\n");
+    fprintf(stderr, "  -m p       dump program\n");
+    fprintf(stderr, "  -m i       instruction count and speed\n");
+    fprintf(stderr, "  -m f       superinstruction counts (threaded core)\n");
+    fprintf(stderr, "  -p         profile, printed at exit (switch|threaded core)\n");
+    fprintf(stderr, "  -H <n>     time one instruction in about n when profiling\n");
+    fprintf(stderr, "             (default 1000, 0=no host time)\n");
+    fprintf(stderr, "  -o <file>  write opcode profile as CSV (implies -p)\n");
+    fprintf(stderr, "  -R <n>     record last n instructions (default 65536, 0=off)\n");
+    fprintf(stderr, "  -r <file>  recorder dump on stop or SIGINT (RECORDER)\n");
+    fprintf(stderr, "  -w <file>  write snapshot on stop\n");
+    fprintf(stderr, "  -n <n>     write snapshot every n instructions (SNAPSHOT)\n");
+    fprintf(stderr, "  -l <file>  resume from snapshot, no program is loaded\n");
+    fprintf(stderr, "  -E <file>  explore variants in forked copies, print results\n");
+    fprintf(stderr, "  -k <addr>  fork variants when KR reaches addr\n");
+    fprintf(stderr, "  -K <n>     fork variants after n instructions\n");
+    fprintf(stderr, "  -j <n>     max number of running variants (default cores)\n");
+    fprintf(stderr, "  -N <n>     instruction budget per variant (default 100000000,\n");
+    fprintf(stderr, "             0=run to STOP)\n");
+    fprintf(stderr, "  -L <file>  record device I/O log\n");
+    fprintf(stderr, "  -P <file>  replay device I/O log, no tape or drum file is used\n");
+    fprintf(stderr, "  -T <n>     time travel, keyframe every n instructions (switch core, not -F)\n");
+    fprintf(stderr, "  -M <n>     time travel keyframes kept (default 64)\n");
+    fprintf(stderr, "  -D <n>     time travel delta log entries (default 1048576)\n");
+    exit(1);
+}
+
+int clamp(int x, int a, int b)
+{
+    if (x < a) return a;
+    if (x > b) return b;
+    return x;
+}
+
+// instructions to run, at most n and not past the next snapshot
+static uint64_t burst(besk_t* state, uint64_t n, uint64_t snap_every,
+		      uint64_t snap_next)
+{
+    if (snap_every && (snap_next - state->count < n))
+	return snap_next - state->count;
+    return n;
+}
+
+// run n instructions, then until KR is at addr when addr >= 0.
+// return 0 when there or -1 when the machine stopped or is idle
+static int run_to(besk_t* state, int core, halvord_t addr, uint64_t n)
+{
+    besk_run_t r = besk_exec(state, core, n);
+
+    if (addr >= 0) {
+	besk_break(state, addr, 1);
+	while (state->running && (state->KR != addr) &&
+	       (r.reason != BESK_RUN_IDLE))
+	    r = besk_exec(state, BESK_CORE_THREADED, UINT64_MAX);
+	besk_break(state, addr, 0);
+    }
+    if (!state->running || (r.reason == BESK_RUN_IDLE))
+	return -1;
+    return 0;
+}
+
+static void tt_where(besk_t* state)
+{
+    printf("#%lu KR=%03X INS=%05X\n", state->count, state->KR,
+	   mem_get(state->MEM, state->KR & 0x7ff));
+}
+
+// time travel prompt, entered when the machine stops, returns when
+// continued or quit
+static void tt_prompt(besk_t* state)
+{
+    char line[256];
+
+    tt_where(state);
+    while (printf("tt> "), fflush(stdout),
+	   fgets(line, sizeof(line), stdin) != NULL) {
+	uint64_t n = strtoull(line+1, NULL, 0);
+	switch(line[0]) {
+	case 'b':
+	    if (n == 0) n = 1;
+	    if ((n > state->count) || (besk_tt_seek(state, state->count-n) < 0))
+		printf("not in history\n");
+	    break;
+	case 'w': {
+	    unsigned addr = strtoul(line+1, NULL, 16) & 0x7ff;
+	    int64_t c = besk_tt_last_write(state, addr);
+	    if ((c < 0) || (besk_tt_seek(state, c) < 0))
+		printf("no write of %03X in history\n", addr);
+	    break;
+	}
+	case 'g':
+	    if (besk_tt_seek(state, n) < 0)
+		printf("not in history\n");
+	    break;
+	case 's':
+	    besk_tt_seek(state, state->count+1);
+	    break;
+	case 'r':
+	    dump_registers(stdout, state);
+	    continue;
+	case 'c':
+	    state->running = 1;
+	    return;
+	case 'q':
+	    state->quit = 1;
+	    return;
+	case '\n':
+	    continue;
+	default:
+	    printf("b [n]     step back n instructions\n"
+		   "w <addr>  back to the last write of addr (hex)\n"
+		   "g <n>     go to instruction number n\n"
+		   "s         step\n"
+		   "r         registers\n"
+		   "c         continue\n"
+		   "q         quit\n");
+	    continue;
+	}
+	tt_where(state);
+    }
+    state->quit = 1;
+}
+
+int main(int argc, char** argv)
+{
+    besk_t* state;
+    FILE* f;
+    FILE* fin;
+    FILE* fut;
+    FILE* fdrum;
+    char* filename = "*stdin*";
+    char* utremsa_name = "UTREMSA";
+    char* inremsa_name = "INREMSA";
+    char* drum_name = "DRUM.dat";
+    halvord_t addr;
+    halvord_t start = -1;
+    halvord_t end = -1;
+    int sim = 0;
+    int fast = 0;
+    int prof = 0;
+    uint32_t prof_period = PROF_PERIOD;
+    char* csv_name = NULL;
+    uint32_t rec_size = REC_SIZE;
+    char* rec_name = "RECORDER";
+    char* snap_name = NULL;
+    int snap_stop = 0;
+    uint64_t snap_every = 0;
+    uint64_t snap_next = 0;
+    char* resume_name = NULL;
+    char* explore_name = NULL;
+    halvord_t explore_kr = -1;
+    uint64_t explore_count = 0;
+    uint64_t explore_max = EXPLORE_MAX;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    char* io_name = NULL;
+    int io_replay = 0;
+    uint64_t tt_interval = 0;
+    uint32_t tt_keyframes = 64;
+    uint32_t tt_deltas = 1 << 20;
+    int was_running = 0;
+    int step = 0;
+    int quit = 0;
+    char* mdump = "";
+    int trace = 0;
+    int opt;
+    int xpos = 1, ypos = 1;
+    int core = BESK_CORE_SWITCH;
+    halvord_t brk[MAX_BREAK];
+    int nbrk = 0;
+    halvord_t brk_kr = -1;  // continue from this breakpoint
+    int i;
+    struct timespec t0, t1;
+    struct timespec tsim, tnow;
+    
+    while ((opt = getopt(argc, argv, "tSFpH:o:R:r:w:n:l:E:k:K:N:j:L:P:T:M:D:sqi:u:d:a:e:b:x:y:m:c:")) != -1) {
+	switch(opt) {
+	case 'a': {
+	    char* eptr;
+	    start = strtol(optarg, &eptr, 0);
+	    if (*eptr != '\0') usage();
+	    break;
+	}
+	case 'e': {
+	    char* eptr;
+	    end = strtol(optarg, &eptr, 0);
+	    if (*eptr != '\0') usage();
+	    break;
+	}
+	case 'b': {
+	    char* eptr;
+	    if (nbrk >= MAX_BREAK) usage();
+	    brk[nbrk++] = strtol(optarg, &eptr, 0);
+	    if (*eptr != '\0') usage();
+	    break;
+	}	    
+	case 'S':
+	    sim = 1;
+	    break;
+	case 'F':
+	    fast = 1;
+	    break;
+	case 'p':
+	    prof = 1;
+	    break;
+	case 'H': {
+	    char* eptr;
+	    prof_period = strtoul(optarg, &eptr, 0);
+	    if (*eptr != '\0') usage();
+	    break;
+	}
+	case 'o':
+	    prof = 1;
+	    csv_name = optarg;
+	    break;
+	case 'R': {
+	    char* eptr;
+	    rec_size = strtoul(optarg, &eptr, 0);
+	    if (*eptr != '\0') usage();
+	    break;
+	}
+	case 'r':
+	    rec_name = optarg;
+	    break;
+	case 'w':
+	    snap_name = optarg;
+	    snap_stop = 1;
+	    break;
+	case 'n': {
+	    char* eptr;
+	    snap_every = strtoull(optarg, &eptr, 0);
+	    if (*eptr != '\0') usage();
+	    break;
+	}
+	case 'l':
+	    resume_name = optarg;
+	    break;
+	case 'E':
+	    explore_name = optarg;
+	    break;
+	case 'k': {
+	    char* eptr;
+	    explore_kr = strtol(optarg, &eptr, 0) & 0x7ff;
+	    if (*eptr != '\0') usage();
+	    break;
+	}
+	case 'K': {
+	    char* eptr;
+	    explore_count = strtoull(optarg, &eptr, 0);
+	    if (*eptr != '\0') usage();
+	    break;
+	}
+	case 'N': {
+	    char* eptr;
+	    explore_max = strtoull(optarg, &eptr, 0);
+	    if (*eptr != '\0') usage();
+	    break;
+	}
+	case 'j':
+	    jobs = atoi(optarg);
+	    break;
+	case 'L':
+	    io_name = optarg;
+	    io_replay = 0;
+	    break;
+	case 'P':
+	    io_name = optarg;
+	    io_replay = 1;
+	    break;
+	case 'T': {
+	    char* eptr;
+	    tt_interval = strtoull(optarg, &eptr, 0);
+	    if ((*eptr != '\0') || (tt_interval == 0)) usage();
+	    break;
+	}
+	case 'M': {
+	    char* eptr;
+	    unsigned long n = strtoul(optarg, &eptr, 0);
+	    if ((*eptr != '\0') || (n == 0) || (n > TT_MAX_SIZE)) usage();
+	    tt_keyframes = n;
+	    break;
+	}
+	case 'D': {
+	    char* eptr;
+	    unsigned long n = strtoul(optarg, &eptr, 0);
+	    if ((*eptr != '\0') || (n == 0) || (n > TT_MAX_SIZE)) usage();
+	    tt_deltas = n;
+	    break;
+	}
+	case 's':
+	    step = 1;
+	    break;
+	case 'm':
+	    mdump = optarg;
+	    break;
+	case 't':
+	    trace = 1;
+	    break;
+	case 'i': // set inremsa
+	    inremsa_name = optarg;
+	    break;
+	case 'u': // set utremsa
+	    utremsa_name = optarg;
+	    break;
+	case 'd': // set drum memory file name
+	    drum_name = optarg;
+	    break;	    
+	case 'x':
+	    xpos = atoi(optarg);
+	    xpos = clamp(xpos, 1, 8);
+	    break;
+	case 'y':
+	    ypos = atoi(optarg);
+	    ypos = clamp(ypos, 1, 8);
+	    break;
+	case 'q':
+	    quit = 1;
+	    break;
+	case 'c':
+	    if (strcmp(optarg, "switch") == 0)
+		core = BESK_CORE_SWITCH;
+	    else if (strcmp(optarg, "threaded") == 0)
+		core = BESK_CORE_THREADED;
+	    else if (strcmp(optarg, "jit") == 0)
+		core = BESK_CORE_JIT;
+	    else
+		usage();
+	    break;
+	default:
+	    usage();
+	}
+    }
+
+    if (resume_name) {
+	f = NULL;
+	filename = resume_name;
+    }
+    else if (optind >= argc) {
+	f = stdin;
+	filename = "*stdin*";
+    }
+    else {
+	if ((f = fopen(argv[optind], "r")) == NULL) {
+	    fprintf(stderr, "unable to open file %s\n", argv[optind]);
+	    usage();
+	}
+	filename = argv[optind];
+    }
+    if (io_replay) {  // devices are fed from the io log
+	fin = NULL;
+	fut = NULL;
+	fdrum = NULL;
+    }
+    else {
+	if ((fin = fopen(inremsa_name, "r")) == NULL) {
+	    fprintf(stderr, "unable to open input paper tape file %s\n",
+		    inremsa_name);
+	    exit(1);
+	}
+	// continue the output tape of the snapshot, besk_restore cuts it
+	if ((resume_name == NULL) ||
+	    ((fut = fopen(utremsa_name, "r+")) == NULL))
+	    fut = fopen(utremsa_name, "w");
+	if (fut == NULL) {
+	    fprintf(stderr, "unable to open output paper tape file %s\n",
+		    utremsa_name);
+	    exit(1);
+	}
+	if ((fdrum = fopen(drum_name, "rw")) == NULL) {
+	    fprintf(stderr, "unable to open output drum file %s\n",
+		    drum_name);
+	    exit(1);
+	}
+    }
+
+    if ((state = besk_create()) == NULL) {
+	fprintf(stderr, "unable to allocate machine\n");
+	exit(1);
+    }
+    state->Fpos_x = xpos;
+    state->Fpos_y = ypos;
+    state->quit = quit;
+    // state->page = TELEX_PAGE_LTR; // do we start here?
+
+    state->in = fin;
+    state->ut = fut;
+    state->drum = fdrum;
+    if (resume_name) {
+	if (besk_restore(state, resume_name) < 0)
+	    exit(1);
+	addr = state->KR;
+    }
+    else {
+	addr = besk_load(state, f, filename, 1);
+	if ((addr < 0) && (start < 0)) {
+	    fprintf(stderr, "neither program or start address is given\n");
+	    usage();
+	}
+	if (f != stdin)
+	    fclose(f);
+    }
+
+    if (sim) {
+	SIMULATOR_INIT(argc, argv, state);
+    }
+    if (step)
+	state->gang_pos = GANG_STEP;
+    else if (resume_name == NULL) {  // else knobs from the snapshot
+	state->gang_pos = GANG_RUN;
+	state->kontroll_utskrift_pos = KONTROLL_UTSKRIFT_OFF;
+    }
+
+    state->trace = trace;
+    if (besk_rec_init(state, rec_size) < 0) {
+	fprintf(stderr, "unable to allocate recorder\n");
+	exit(1);
+    }
+    state->rec_name = rec_name;
+    signal(SIGINT, sigint_handler);
+    if (io_name && (besk_io_open(state, io_name, io_replay) < 0))
+	exit(1);
+    if (fast) {  // bursts are only run by besk_run
+	core = BESK_CORE_THREADED;
+	state->fq_on = sim;
+    }
+    if (tt_interval) {  // recorded by besk_step0
+	if (core != BESK_CORE_SWITCH) {
+	    fprintf(stderr, "time travel needs the switch core\n");
+	    exit(1);
+	}
+	if (besk_tt_init(state, tt_interval, tt_keyframes, tt_deltas) < 0) {
+	    fprintf(stderr, "unable to allocate time travel log\n");
+	    exit(1);
+	}
+    }
+    if (prof) {  // counted by besk_step and besk_run
+	if (core == BESK_CORE_JIT) {
+	    fprintf(stderr, "profile needs the switch or threaded core\n");
+	    exit(1);
+	}
+	if ((state->prof = prof_create(prof_period)) == NULL) {
+	    fprintf(stderr, "unable to allocate profile\n");
+	    exit(1);
+	}
+    }
+    for (i = 0; i < nbrk; i++)
+	besk_break(state, brk[i], 1);
+    
+    state->running = 1;
+    state->KR = (start<0) ? addr : start;
+    if (snap_every) {
+	if (snap_name == NULL)
+	    snap_name = "SNAPSHOT";
+	snap_next = (state->count / snap_every + 1) * snap_every;
+    }
+
+    if (explore_name) {
+	FILE* fv;
+	int n;
+	if ((fv = fopen(explore_name, "r")) == NULL) {
+	    fprintf(stderr, "unable to open variants file %s\n", explore_name);
+	    exit(1);
+	}
+	if (run_to(state, core, explore_kr, explore_count) < 0) {
+	    fprintf(stderr, "machine stopped at KR=%03X before fork point\n",
+		    state->KR);
+	    exit(1);
+	}
+	n = besk_explore(state, core, fv, explore_name, jobs,
+			 explore_max ? explore_max : UINT64_MAX, stdout);
+	fclose(fv);
+	besk_destroy(state);
+	exit((n < 0) ? 1 : 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    tsim = t0;
+    was_running = state->running;  // a stop in the first burst is seen
+    while(!state->quit) {
+	if (state->running) {
+	    if (abs(state->gang_pos) == GANG_STEP) {
+		besk_step0(state);
+		if (sim) { SIMULATOR_RUN(state); }
+		if (abs(state->kontroll_utskrift_pos) == KONTROLL_UTSKRIFT_STEGVIS) {
+		    state->trace = 1; // memory trace as well
+		    besk_trace(stdout, state);
+		}
+		besk_step(state);
+		state->running = 0;
+		state->trace = 0;		
+	    }
+	    else if (core == BESK_CORE_THREADED) {
+		besk_run_t r = besk_run(state,
+					burst(state, fast ? FAST_BURST :
+					      (sim ? 1 : THREADED_BURST),
+					      snap_every, snap_next));
+		if ((r.reason == BESK_RUN_IDLE) && !sim) {
+		    printf("idle at KR=%03X\n", state->KR);
+		    state->running = 0;
+		}
+		else if ((r.reason == BESK_RUN_BREAK) && (state->KR != brk_kr)) {
+		    printf("%03X | BREAK\n", state->KR);
+		    brk_kr = state->KR;
+		    state->running = 0;
+		}
+		else if ((r.reason == BESK_RUN_BREAK) ||
+			 (r.reason == BESK_RUN_IO)) {
+		    besk_step0(state);
+		    besk_step(state);
+		    brk_kr = -1;
+		}
+		if (sim && fast) {
+		    // service the simulator at a fixed rate, when stopped
+		    // or when the function display queue is full
+		    if (r.reason == BESK_RUN_IDLE)  // nothing to run until next update
+			usleep(SIM_PERIOD/1000);
+		    clock_gettime(CLOCK_MONOTONIC, &tnow);
+		    if (!state->running || (r.reason == BESK_RUN_DISPLAY) ||
+			(r.reason == BESK_RUN_IDLE) ||
+			((tnow.tv_sec - tsim.tv_sec)*1000000000L +
+			 (tnow.tv_nsec - tsim.tv_nsec) >= SIM_PERIOD)) {
+			SIMULATOR_RUN(state);
+			tsim = tnow;
+		    }
+		}
+		else if (sim) { SIMULATOR_RUN(state); }
+	    }
+	    else if (core == BESK_CORE_JIT) {
+		jit_run(state, burst(state, sim ? 1 : THREADED_BURST,
+				     snap_every, snap_next));
+		if (sim) { SIMULATOR_RUN(state); }
+	    }
+	    else {
+		besk_step0(state);
+		besk_step(state);
+		if (sim) { SIMULATOR_RUN(state); }
+	    }
+	}
+	else {
+	    if (sim) { SIMULATOR_RUN(state); }
+	    else { state->quit = 1; }
+	}
+	if (snap_every && (state->count >= snap_next)) {
+	    besk_save(state, snap_name);
+	    snap_next = (state->count / snap_every + 1) * snap_every;
+	}
+	// dump flight recorder and snapshot when stopped (not single
+	// step) or recorder when interrupted
+	if (was_running && !state->running &&
+	    (abs(state->gang_pos) != GANG_STEP)) {
+	    besk_rec_save(state);
+	    if (snap_stop)
+		besk_save(state, snap_name);
+	    if (state->tt)
+		tt_prompt(state);
+	}
+	was_running = state->running;
+	if (interrupted && state->tt) {
+	    interrupted = 0;
+	    state->running = 0;
+	    tt_prompt(state);
+	    was_running = state->running;
+	}
+	else if (interrupted) {
+	    printf("%03X | INTERRUPTED\n", state->KR);
+	    besk_rec_save(state);
+	    state->quit = 1;
+	}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (mdump) {
+	while(*mdump) {
+	    switch(*mdump) {
+	    case 'r': dump_registers(stdout, state); break;
+	    case 'm': dump_mem(stdout, start, end, state->MEM); break;
+	    case 'p': dump_prog(stdout, start, end, state->MEM); break;
+	    case 'i': dump_speed(stdout, state, &t0, &t1); break;
+	    case 'f': dump_fused(stdout, state); break;
+	    }
+	    mdump++;
+	}
+    }
+    if (state->prof) {
+	dump_prof(stdout, state);
+	if (csv_name) {
+	    FILE* fcsv;
+	    if ((fcsv = fopen(csv_name, "w")) == NULL) {
+		fprintf(stderr, "unable to open csv file %s\n", csv_name);
+		exit(1);
+	    }
+	    dump_prof_csv(fcsv, state);
+	    fclose(fcsv);
+	}
+    }
+    besk_destroy(state);
+    exit(0);
+}
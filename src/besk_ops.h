@@ -0,0 +1,386 @@
+//
+//  BESK operation semantics
+//
+//  Memory access helpers and the OPC_<n>(HF,ZF,TF) description of each
+//  operation, shared by the threaded core in besk.c and by programs
+//  translated to C by besk2c. An OPC_<n> expands in a scope with the
+//  registers MD MR AR ARP AR00 AR40 SI KR INS AS, MEM, the predecoded
+//  instruction d, state and the run status side, reason and stop. The
+//  jumps (0A, 0C, 0E) leave to the label jump.
+//
+#ifndef __BESK_OPS_H__
+#define __BESK_OPS_H__
+
+#include "besk.h"
+
+// Helord layout - 64 bit ord as 2 32-bit half words
+// using 20 bit in each half only, Vs,Hs are only used
+// as sign extension when possible.
+// 
+//        even                 odd
+// +-------------------+-------------------+
+// | Vs:12,Vw:12,Vop:8 | Hs:12,Hw:12,Hop:8 |
+// +-------------------+-------------------+
+// when return as helord (and as stored in registers)
+// +---------------------------------------+
+// |      s:24,Vw:12,Vop:8,Hw:12,Hop:8     |
+// +---------------------------------------+
+//
+
+// reading left halvord (even address) is reading into upper helord,
+// while lower (right) is set to zero.
+// read right halvord (odd address) is reading into lower helord
+// while upper (left) s set to zero
+// 
+static inline helord_t halvord_read(unsigned addr, besk_mem_t* mem)
+{
+#ifdef BESK_PACKED_MEM
+     if (addr & 1) // read hhao (right half)
+	 return mem[addr>>1] & HALVORD_MASK;
+     else  // read vhao (left half)
+	 return mem[addr>>1] & ((helord_t)HALVORD_MASK << 20);
+#else
+     if (addr & 1) // read hhao (right half)
+	 return (helord_t) (mem[addr] & HALVORD_MASK);
+     else  // read vhao (left half)
+	 return ((helord_t) ((mem[addr] & HALVORD_MASK))) << 20;
+#endif
+}
+
+// read halv ord (H=0) | or hel ord (H=1)
+static inline helord_t ord_read(int H, unsigned addr, besk_mem_t* mem)
+{
+    helord_t value;
+    addr &= 0x7ff; // ignore top bit! (cyclic memory!)
+    if (H)
+	value = mem_helord_read(addr, mem);
+    else
+	value = halvord_read(addr, mem);
+    return value;
+}
+
+
+static inline void halvord_write(unsigned addr, besk_mem_t* mem, helord_t value)
+{
+    addr &= 0x7ff; // ignore top bit! (cyclic memory!)
+#ifdef BESK_PACKED_MEM
+    helord_t* w = &mem[addr>>1];
+    if (addr & 1) // hhao only to hhac
+	*w = (*w & ~(helord_t)HALVORD_MASK) | (value & HALVORD_MASK);
+    else  // vhao only to vhac, value bits 51..20 as in a halvord_t cell
+	*w = ((helord_t)((int64_t)(value << 12) >> 12) &
+	      ~(helord_t)HALVORD_MASK) | (*w & HALVORD_MASK);
+#else
+    if (addr & 1) { // hhao only to hhac
+	mem[addr] = value & HALVORD_MASK;
+    }
+    else { // vhao only to vhac! ?
+	// mem[addr] = value & HALVORD_MASK;
+	mem[addr] = (value >> 20);
+    }
+#endif
+}
+
+// write halv ord (H=0) or hel ord (H=1)
+static inline void ord_write(int H, unsigned addr, besk_mem_t* mem, helord_t value)
+{
+    if (H)
+	mem_helord_write(addr, mem, value);
+    else
+	halvord_write(addr, mem, value);
+}
+
+// write address part of addr
+static inline void addr_write(int H, unsigned addr, besk_mem_t* mem, helord_t value)
+{
+    addr &= 0x7ff; // ignore top bit! (cyclic memory!)
+#ifdef BESK_PACKED_MEM
+    helord_t m;
+    if (H) {  // both cells, the H operand address is even
+	helord_t* w = &mem[addr>>1];
+	m = ((helord_t)HALVORD_ADDR << 20) | HALVORD_ADDR;
+	*w = (*w & ~m) | (value & m);
+    }
+    else if (addr & 1) { // write hha0 (right half)
+	helord_t* w = &mem[addr>>1];
+	m = HALVORD_ADDR;
+	*w = (*w & ~m) | (value & m);
+    }
+    else {
+	helord_t* w = &mem[addr>>1];
+	m = (helord_t)HALVORD_ADDR << 20;
+	*w = (*w & ~m) | (value & m);
+    }
+#else
+    if (H) {  // both cells
+	mem[addr]   = (mem[addr] & ~HALVORD_OP)|((value >> 20) & HALVORD_ADDR);
+	mem[addr+1] = (mem[addr+1] & ~HALVORD_OP) | (value & HALVORD_ADDR);
+
+    }
+    else if (addr & 1) { // write hha0 (right half)
+    	mem[addr] = (mem[addr] & ~HALVORD_OP) | (value & HALVORD_ADDR);
+
+
+    }
+    else {
+	// mem[addr] = (mem[addr] & ~0x000FF) | (value & 0xFFF00);
+	mem[addr] = (mem[addr] & ~HALVORD_OP) | ((value >> 20) & HALVORD_ADDR);
+    }
+#endif
+}
+
+// read operand of predecoded instruction
+static inline helord_t decode_read(besk_decode_t* d, besk_mem_t* mem)
+{
+    if (d->flags & DECODE_H)
+	return mem_helord_read(d->addr, mem);
+    return halvord_read(d->addr, mem);
+}
+
+// drop predecoded cells written by ord_write/addr_write (H=1 two cells)
+// and any translated code covering them
+static inline void decode_invalidate(besk_t* state, int H, unsigned addr)
+{
+    addr &= 0x7ff;
+    if (state->DEC[addr].flags & DECODE_JIT)
+	jit_invalidate(state, addr);
+    state->DEC[addr].flags = 0;
+    if (H) {
+	unsigned addr1 = (addr+1) & 0x7ff;
+	if (state->DEC[addr1].flags & DECODE_JIT)
+	    jit_invalidate(state, addr1);
+	state->DEC[addr1].flags = 0;
+    }
+}
+
+// devices (besk.c)
+extern helord_t read_drum_memory(besk_t* st, halvord_t INS, helord_t MR);
+extern helord_t write_drum_memory(besk_t* st, halvord_t INS, helord_t MR);
+extern helord_t read_4_channel_remsa(besk_t* st, int n);
+extern helord_t read_5_channel_remsa(besk_t* st, int n);
+extern void     write_4_channel_remsa(besk_t* st, uint8_t code);
+extern void     write_tecken_remsa(besk_t* st, uint8_t code);
+// memory trace (besk.c)
+extern void trace_addr(FILE* f, halvord_t addr, halvord_t INS, besk_mem_t* mem);
+extern void trace_read(FILE* f, halvord_t addr, helord_t value);
+extern void trace_write(FILE* f, halvord_t addr, halvord_t INS, helord_t value);
+
+#define OPC_READ(HF) \
+    ((HF) ? mem_helord_read(d->addr, MEM) : halvord_read(d->addr, MEM))
+
+#define OPC_WRITE(HF, value) do {				\
+	if (HF) mem_helord_write(AS, MEM, (value));		\
+	else    halvord_write(AS, MEM, (value));		\
+	decode_invalidate(state, (HF), AS);			\
+	side++;							\
+    } while(0)
+
+#define OPC_TRACE_READ(TF) \
+    do { if (TF) trace_read(stdout, INS, MD); } while(0)
+#define OPC_TRACE_WRITE(TF) \
+    do { if (TF) trace_write(stdout, AS, INS, AR); } while(0)
+
+#define OPC_ERROR(HF,ZF,TF) do {					\
+	printf("%03X | ERROR %02X not implemented\n", KR, O(INS));	\
+	state->running = 0;						\
+	reason = BESK_RUN_ERROR;					\
+	stop = 1;							\
+    } while(0)
+
+#define OPC_00(HF,ZF,TF) do {  /* band */				\
+	MD = OPC_READ(HF); OPC_TRACE_READ(TF);				\
+	AR = (MD+AR) & MR;						\
+	SI = 0;								\
+    } while(0)
+
+#define OPC_01(HF,ZF,TF) do {  /* movmr */				\
+	AR = MR; MR = 0; SI = 0;					\
+    } while(0)
+
+#define OPC_02(HF,ZF,TF) do {  /* mul */				\
+	helord_t H_, L_;						\
+	MD = OPC_READ(HF); OPC_TRACE_READ(TF);				\
+	H_ = helord_muladd(MD, MR, 0, helord_sign_bit(AR), &L_);	\
+	AR = H_; AR40 = helord_sign_bit(L_); MR = L_ >> 1;		\
+	SI = 0;								\
+    } while(0)
+
+#define OPC_03(HF,ZF,TF) do {  /* mulr */				\
+	helord_t H_, L_;						\
+	MD = OPC_READ(HF); OPC_TRACE_READ(TF);				\
+	H_ = helord_muladd(MD, MR, 0, HELORD_SIGN, &L_);		\
+	AR = H_; AR40 = helord_sign_bit(L_); MR = L_ >> 1;		\
+	SI = 0;								\
+    } while(0)
+
+#define OPC_04(HF,ZF,TF) do {  /* ashr | shr */			\
+	if ((AS & 0x3F) > 0) {						\
+	    if (ZF) AR = helord_shr40(ARP, AS, &AR40);			\
+	    else    AR = helord_ashr40(AR, AS, &AR40);			\
+	    SI = helord_sign_bit(AR) != AR00;				\
+	}								\
+    } while(0)
+
+#define OPC_05(HF,ZF,TF) do {  /* shl | shl40 */			\
+	int k_ = AS & 0x3F;						\
+	if (k_ > 0) {							\
+	    if (ZF) {							\
+		AR = helord_shl00(ARP,1,&AR00) | AR40;			\
+		k_--;							\
+		AR40 = 0;						\
+	    }								\
+	    if (k_ > 0)							\
+		AR = helord_shl00(AR, k_, &AR00);			\
+	    SI = helord_sign_bit(AR) != AR00;				\
+	}								\
+    } while(0)
+
+#define OPC_06(HF,ZF,TF) do {  /* addst | incst */			\
+	MD = OPC_READ(HF); OPC_TRACE_READ(TF);				\
+	if (ZF) SI = helord_add_oflw(MD, 0x0020000200, &AR);		\
+	else    SI = helord_add_oflw(MD, AR, &AR);			\
+	OPC_WRITE(HF, AR); OPC_TRACE_WRITE(TF);				\
+    } while(0)
+
+#define OPC_07(HF,ZF,TF) do {  /* stora */				\
+	addr_write(HF, AS, MEM, AR);					\
+	decode_invalidate(state, HF, AS);				\
+	side++;								\
+	if (TF) trace_addr(stdout, AS, INS, MEM);			\
+    } while(0)
+
+#define OPC_08(HF,ZF,TF) do {  /* addmr */				\
+	MD = OPC_READ(HF); OPC_TRACE_READ(TF);				\
+	SI = helord_add_oflw(MD, AR, &AR);				\
+	MR = AR;							\
+    } while(0)
+
+#define OPC_09(HF,ZF,TF) do {  /* submr */				\
+	MD = OPC_READ(HF); OPC_TRACE_READ(TF);				\
+	SI = helord_add_oflw(helord_neg(MD), AR, &AR);			\
+	MR = AR;							\
+    } while(0)
+
+#define OPC_0A(HF,ZF,TF) do {  /* jc */				\
+	if (SI) { KR = AS; goto jump; }					\
+    } while(0)
+
+#define OPC_0B(HF,ZF,TF) do {  /* sub | neg */				\
+	MD = OPC_READ(HF); OPC_TRACE_READ(TF);				\
+	SI = helord_add_oflw(helord_neg(MD), AR, &AR);			\
+    } while(0)
+
+#define OPC_0C(HF,ZF,TF) do {  /* jmp */				\
+	KR = AS; goto jump;						\
+    } while(0)
+
+#define OPC_0D(HF,ZF,TF) do {  /* aadd */				\
+	MD = OPC_READ(HF); OPC_TRACE_READ(TF);				\
+	SI = helord_add_oflw(helord_abs(MD), AR, &AR);			\
+    } while(0)
+
+#define OPC_0E(HF,ZF,TF) do {  /* jge | jlt (see besk_step) */		\
+	if (ZF) {							\
+	    AR = ARP;							\
+	    if (AR < 0) { KR = AS; goto jump; }				\
+	}								\
+	else {								\
+	    if (AR >= 0) { KR = AS; goto jump; }			\
+	}								\
+    } while(0)
+
+#define OPC_0F(HF,ZF,TF) do {  /* asub */				\
+	MD = OPC_READ(HF); OPC_TRACE_READ(TF);				\
+	SI = helord_add_oflw(helord_neg(helord_abs(MD)), AR, &AR);	\
+    } while(0)
+
+#define OPC_10(HF,ZF,TF) do {  /* add | load */			\
+	MD = OPC_READ(HF); OPC_TRACE_READ(TF);				\
+	SI = helord_add_oflw(MD, AR, &AR);				\
+    } while(0)
+
+#define OPC_11(HF,ZF,TF) do {  /* store */				\
+	OPC_WRITE(HF, AR); OPC_TRACE_WRITE(TF);				\
+    } while(0)
+
+#define OPC_12(HF,ZF,TF) do {  /* div */				\
+	helord_t q_;							\
+	MD = OPC_READ(HF); OPC_TRACE_READ(TF);				\
+	q_ = helord_divrem(AR, MD, &AR);				\
+	MR = helord_reverse(q_);					\
+    } while(0)
+
+#define OPC_13(HF,ZF,TF) do {  /* rev */				\
+	AR = helord_reverse(MR); MR = 0; SI = 0;			\
+    } while(0)
+
+#define OPC_14(HF,ZF,TF) OPC_ERROR(HF,ZF,TF)  // read5 (not reached)
+
+#define OPC_15(HF,ZF,TF) do {  /* norm | norm40 */			\
+	if (ZF) AR = ARP;						\
+	AR = helord_norm(AR, ZF, &AR40);				\
+	SI = 0;								\
+    } while(0)
+
+#define OPC_16(HF,ZF,TF) OPC_ERROR(HF,ZF,TF)
+#define OPC_17(HF,ZF,TF) OPC_ERROR(HF,ZF,TF)
+
+#define OPC_18(HF,ZF,TF) do {  /* f */					\
+	switch(AS) {							\
+	case 0x000: case 0x002: state->Fx = AR; state->Fop=0; break;	\
+	case 0x004: state->Fx = AR; state->Fop=1; break;		\
+	case 0x006: state->Fx = AR; state->Fop=2; break;		\
+	case 0x008: case 0x00A: state->Fy = AR; state->Fop=0; break;	\
+	case 0x00C: state->Fy = AR; state->Fop=1; break;		\
+	case 0x00E: state->Fy = AR; state->Fop=2; break;		\
+	}								\
+	side++;								\
+	if (state->fq_on && state->Fop) {				\
+	    besk_fpoint_t* p_ = &state->fq[state->fq_len++];		\
+	    p_->x = state->Fx; p_->y = state->Fy; p_->op = state->Fop;	\
+	    state->Fop = 0;						\
+	    if (state->fq_len == FQUEUE_SIZE) {				\
+		reason = BESK_RUN_DISPLAY;				\
+		stop = 1;						\
+	    }								\
+	}								\
+    } while(0)
+
+#define OPC_19(HF,ZF,TF) do {  /* read4x10 | read4x1 */		\
+	MD = read_4_channel_remsa(state, (ZF) ? 1 : 10);		\
+	AR = MD; SI = 0;						\
+	OPC_WRITE(HF, AR); OPC_TRACE_WRITE(TF);				\
+    } while(0)
+
+#define OPC_1A(HF,ZF,TF) OPC_ERROR(HF,ZF,TF)
+
+#define OPC_1B(HF,ZF,TF) do {  /* rd */				\
+	AR = read_drum_memory(state, INS, MR);				\
+    } while(0)
+
+#define OPC_1C(HF,ZF,TF) do {  /* write4 */				\
+	write_4_channel_remsa(state, AR & 0xF);				\
+    } while(0)
+
+#define OPC_1D(HF,ZF,TF) do {  /* write */				\
+	write_tecken_remsa(state, AR & 0xF);				\
+    } while(0)
+
+#define OPC_1E(HF,ZF,TF) OPC_ERROR(HF,ZF,TF)
+
+#define OPC_1F(HF,ZF,TF) do {  /* wd */				\
+	AR = write_drum_memory(state, INS, MR);				\
+    } while(0)
+
+// all handler numbers (N)
+#define OPC_FOREACH(X, h, z, t)						\
+    X(00,h,z,t) X(01,h,z,t) X(02,h,z,t) X(03,h,z,t)			\
+    X(04,h,z,t) X(05,h,z,t) X(06,h,z,t) X(07,h,z,t)			\
+    X(08,h,z,t) X(09,h,z,t) X(0A,h,z,t) X(0B,h,z,t)			\
+    X(0C,h,z,t) X(0D,h,z,t) X(0E,h,z,t) X(0F,h,z,t)			\
+    X(10,h,z,t) X(11,h,z,t) X(12,h,z,t) X(13,h,z,t)			\
+    X(14,h,z,t) X(15,h,z,t) X(16,h,z,t) X(17,h,z,t)			\
+    X(18,h,z,t) X(19,h,z,t) X(1A,h,z,t) X(1B,h,z,t)			\
+    X(1C,h,z,t) X(1D,h,z,t) X(1E,h,z,t) X(1F,h,z,t)
+
+#endif
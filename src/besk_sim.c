@@ -870,25 +870,20 @@ static void draw_function_grid(besk_sim_t* bst, besk_t* st)
 }
 
 // -1.0, -0.75, -0.5, -0.25, 0, 0.25, 0.5, 0.75, 1
-static void draw_function(besk_sim_t* bst, besk_t* st)
+static void draw_point(besk_sim_t* bst, besk_t* st,
+		       helord_t x0, helord_t y0, int op)
 {
-    helord_t x0, y0;
     double xd, yd;
     double x, y;
     int xi, yi;
-    
-    if (st->Fop == 0)
-	return;
 
-//  fprintf(stdout, "Fx = %010lX, %f\n",  st->Fx, helord_to_double(st->Fx));
-//  fprintf(stdout, "Fy = %010lX, %f\n",  st->Fy, helord_to_double(st->Fy));
+//  fprintf(stdout, "Fx = %010lX, %f\n",  x0, helord_to_double(x0));
+//  fprintf(stdout, "Fy = %010lX, %f\n",  y0, helord_to_double(y0));
 
     // x0,x1,x2,x3,x4,x5,x6,x7,x8,x9,x10,x11....x39
-    x0 = st->Fx;
     xd = helord_sign_bit(x0) ? -255.0 : 255.0;
     x  = ((helord_abs(x0) >> (32-st->Fpos_x)) & 0xFF) / xd;
 
-    y0 = st->Fy;
     yd = helord_sign_bit(y0) ? -255.0 : 255.0;
     y  = ((helord_abs(y0) >> (32-st->Fpos_y)) & 0xFF) / yd;
 	
@@ -901,7 +896,7 @@ static void draw_function(besk_sim_t* bst, besk_t* st)
     // yi += FUNCTION_YOFFS;
     // fprintf(stdout, "x=%f, y=%f  (%d,%d)\n", x, y, xi, yi);
 
-    if (st->Fop == 1) {
+    if (op == 1) {
 	epx_pixmap_draw_point(bst->fpx, bst->fgc, xi, yi);
     }
     else {
@@ -909,6 +904,19 @@ static void draw_function(besk_sim_t* bst, besk_t* st)
     }
     
     bst->need_function_redraw = 1;
+}
+
+// draw points queued by besk_run (-F) and the current point
+static void draw_function(besk_sim_t* bst, besk_t* st)
+{
+    unsigned i;
+
+    for (i = 0; i < st->fq_len; i++)
+	draw_point(bst, st, st->fq[i].x, st->fq[i].y, st->fq[i].op);
+    st->fq_len = 0;
+    if (st->Fop == 0)
+	return;
+    draw_point(bst, st, st->Fx, st->Fy, st->Fop);
     st->Fop = 0;
 }
 
@@ -965,6 +973,9 @@ void simulator_run(besk_t* st)
 	    else if (e.key.sym == 's') {
 		start = 1;
 	    }
+	    else if (e.key.sym == 'r') {  // dump flight recorder
+		besk_rec_save(st);
+	    }
 	}
     }
 
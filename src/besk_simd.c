@@ -0,0 +1,108 @@
+//
+//  BESK lockstep engine
+//
+//  Machines running the same program are executed in lockstep, one
+//  machine per vector lane.  MD, MR, AR and ARP are kept as vectors of
+//  40-bit values in 64-bit lanes and memory as rows of one halvord per
+//  lane and cell (structure of arrays), so an operand read or a store
+//  is one vector access.  The engine in besk_simd_group.h is built for
+//  8 lanes with AVX-512, 4 lanes with AVX2 and 4 lanes for any other
+//  host, simd_exec picks the widest the cpu supports.
+//
+//  All lanes share KR.  A lane whose instruction word at KR differs
+//  (self modifying code) or whose SI differs at a jc leaves the group,
+//  its registers and memory are written back to its besk_t before the
+//  instruction, and it continues on the scalar core.  DIV, REV and NORM
+//  are run per lane, I/O, f and undefined operations are run by
+//  besk_step on every lane with the registers and the cells they use
+//  written back and reloaded.  Self loops (jmp to KR) are left to the
+//  scalar core as well.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#include "besk.h"
+
+#define SIMD_MAX_LANES 8
+
+#define SIMD_CAT(a,b)  a##_##b
+#define SIMD_CAT2(a,b) SIMD_CAT(a,b)
+#define SIMD_NAME(name) SIMD_CAT2(name, SIMD_ISA)
+
+#define SIMD_INLINE static inline __attribute__((always_inline))
+
+#define VZERO ((vh_t){0})
+
+// operations run by besk_step on all lanes (I/O, f and undefined)
+#define SIMD_SYNC_OPS ((1u<<OP_READ5_)|(1u<<OP_UNDEF16)|(1u<<OP_UNDEF17)| \
+		       (1u<<OP_FUNC)|(1u<<OP_READ4x10)|(1u<<OP_UNDEF1A)|  \
+		       (1u<<OP_RD)|(1u<<OP_WRITE4)|(1u<<OP_WRITE)|	  \
+		       (1u<<OP_UNDEF1E)|(1u<<OP_WD))
+
+#define FOREACH_LANE(v, i) \
+    for (i = 0; i < SIMD_LANES; i++) if ((v)->active & (1u << i))
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define SIMD_X86 1
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define SIMD_LANES 8
+#define SIMD_ISA   avx512
+#include "besk_simd_group.h"
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define SIMD_LANES 4
+#define SIMD_ISA   avx2
+#include "besk_simd_group.h"
+#pragma GCC pop_options
+#endif
+
+#define SIMD_LANES 4
+#define SIMD_ISA   generic
+#include "besk_simd_group.h"
+
+// Run n machines with the same program in lane groups, lanes with the
+// same KR start in lockstep, the others and the lanes leaving the group
+// run on core. Each machine runs at most max_instructions, r[i] is set
+// as from besk_exec. Returns the number of instructions executed in
+// lockstep.
+uint64_t simd_exec(besk_t** lane, besk_run_t* r, int n, int core,
+		   uint64_t max_instructions)
+{
+    unsigned (*group)(besk_t** lane, int m, uint64_t max) = simd_group_generic;
+    int width = 4;
+    uint64_t lockstep = 0;
+    int g, i;
+
+#ifdef SIMD_X86
+    if (__builtin_cpu_supports("avx512f")) {
+	group = simd_group_avx512;
+	width = 8;
+    }
+    else if (__builtin_cpu_supports("avx2"))
+	group = simd_group_avx2;
+#endif
+    for (g = 0; g < n; g += width) {
+	int m = (n-g < width) ? n-g : width;
+	uint64_t count0[SIMD_MAX_LANES];
+	unsigned run;
+
+	for (i = 0; i < m; i++)
+	    count0[i] = lane[g+i]->count;
+	run = group(lane+g, m, max_instructions);
+	for (i = 0; i < m; i++) {
+	    besk_t* s = lane[g+i];
+	    uint64_t done = s->count - count0[i];
+	    if (run & (1u << i))
+		lockstep += done;
+	    r[g+i] = besk_exec(s, core, max_instructions - done);
+	    r[g+i].count += done;
+	}
+    }
+    return lockstep;
+}
@@ -0,0 +1,640 @@
+//
+//  BESK lockstep engine for one lane group width, included by
+//  besk_simd.c once per instruction set with SIMD_LANES (machines per
+//  group) and SIMD_ISA (name suffix) defined.
+//
+#define vh_t              SIMD_NAME(vh_t)
+#define vs_t              SIMD_NAME(vs_t)
+#define vm_t              SIMD_NAME(vm_t)
+#define simd_t            SIMD_NAME(simd_t)
+#define simd_load_regs    SIMD_NAME(simd_load_regs)
+#define simd_load         SIMD_NAME(simd_load)
+#define simd_store_regs   SIMD_NAME(simd_store_regs)
+#define simd_store_cell   SIMD_NAME(simd_store_cell)
+#define simd_store        SIMD_NAME(simd_store)
+#define simd_drop         SIMD_NAME(simd_drop)
+#define simd_sync_step    SIMD_NAME(simd_sync_step)
+#define vmask             SIMD_NAME(vmask)
+#define vselect           SIMD_NAME(vselect)
+#define vmem_read         SIMD_NAME(vmem_read)
+#define vmem_write        SIMD_NAME(vmem_write)
+#define vaddr_write       SIMD_NAME(vaddr_write)
+#define vhelord_sign_bit  SIMD_NAME(vhelord_sign_bit)
+#define vhelord_neg       SIMD_NAME(vhelord_neg)
+#define vhelord_abs       SIMD_NAME(vhelord_abs)
+#define vhelord_add_oflw  SIMD_NAME(vhelord_add_oflw)
+#define vhelord_shl00     SIMD_NAME(vhelord_shl00)
+#define vhelord_ashr40    SIMD_NAME(vhelord_ashr40)
+#define vhelord_shr40     SIMD_NAME(vhelord_shr40)
+#define vhelord_muladd    SIMD_NAME(vhelord_muladd)
+#define simd_run          SIMD_NAME(simd_run)
+#define simd_group        SIMD_NAME(simd_group)
+
+typedef uint64_t vh_t __attribute__((vector_size(8*SIMD_LANES)));  // helord
+typedef int64_t  vs_t __attribute__((vector_size(8*SIMD_LANES)));
+typedef int32_t  vm_t __attribute__((vector_size(4*SIMD_LANES)));  // halvord
+
+typedef struct
+{
+    vh_t MD;
+    vh_t MR;
+    vh_t AR;
+    vh_t ARP;
+    vh_t AR00;        // 0|1
+    vh_t AR40;        // 0|1
+    vh_t SI;          // 0|1
+    halvord_t KR;
+    halvord_t INS;
+    int       running;
+    unsigned  active;         // lanes in lockstep
+    uint64_t  count;          // instructions since lanes were loaded
+    besk_t*   lane[SIMD_LANES];
+    besk_decode_t DEC[NUM_HALF_CELLS];  // valid when all lanes are equal
+    vm_t      MEM[NUM_HALF_CELLS];
+} simd_t;
+
+// load registers of lane i
+static void simd_load_regs(simd_t* v, int i)
+{
+    besk_t* s = v->lane[i];
+
+    v->MD[i]   = s->MD;
+    v->MR[i]   = s->MR;
+    v->AR[i]   = s->AR;
+    v->ARP[i]  = s->ARP;
+    v->AR00[i] = s->AR00;
+    v->AR40[i] = s->AR40;
+    v->SI[i]   = s->SI;
+}
+
+// load registers and memory of lane i
+static void simd_load(simd_t* v, int i)
+{
+    besk_t* s = v->lane[i];
+    int a;
+
+    simd_load_regs(v, i);
+    for (a = 0; a < NUM_HALF_CELLS; a++)
+	v->MEM[a][i] = mem_get(s->MEM, a);
+}
+
+// write back the registers of lane i
+static void simd_store_regs(simd_t* v, int i)
+{
+    besk_t* s = v->lane[i];
+
+    s->MD   = v->MD[i];
+    s->MR   = v->MR[i];
+    s->AR   = v->AR[i];
+    s->ARP  = v->ARP[i];
+    s->AR00 = v->AR00[i];
+    s->AR40 = v->AR40[i];
+    s->SI   = v->SI[i];
+    s->KR   = v->KR;
+    s->INS  = v->INS;
+    s->running = v->running;
+    s->count += v->count;
+}
+
+// write back cell a of lane i, return 1 if it changed
+SIMD_INLINE int simd_store_cell(simd_t* v, int i, unsigned a)
+{
+    besk_t* s = v->lane[i];
+
+    if (mem_get(s->MEM, a) == v->MEM[a][i])
+	return 0;
+    mem_set(s->MEM, a, v->MEM[a][i]);
+    s->DEC[a].flags = 0;
+    return 1;
+}
+
+// write back lane i and remove it from the group
+static void simd_store(simd_t* v, int i)
+{
+    besk_t* s = v->lane[i];
+    int changed = 0;
+    int a;
+
+    simd_store_regs(v, i);
+    for (a = 0; a < NUM_HALF_CELLS; a++)
+	changed |= simd_store_cell(v, i, a);
+    if (changed && s->jit)
+	jit_destroy(s);
+    v->active &= ~(1u << i);
+}
+
+// write back lanes not in keep
+static void simd_drop(simd_t* v, unsigned keep)
+{
+    unsigned m = v->active & ~keep;
+    while (m) {
+	int i = __builtin_ctz(m);
+	simd_store(v, i);
+	m &= m-1;
+    }
+}
+
+// Run the instruction d at KR with besk_step on all lanes. Only the
+// registers, the instruction cell and the cells the operation uses
+// (the drum channel of RD and WD, the operand of read4 and read5) are
+// moved between the lanes and the group, the rest of the lane memory
+// is written back when the lane leaves the group.
+static void simd_sync_step(simd_t* v, besk_decode_t* d)
+{
+    unsigned m = v->active;
+    unsigned live = 0;
+    unsigned KR = v->KR & 0x7ff;
+    unsigned a0 = 0, na = 0;  // cells used by the operation
+    int load = 1;             // the operation writes them
+    unsigned a;
+    int i;
+
+    switch(d->n) {
+    case OP_READ5_:
+    case OP_READ4x10:
+	a0 = d->addr; na = 2;
+	break;
+    case OP_WD:
+	load = 0;
+	// fall through
+    case OP_RD:
+	a0 = W(d->ins) & 0x7FE; na = DRUM_CHANNEL_SIZE;
+	break;
+    }
+    for (i = 0; i < SIMD_LANES; i++) {
+	if (m & (1u << i)) {
+	    besk_t* s = v->lane[i];
+	    int changed = simd_store_cell(v, i, KR);
+	    for (a = 0; a < na; a++)
+		changed |= simd_store_cell(v, i, (a0 + a) & 0x7ff);
+	    if (changed && s->jit)
+		jit_destroy(s);
+	    simd_store_regs(v, i);
+	    besk_step0(s);
+	    besk_step(s);
+	    if (s->running) live |= (1u << i);
+	    simd_load_regs(v, i);
+	    for (a = 0; load && (a < na); a++)
+		v->MEM[(a0 + a) & 0x7ff][i] = mem_get(s->MEM, (a0 + a) & 0x7ff);
+	}
+    }
+    for (a = 0; load && (a < na); a++)
+	v->DEC[(a0 + a) & 0x7ff].flags = 0;
+    v->count = 0;
+    v->KR  = v->lane[__builtin_ctz(m)]->KR;
+    v->INS = v->lane[__builtin_ctz(m)]->INS;
+    if (live != m)  // STOP or error, the same on all lanes
+	v->running = 0;
+}
+
+// lanes of *m (-1/0 per lane) as a bit mask
+SIMD_INLINE unsigned vmask(const vs_t* m)
+{
+    unsigned r = 0;
+    int i;
+    for (i = 0; i < SIMD_LANES; i++)
+	r |= ((*m)[i] & 1u) << i;
+    return r;
+}
+
+SIMD_INLINE vh_t vselect(vh_t m, vh_t a, vh_t b)
+{
+    return (a & m) | (b & ~m);
+}
+
+// helord_read/halvord_read of cell rows
+SIMD_INLINE vh_t vmem_read(simd_t* v, besk_decode_t* d)
+{
+    if (d->flags & DECODE_H) {
+	vh_t hi = (vh_t) __builtin_convertvector(v->MEM[d->addr], vs_t);
+	vh_t lo = (vh_t) __builtin_convertvector(v->MEM[d->addr+1], vs_t);
+	return ((hi << 20) & ~(helord_t)0xFFFFF) | (lo & 0xFFFFF);
+    }
+    else {
+	vh_t x = (vh_t) __builtin_convertvector(v->MEM[d->addr], vs_t);
+	if (d->addr & 1)
+	    return x & HALVORD_MASK;
+	return (x & HALVORD_MASK) << 20;
+    }
+}
+
+// ord_write with decode_invalidate
+SIMD_INLINE void vmem_write(simd_t* v, int H, unsigned addr, vh_t value)
+{
+    addr &= 0x7ff;
+    if (H || !(addr & 1))
+	v->MEM[addr] = __builtin_convertvector(value >> 20, vm_t);
+    else
+	v->MEM[addr] = __builtin_convertvector(value & HALVORD_MASK, vm_t);
+    v->DEC[addr].flags = 0;
+    if (H) {
+	v->MEM[addr+1] = __builtin_convertvector(value & HALVORD_MASK, vm_t);
+	v->DEC[(addr+1) & 0x7ff].flags = 0;
+    }
+}
+
+// addr_write with decode_invalidate
+SIMD_INLINE void vaddr_write(simd_t* v, int H, unsigned addr, vh_t value)
+{
+    addr &= 0x7ff;
+    if (H) {
+	v->MEM[addr] = (v->MEM[addr] & ~HALVORD_OP) |
+	    __builtin_convertvector((value >> 20) & HALVORD_ADDR, vm_t);
+	v->MEM[addr+1] = (v->MEM[addr+1] & ~HALVORD_OP) |
+	    __builtin_convertvector(value & HALVORD_ADDR, vm_t);
+	v->DEC[(addr+1) & 0x7ff].flags = 0;
+    }
+    else if (addr & 1)
+	v->MEM[addr] = (v->MEM[addr] & ~HALVORD_OP) |
+	    __builtin_convertvector(value & HALVORD_ADDR, vm_t);
+    else
+	v->MEM[addr] = (v->MEM[addr] & ~HALVORD_OP) |
+	    __builtin_convertvector((value >> 20) & HALVORD_ADDR, vm_t);
+    v->DEC[addr].flags = 0;
+}
+
+SIMD_INLINE vh_t vhelord_sign_bit(vh_t a)
+{
+    return (a >> 39) & 1;
+}
+
+SIMD_INLINE vh_t vhelord_neg(vh_t a)
+{
+    return (~a + 1) & HELORD_MASK;
+}
+
+SIMD_INLINE vh_t vhelord_abs(vh_t a)
+{
+    return vselect((vh_t)(vhelord_sign_bit(a) != 0), vhelord_neg(a), a);
+}
+
+// helord_add_oflw, overflow 0|1 per lane
+SIMD_INLINE vh_t vhelord_add_oflw(vh_t a, vh_t b, vh_t* rp)
+{
+    vh_t r  = (a + b) & HELORD_MASK;
+    vh_t sa = (vh_t)((a >> 39) != 0);
+    vh_t sb = (vh_t)((b >> 39) != 0);
+    vh_t sr = (vh_t)((r >> 39) != 0);
+    *rp = r;
+    return ((sa & sb & ~sr) | (~sa & ~sb & sr)) & 1;
+}
+
+// helord_shl00, s < 64
+SIMD_INLINE vh_t vhelord_shl00(vh_t a, unsigned s, vh_t* ar00)
+{
+    a = a << s;
+    *ar00 = (a >> 40) & 1;
+    return a & HELORD_MASK;
+}
+
+// helord_ashr40, 0 < s < 40 (shifts helord_t, as helord_ashr40)
+SIMD_INLINE vh_t vhelord_ashr40(vh_t a, unsigned s, vh_t* ar40)
+{
+    *ar40 = (a >> (s-1)) & 1;
+    return ((a << 24) >> (24+s)) & HELORD_MASK;
+}
+
+// helord_shr40, 0 < s < 40
+SIMD_INLINE vh_t vhelord_shr40(vh_t a, unsigned s, vh_t* ar40)
+{
+    *ar40 = (a >> (s-1)) & 1;
+    return (a >> s) & HELORD_MASK;
+}
+
+// helord_muladd with c1 = 0. The 79 bit product of the sign extended
+// operands is formed from 20 bit limbs, a = ah*2^20 + al with al
+// unsigned, so every partial product fits in 64 bits.
+SIMD_INLINE vh_t vhelord_muladd(vh_t a, vh_t b, vh_t c0, vh_t* lwp)
+{
+    vs_t sa = ((vs_t)(a << 24)) >> 24;
+    vs_t sb = ((vs_t)(b << 24)) >> 24;
+    vs_t al = sa & 0xFFFFF, ah = sa >> 20;
+    vs_t bl = sb & 0xFFFFF, bh = sb >> 20;
+    vs_t t0 = al * bl;             // < 2^40
+    vs_t t1 = ah * bl + al * bh;   // |t1| < 2^40
+    vs_t t2 = ah * bh;
+    vs_t mid = t0 + ((t1 & 0xFFFFF) << 20);     // < 2^41
+    vs_t hi  = t2 + (t1 >> 20) + (mid >> 40);   // p >> 40
+    vh_t p0  = (vh_t) mid & HELORD_MASK;        // p & HELORD_MASK
+    vh_t p1  = (((vh_t) hi << 1) | (((vh_t) mid >> 39) & 1)) & HELORD_MASK;
+    vh_t s   = p0 + c0;
+
+    *lwp = s & HELORD_MASK;
+    return (p1 + ((s >> 40) & 1)) & HELORD_MASK;
+}
+
+// run at most n instructions, stop when no lane is left
+static void simd_run(simd_t* v, uint64_t n)
+{
+    vh_t MD  = v->MD;
+    vh_t MR  = v->MR;
+    vh_t AR  = v->AR;
+    vh_t ARP = v->ARP;
+    vh_t AR00 = v->AR00;
+    vh_t AR40 = v->AR40;
+    vh_t SI  = v->SI;
+    halvord_t KR = v->KR;
+    uint64_t steps = 0;
+    int i;
+
+#define SIMD_SWAPOUT() do {					\
+	v->MD = MD; v->MR = MR; v->AR = AR; v->ARP = ARP;	\
+	v->AR00 = AR00; v->AR40 = AR40; v->SI = SI;		\
+	v->KR = KR;						\
+	v->count += steps; steps = 0;				\
+    } while(0)
+
+#define SIMD_SWAPIN() do {					\
+	MD = v->MD; MR = v->MR; AR = v->AR; ARP = v->ARP;	\
+	AR00 = v->AR00; AR40 = v->AR40; SI = v->SI;		\
+	KR = v->KR;						\
+    } while(0)
+
+    while (v->active && v->running && (n > 0)) {
+	unsigned addr = KR & 0x7ff;
+	besk_decode_t* d = &v->DEC[addr];
+	halvord_t INS;
+	unsigned AS;
+
+	if (!(d->flags & DECODE_VALID)) {
+	    // lanes with another instruction word leave the group
+	    halvord_t ins = v->MEM[addr][__builtin_ctz(v->active)];
+	    vs_t eq = __builtin_convertvector(v->MEM[addr] == ins, vs_t);
+	    unsigned keep = vmask(&eq);
+	    if ((v->active & ~keep) != 0) {
+		SIMD_SWAPOUT();
+		simd_drop(v, keep);
+	    }
+	    decode_instruction(d, ins, 1);
+	}
+	INS = d->ins;
+	AS  = d->w;
+
+	if (SIMD_SYNC_OPS & (1u << d->n)) {
+	    SIMD_SWAPOUT();
+	    simd_sync_step(v, d);
+	    SIMD_SWAPIN();
+	    n--;
+	    continue;
+	}
+	if (d->n == OP_JC) {  // split when SI differs
+	    vs_t eq = (SI == SI[__builtin_ctz(v->active)]);
+	    unsigned keep = vmask(&eq);
+	    if ((v->active & ~keep) != 0) {
+		SIMD_SWAPOUT();
+		simd_drop(v, keep);
+	    }
+	}
+	else if (((d->n == OP_JMP) || ((d->n == OP_JGE) &&
+				       !(d->flags & DECODE_Z))) &&
+		 (AS == (unsigned) KR) && !(d->flags & DECODE_STOP)) {
+	    SIMD_SWAPOUT();  // leave self loops to the scalar core
+	    simd_drop(v, 0);
+	    break;
+	}
+
+	// besk_step0
+	v->INS = INS;
+	if (d->flags & DECODE_STOP)
+	    v->running = 0;
+	ARP = AR;
+	if (d->flags & DECODE_Z) {
+	    AR00 = VZERO; AR40 = VZERO; AR = VZERO; SI = VZERO;
+	}
+	steps++;
+	n--;
+
+	switch(d->n) {
+	case OP_BAND:
+	    MD = vmem_read(v, d);
+	    AR = (MD+AR) & MR;
+	    SI = VZERO;
+	    break;
+
+	case OP_MOVMR:
+	    AR = MR;
+	    MR = VZERO;
+	    SI = VZERO;
+	    break;
+
+	case OP_MUL:
+	case OP_MULR: {
+	    vh_t L;
+	    MD = vmem_read(v, d);
+	    if (d->n == OP_MUL)
+		AR = vhelord_muladd(MD, MR, vhelord_sign_bit(AR), &L);
+	    else
+		AR = vhelord_muladd(MD, MR, VZERO + HELORD_SIGN, &L);
+	    AR40 = vhelord_sign_bit(L);
+	    MR = L >> 1;
+	    SI = VZERO;
+	    break;
+	}
+
+	case OP_ASHR: {
+	    int k = AS & 0x3F;
+	    if (k > 0) {
+		if (AS < 40) {
+		    if (d->flags & DECODE_Z)
+			AR = vhelord_shr40(ARP, AS, &AR40);
+		    else
+			AR = vhelord_ashr40(AR, AS, &AR40);
+		}
+		else {
+		    FOREACH_LANE(v, i) {
+			uint8_t ar40;
+			if (d->flags & DECODE_Z)
+			    AR[i] = helord_shr40(ARP[i], AS, &ar40);
+			else
+			    AR[i] = helord_ashr40(AR[i], AS, &ar40);
+			AR40[i] = ar40;
+		    }
+		}
+		SI = (vh_t)(vhelord_sign_bit(AR) != AR00) & 1;
+	    }
+	    break;
+	}
+
+	case OP_SHL: {
+	    int k = AS & 0x3F;
+	    if (k > 0) {
+		if (d->flags & DECODE_Z) {
+		    AR = vhelord_shl00(ARP, 1, &AR00) | AR40;
+		    k--;
+		    AR40 = VZERO;
+		}
+		if (k > 0)
+		    AR = vhelord_shl00(AR, k, &AR00);
+		SI = (vh_t)(vhelord_sign_bit(AR) != AR00) & 1;
+	    }
+	    break;
+	}
+
+	case OP_ADDST:
+	    MD = vmem_read(v, d);
+	    if (d->flags & DECODE_Z)
+		SI = vhelord_add_oflw(MD, VZERO + 0x0020000200, &AR);
+	    else
+		SI = vhelord_add_oflw(MD, AR, &AR);
+	    vmem_write(v, H(INS), AS, AR);
+	    break;
+
+	case OP_STORA:
+	    vaddr_write(v, H(INS), AS, AR);
+	    break;
+
+	case OP_ADDMR:
+	    MD = vmem_read(v, d);
+	    SI = vhelord_add_oflw(MD, AR, &AR);
+	    MR = AR;
+	    break;
+
+	case OP_SUBMR:
+	    MD = vmem_read(v, d);
+	    SI = vhelord_add_oflw(vhelord_neg(MD), AR, &AR);
+	    MR = AR;
+	    break;
+
+	case OP_JC:  // SI is the same on all lanes
+	    if (SI[__builtin_ctz(v->active)]) {
+		KR = AS;
+		continue;
+	    }
+	    break;
+
+	case OP_SUB:
+	    MD = vmem_read(v, d);
+	    SI = vhelord_add_oflw(vhelord_neg(MD), AR, &AR);
+	    break;
+
+	case OP_JMP:
+	    KR = AS;
+	    continue;
+
+	case OP_AADD:
+	    MD = vmem_read(v, d);
+	    SI = vhelord_add_oflw(vhelord_abs(MD), AR, &AR);
+	    break;
+
+	case OP_JGE:  // jge always jumps, jlt never (see besk_step)
+	    if (d->flags & DECODE_Z)
+		AR = ARP;
+	    else {
+		KR = AS;
+		continue;
+	    }
+	    break;
+
+	case OP_ASUB:
+	    MD = vmem_read(v, d);
+	    SI = vhelord_add_oflw(vhelord_neg(vhelord_abs(MD)), AR, &AR);
+	    break;
+
+	case OP_ADD:
+	    MD = vmem_read(v, d);
+	    SI = vhelord_add_oflw(MD, AR, &AR);
+	    break;
+
+	case OP_STORE:
+	    vmem_write(v, H(INS), AS, AR);
+	    break;
+
+	case OP_DIV:
+	    MD = vmem_read(v, d);
+	    FOREACH_LANE(v, i) {
+		helord_t r;
+		MR[i] = helord_reverse(helord_divrem(AR[i], MD[i], &r));
+		AR[i] = r;
+	    }
+	    break;
+
+	case OP_REV:
+	    FOREACH_LANE(v, i)
+		AR[i] = helord_reverse(MR[i]);
+	    MR = VZERO;
+	    SI = VZERO;
+	    break;
+
+	case OP_NORM:
+	    if (d->flags & DECODE_Z)
+		AR = ARP;
+	    FOREACH_LANE(v, i) {
+		uint8_t ar40 = AR40[i];
+		AR[i] = helord_norm(AR[i], (d->flags & DECODE_Z) != 0, &ar40);
+		AR40[i] = ar40;
+	    }
+	    SI = VZERO;
+	    break;
+	}
+	KR++;
+    }
+    SIMD_SWAPOUT();
+#undef SIMD_SWAPOUT
+#undef SIMD_SWAPIN
+}
+
+// Run lanes 0..m-1 (m <= SIMD_LANES) in lockstep, the lanes that are
+// running with the KR of the first one and without trace, recorder,
+// profile or time travel log. Returns the lanes that were run.
+static unsigned simd_group(besk_t** lane, int m, uint64_t max_instructions)
+{
+    simd_t* v;
+    unsigned run;
+    int first = -1;
+    int i;
+
+    if ((v = aligned_alloc(64, sizeof(simd_t))) == NULL)
+	return 0;
+    memset(v, 0, sizeof(simd_t));
+    v->running = 1;
+    for (i = 0; i < m; i++) {
+	besk_t* s = lane[i];
+	if (!s->running || s->trace || s->rec || s->prof || s->tt)
+	    continue;
+	if (first < 0)
+	    first = i;
+	else if (s->KR != lane[first]->KR)
+	    continue;
+	v->lane[i] = s;
+	v->active |= (1u << i);
+	simd_load(v, i);
+    }
+    run = v->active;
+    if (first >= 0) {
+	v->KR  = lane[first]->KR;
+	v->INS = lane[first]->INS;
+	simd_run(v, max_instructions);
+	simd_drop(v, 0);
+    }
+    free(v);
+    return run;
+}
+
+#undef vh_t
+#undef vs_t
+#undef vm_t
+#undef simd_t
+#undef simd_load_regs
+#undef simd_load
+#undef simd_store_regs
+#undef simd_store_cell
+#undef simd_store
+#undef simd_drop
+#undef simd_sync_step
+#undef vmask
+#undef vselect
+#undef vmem_read
+#undef vmem_write
+#undef vaddr_write
+#undef vhelord_sign_bit
+#undef vhelord_neg
+#undef vhelord_abs
+#undef vhelord_add_oflw
+#undef vhelord_shl00
+#undef vhelord_ashr40
+#undef vhelord_shr40
+#undef vhelord_muladd
+#undef simd_run
+#undef simd_group
+#undef SIMD_LANES
+#undef SIMD_ISA
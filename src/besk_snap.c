@@ -0,0 +1,233 @@
+//
+//  BESK machine snapshot
+//
+//  A snapshot is a fixed size image (besk_image_t) of the machine
+//  state: registers, memory, function display, knobs, instruction
+//  count, paper tape positions and the identity of the drum file.
+//  All fields have fixed width and offset and the image is written in
+//  host byte order, so restore maps the file and copies the fields
+//  without parsing. The version is bumped when the layout changes.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "besk.h"
+
+#define SNAP_MAGIC   "BESKSNAP"
+#define SNAP_VERSION 1
+#define SNAP_ENDIAN  0x01020304  // reads as 0x04030201 on other byte order
+
+typedef struct
+{
+    char     magic[8];     // SNAP_MAGIC
+    uint32_t version;      // SNAP_VERSION
+    uint32_t endian;       // SNAP_ENDIAN
+    uint64_t size;         // sizeof(besk_image_t)
+    // registers
+    uint64_t MD;
+    uint64_t MR;
+    uint64_t AR;
+    uint64_t ARP;
+    uint64_t BR;
+    int32_t  KR;
+    int32_t  INS;
+    uint8_t  AR00;
+    uint8_t  AR40;
+    uint8_t  SI;
+    uint8_t  running;
+    int32_t  page;         // telex page code
+    uint64_t count;        // executed instructions
+    // function display and knobs
+    uint64_t Fx;
+    uint64_t Fy;
+    uint64_t Fop;
+    uint8_t  Fpos_x;
+    uint8_t  Fpos_y;
+    uint8_t  pad[2];
+    int32_t  utmatning_pos;
+    int32_t  kontroll_utskrift_pos;
+    int32_t  gang_pos;
+    // devices, -1 when not seekable or not attached
+    int64_t  in_pos;       // INREMSA read offset
+    int64_t  ut_pos;       // UTREMSA write offset
+    uint64_t drum_dev;     // drum file st_dev, st_ino, 0 if not a file
+    uint64_t drum_ino;
+    int32_t  MEM[NUM_HALF_CELLS];
+} besk_image_t;
+
+static int64_t file_pos(FILE* f)
+{
+    if (f == NULL)
+	return -1;
+    return ftello(f);
+}
+
+static void file_id(FILE* f, uint64_t* dev, uint64_t* ino)
+{
+    struct stat st;
+    int fd;
+
+    *dev = 0;
+    *ino = 0;
+    if ((f != NULL) && ((fd = fileno(f)) >= 0) && (fstat(fd, &st) == 0)) {
+	*dev = st.st_dev;
+	*ino = st.st_ino;
+    }
+}
+
+// Write a snapshot of state to path. The image is written to a
+// temporary file that replaces path when complete, a crash while
+// saving leaves the previous snapshot. Return 0 or -1 on error.
+int besk_save(besk_t* state, char* path)
+{
+    besk_image_t* im;
+    char* tmp;
+    FILE* f;
+    int ok, i;
+
+    if ((im = calloc(1, sizeof(besk_image_t))) == NULL)
+	return -1;
+    if ((tmp = malloc(strlen(path)+5)) == NULL) {
+	free(im);
+	return -1;
+    }
+    memcpy(im->magic, SNAP_MAGIC, sizeof(im->magic));
+    im->version = SNAP_VERSION;
+    im->endian  = SNAP_ENDIAN;
+    im->size    = sizeof(besk_image_t);
+    im->MD   = state->MD;
+    im->MR   = state->MR;
+    im->AR   = state->AR;
+    im->ARP  = state->ARP;
+    im->BR   = state->BR;
+    im->KR   = state->KR;
+    im->INS  = state->INS;
+    im->AR00 = state->AR00;
+    im->AR40 = state->AR40;
+    im->SI   = state->SI;
+    im->running = state->running;
+    im->page  = state->page;
+    im->count = state->count;
+    im->Fx  = state->Fx;
+    im->Fy  = state->Fy;
+    im->Fop = state->Fop;
+    im->Fpos_x = state->Fpos_x;
+    im->Fpos_y = state->Fpos_y;
+    im->utmatning_pos = state->utmatning_pos;
+    im->kontroll_utskrift_pos = state->kontroll_utskrift_pos;
+    im->gang_pos = state->gang_pos;
+    if (state->ut != NULL)
+	fflush(state->ut);
+    im->in_pos = file_pos(state->in);
+    im->ut_pos = file_pos(state->ut);
+    file_id(state->drum, &im->drum_dev, &im->drum_ino);
+    for (i = 0; i < NUM_HALF_CELLS; i++)  // cells as in either layout
+	im->MEM[i] = mem_get(state->MEM, i);
+
+    sprintf(tmp, "%s.tmp", path);
+    if ((f = fopen(tmp, "w")) == NULL) {
+	fprintf(stderr, "unable to open snapshot file %s\n", tmp);
+	free(tmp);
+	free(im);
+	return -1;
+    }
+    ok = (fwrite(im, sizeof(besk_image_t), 1, f) == 1);
+    ok = (fclose(f) == 0) && ok;
+    if (ok && (rename(tmp, path) < 0))
+	ok = 0;
+    if (!ok) {
+	fprintf(stderr, "unable to write snapshot file %s\n", path);
+	unlink(tmp);
+    }
+    free(tmp);
+    free(im);
+    return ok ? 0 : -1;
+}
+
+// Restore state from snapshot path, the caller has attached in, ut and
+// drum. INREMSA is positioned at the saved offset and UTREMSA is cut
+// at the saved offset. Breakpoints, recorder and profile are kept.
+// Return 0 or -1 on error.
+int besk_restore(besk_t* state, char* path)
+{
+    const besk_image_t* im;
+    struct stat st;
+    uint64_t dev, ino;
+    int fd, i;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	fprintf(stderr, "unable to open snapshot file %s\n", path);
+	return -1;
+    }
+    if ((fstat(fd, &st) < 0) || (st.st_size != sizeof(besk_image_t))) {
+	fprintf(stderr, "%s: not a snapshot of this version\n", path);
+	close(fd);
+	return -1;
+    }
+    im = mmap(NULL, sizeof(besk_image_t), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (im == MAP_FAILED) {
+	fprintf(stderr, "unable to map snapshot file %s\n", path);
+	return -1;
+    }
+    if ((memcmp(im->magic, SNAP_MAGIC, sizeof(im->magic)) != 0) ||
+	(im->version != SNAP_VERSION) || (im->endian != SNAP_ENDIAN) ||
+	(im->size != sizeof(besk_image_t))) {
+	fprintf(stderr, "%s: not a snapshot of this version\n", path);
+	munmap((void*)im, sizeof(besk_image_t));
+	return -1;
+    }
+    state->MD   = im->MD;
+    state->MR   = im->MR;
+    state->AR   = im->AR;
+    state->ARP  = im->ARP;
+    state->BR   = im->BR;
+    state->KR   = im->KR;
+    state->INS  = im->INS;
+    state->AR00 = im->AR00;
+    state->AR40 = im->AR40;
+    state->SI   = im->SI;
+    state->running = im->running;
+    state->page  = im->page;
+    state->count = im->count;
+    state->Fx  = im->Fx;
+    state->Fy  = im->Fy;
+    state->Fop = im->Fop;
+    state->Fpos_x = im->Fpos_x;
+    state->Fpos_y = im->Fpos_y;
+    state->utmatning_pos = im->utmatning_pos;
+    state->kontroll_utskrift_pos = im->kontroll_utskrift_pos;
+    state->gang_pos = im->gang_pos;
+    state->fq_len = 0;
+    for (i = 0; i < NUM_HALF_CELLS; i++)
+	mem_set(state->MEM, i, im->MEM[i]);
+    // memory is rewritten behind the decode cache and translated code
+    jit_destroy(state);
+    for (i = 0; i < NUM_HALF_CELLS; i++)
+	state->DEC[i].flags = 0;
+
+    if ((state->in != NULL) && (im->in_pos >= 0) &&
+	(fseeko(state->in, im->in_pos, SEEK_SET) < 0))
+	fprintf(stderr, "%s: unable to position input paper tape\n", path);
+    if ((state->ut != NULL) && (im->ut_pos >= 0)) {
+	fflush(state->ut);
+	if ((fstat(fileno(state->ut), &st) < 0) || (st.st_size < im->ut_pos))
+	    fprintf(stderr, "%s: output paper tape is shorter than snapshot\n",
+		    path);
+	else if ((ftruncate(fileno(state->ut), im->ut_pos) < 0) ||
+		 (fseeko(state->ut, im->ut_pos, SEEK_SET) < 0))
+	    fprintf(stderr, "%s: unable to position output paper tape\n",
+		    path);
+    }
+    file_id(state->drum, &dev, &ino);
+    if ((im->drum_ino != 0) && ((dev != im->drum_dev) || (ino != im->drum_ino)))
+	fprintf(stderr, "%s: drum file is not the one of the snapshot\n", path);
+    munmap((void*)im, sizeof(besk_image_t));
+    return 0;
+}
@@ -2,9 +2,13 @@
 // Besk tests
 //
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <math.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "helord.h"
 
@@ -181,8 +185,319 @@ void test_besk_fix()
     assert(fix_equal(q, 0.125));
 }
 
+// NORM/NORM40 as the bit at a time loop in besk_step
+helord_t norm_loop(helord_t a, int inject, uint8_t* ar40)
+{
+    while ((a != 0) &&
+	   ((((a >> 38) & 0x3) == 0) || (((a >> 38) & 0x3) == 3))) {
+	a <<= 1;
+	if (inject) {
+	    a |= *ar40;
+	    *ar40 = 0;
+	}
+    }
+    return a;
+}
+
+void test_besk_norm()
+{
+    // low bits below the first differing bit: none, ones, pattern
+    static const helord_t low[] = { 0, 0xFFFFFFFFFF, 0x5A5A5A5A5A };
+    // garbage above bit 39 from earlier shifts
+    static const helord_t high[] = { 0, 0xFFFFFF0000000000, 0x0000010000000000 };
+    int k, sign, inject, in, i, j;
+    int n = 0;
+
+    // shift distance k, bits 39..39-k equal to the sign and bit 38-k
+    // differs, k=39 all equal (distance 39, 40 with AR40 or zero)
+    for (k = 0; k <= 39; k++) {
+	for (sign = 0; sign <= 1; sign++) {
+	    for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+		    helord_t a = sign ? HELORD_MASK : 0;
+		    if (k < 39) {
+			helord_t below = ((helord_t)1 << (38-k)) - 1;
+			a ^= (helord_t)1 << (38-k);
+			a = (a & ~below) | (low[i] & below);
+		    }
+		    a |= high[j];
+		    for (inject = 0; inject <= 1; inject++) {
+			for (in = 0; in <= 1; in++) {
+			    uint8_t ar40a = in, ar40b = in;
+			    helord_t x = helord_norm(a, inject, &ar40a);
+			    helord_t y = norm_loop(a, inject, &ar40b);
+			    if ((x != y) || (ar40a != ar40b)) {
+				printf("FAIL norm(%016lX,%d,%d) = %016lX,%d "
+				       "expect %016lX,%d\n", a, inject, in,
+				       x, ar40a, y, ar40b);
+			    }
+			    assert(x == y);
+			    assert(ar40a == ar40b);
+			    n++;
+			}
+		    }
+		}
+	    }
+	}
+    }
+    printf("norm: %d cases ok\n", n);
+}
+
+// reverse as the bit at a time loops helord.c and halvord.c had
+helord_t helord_reverse_loop(helord_t x, int n)
+{
+    int i;
+    helord_t y = 0;
+    for (i = 0; i < n; i++) {
+	y = (y<<1) | (x & 1);
+	x >>= 1;
+    }
+    return y;
+}
+
+void test_besk_reverse()
+{
+    static const helord_t high[] = { 0, 0xFFFFFF0000000000, 0x5A5A5A0000000000 };
+    helord_t x, h;
+    int i, j;
+
+    // every halvord, plain and sign extended
+    for (x = 0; x <= HALVORD_MASK; x++) {
+	halvord_t y = (halvord_t) x;
+	halvord_t s = (halvord_t)(((int32_t)(y << 12)) >> 12);
+	assert(halvord_reverse(y) == (halvord_t)helord_reverse_loop(y, 20));
+	assert(halvord_reverse(s) == (halvord_t)helord_reverse_loop(s, 20));
+    }
+    // every value of each half of a helord with the other half fixed,
+    // with and without garbage above bit 39
+    for (x = 0; x <= HALVORD_MASK; x++) {
+	for (i = 0; i < 3; i++) {
+	    for (j = 0; j < 3; j++) {
+		h = (i == 0) ? 0 : (i == 1) ? HALVORD_MASK : 0x5A5A5;
+		helord_t lo = (h << 20) | x | high[j];
+		helord_t hi = (x << 20) | h | high[j];
+		assert(helord_reverse(lo) == helord_reverse_loop(lo, 40));
+		assert(helord_reverse(hi) == helord_reverse_loop(hi, 40));
+	    }
+	}
+    }
+    // and every single bit
+    for (i = 0; i < 64; i++) {
+	h = (helord_t)1 << i;
+	assert(helord_reverse(h) == helord_reverse_loop(h, 40));
+    }
+    printf("reverse: ok\n");
+}
+
+// abs, to_int64 and add overflow as the branching versions did
+void test_besk_branch_free()
+{
+    static const helord_t v[] = {
+	0, 1, 2, 0x5A5A5A5A5A, 0x3FFFFFFFFF, HELORD_FRAC,
+	HELORD_SIGN, HELORD_SIGN+1, 0xA5A5A5A5A5, 0xC000000000, HELORD_MASK
+    };
+    int n = sizeof(v)/sizeof(v[0]);
+    int i, j;
+    halvord_t h;
+
+    for (i = 0; i < n; i++) {
+	helord_t a = v[i];
+	int64_t x = (a >> 39) ? -((~a + 1) & HELORD_FRAC) : (int64_t) a;
+	assert(helord_abs(a) == ((a >> 39) ? helord_neg(a) : a));
+	assert(helord_to_int64(a) == x);
+	for (j = 0; j < n; j++) {
+	    helord_t b = v[j], r;
+	    int o = helord_add_oflw(a, b, &r);
+	    assert(o == (((a>>39) && (b >> 39) && !(r>>39)) ||
+			 (!(a>>39) && !(b>>39) && (r>>39))));
+	}
+    }
+    for (h = 0; h <= HALVORD_MASK; h++)
+	assert(halvord_abs(h) == ((h >> 19) ? halvord_neg(h) : h));
+    printf("branch free: ok\n");
+}
+
+// division as the 128 bit version did
+helord_t helord_divrem_128(helord_t a, helord_t b, helord_t* rp)
+{
+    __int128 n128 = ((__int128)helord_sign_extend(a)) << 39;
+    int64_t b64 = helord_sign_extend(b);
+    *rp = helord_from_int64(n128 % b64);
+    return helord_from_int64(n128 / b64);
+}
+
+typedef struct {
+    pthread_t tid;
+    uint64_t  seed;
+    uint64_t  count;
+    uint64_t  fail;
+} div_job_t;
+
+static uint64_t xorshift64(uint64_t* s)
+{
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+// random operand, uniform or with a random number of bits (small
+// divisors overflow the quotient) and the edges -1, 0.5, 2^-39
+static helord_t div_operand(uint64_t* s)
+{
+    uint64_t x = xorshift64(s);
+    switch(x & 7) {
+    case 0: return helord_from_int64(helord_sign_extend(x >> 24) >> ((x >> 3) % 40));
+    case 1: return (x & 0x100) ? HELORD_SIGN : (x & 0x200) ? 1 : HELORD_SIGN >> 1;
+    default: return (x >> 24) & HELORD_MASK;
+    }
+}
+
+static void* div_job(void* arg)
+{
+    div_job_t* job = arg;
+    uint64_t s = job->seed;
+    uint64_t i;
+
+    for (i = 0; i < job->count; i++) {
+	helord_t a = div_operand(&s);
+	helord_t b = div_operand(&s);
+	helord_t q0, q1, r0, r1;
+	if (b == 0)
+	    continue;
+	q0 = helord_divrem(a, b, &r0);
+	q1 = helord_divrem_128(a, b, &r1);
+	if ((q0 != q1) || (r0 != r1)) {
+	    if (job->fail++ < 10)
+		printf("FAIL %010lX/%010lX = %010lX,%010lX expect %010lX,%010lX\n",
+		       a, b, q0, r0, q1, r1);
+	}
+    }
+    return NULL;
+}
+
+// divrem against the 128 bit division on count random operand pairs,
+// split over nthreads
+void test_besk_divrem(uint64_t count, int nthreads)
+{
+    div_job_t job[nthreads];
+    uint64_t fail = 0;
+    int i;
+
+    for (i = 0; i < nthreads; i++) {
+	job[i].seed  = 0x9E3779B97F4A7C15ULL * (i + 1);
+	job[i].count = count / nthreads + (i < (int)(count % nthreads));
+	job[i].fail  = 0;
+	pthread_create(&job[i].tid, NULL, div_job, &job[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+	pthread_join(job[i].tid, NULL);
+	fail += job[i].fail;
+    }
+    assert(fail == 0);
+    printf("divrem: %lu cases ok\n", count);
+}
+
+// array operations against the one at a time ones, on every isa
+void test_besk_array()
+{
+    static const char* isa[] = { "scalar", "avx2" };
+    static const double edge[] = {
+	0.0, -0.0, 1.0, -1.0, 1.5, -1.5, 0.5, -0.5, 1.0 - 0x1p-39, -0x1p-39,
+	0x1p-40, -0x1p-40, 0x1p-39 * 0.5, -0x1p-39 * 1.5, INFINITY, -INFINITY,
+	NAN, 0.1, -0.1
+    };
+    enum { N = 1003 };  // not a multiple of the vector length
+    helord_t a[N], b[N], r[N], lw[N], x[N];
+    double y[N], d[N];
+    uint64_t s = 0x243F6A8885A308D3ULL;
+    int k, i, ok = 0;
+
+    for (i = 0; i < N; i++) {
+	a[i] = xorshift64(&s) & HELORD_MASK;
+	b[i] = (i < 4) ? HELORD_SIGN : xorshift64(&s) & HELORD_MASK;
+	if (i < (int)(sizeof(edge)/sizeof(edge[0])))
+	    y[i] = edge[i];
+	else
+	    y[i] = ((int64_t) xorshift64(&s) >> 11) * 0x1p-52 * 1.2;
+    }
+    for (k = 0; k < 2; k++) {
+	if (helord_n_select(isa[k]) < 0)
+	    continue;
+	helord_add_n(a, b, r, N);
+	for (i = 0; i < N; i++) {
+	    helord_t c;
+	    (void) helord_add(a[i], b[i], &c);
+	    assert(r[i] == c);
+	}
+	helord_mul_n(a, b, r, lw, N);
+	for (i = 0; i < N; i++) {
+	    helord_t l, h = helord_mul(a[i], b[i], &l);
+	    assert((r[i] == h) && (lw[i] == l));
+	}
+	helord_mul_n(a, b, x, NULL, N);
+	assert(memcmp(x, r, sizeof(r)) == 0);
+	helord_from_double_n(y, r, N);
+	for (i = 0; i < N; i++) {
+	    if (r[i] != helord_from_double(y[i]))
+		printf("FAIL %s from_double(%a) = %010lX expect %010lX\n",
+		       isa[k], y[i], r[i], helord_from_double(y[i]));
+	    assert(r[i] == helord_from_double(y[i]));
+	}
+	helord_to_double_n(a, d, N);
+	for (i = 0; i < N; i++) {
+	    double e = helord_to_double(a[i]);
+	    assert(memcmp(&d[i], &e, sizeof(double)) == 0);
+	}
+	x[0] = HELORD_SIGN;  // -1, converted to -0.0
+	helord_to_double_n(x, d, 4);
+	assert(signbit(d[0]) && (d[0] == 0.0));
+	helord_reverse_n(a, r, N);
+	for (i = 0; i < N; i++)
+	    assert(r[i] == helord_reverse(a[i]));
+	printf("array %s: ok\n", isa[k]);
+	ok++;
+    }
+    assert(ok > 0);
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: besk_test [options]\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "  -n <n>     random division tests (default 10000000)\n");
+    fprintf(stderr, "  -j <n>     threads for the division tests (default 1)\n");
+    exit(1);
+}
+
 int main(int argc, char** argv)
 {
+    uint64_t div_count = 10000000;
+    int nthreads = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:j:")) != -1) {
+	switch(opt) {
+	case 'n': {
+	    char* eptr;
+	    div_count = strtoull(optarg, &eptr, 0);
+	    if (*eptr != '\0') usage();
+	    break;
+	}
+	case 'j':
+	    if ((nthreads = atoi(optarg)) < 1)
+		usage();
+	    break;
+	default:
+	    usage();
+	}
+    }
+    test_besk_norm();
+    test_besk_reverse();
+    test_besk_branch_free();
+    test_besk_divrem(div_count, nthreads);
+    test_besk_array();
     test_besk_int();
     test_besk_fix();
     exit(0);
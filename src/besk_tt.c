@@ -0,0 +1,331 @@
+//
+//  BESK time travel, reverse execution on the switch core
+//
+//  Every interval instructions a keyframe (registers and memory) is
+//  taken, between keyframes a delta log holds the old values of what
+//  each instruction is about to change outside the registers: memory
+//  cells written by store, addst, stora, read and drum read, drum
+//  bytes written by drum write and the paper tape positions. Going
+//  back to instruction #n undoes the device deltas down to the nearest
+//  keyframe at or before n, restores the keyframe and replays forward,
+//  at most interval instructions.
+//
+//  Memory is bounded by the number of keyframes and log entries, when
+//  the log wraps the keyframes before the oldest entry can no longer be
+//  reached.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "besk.h"
+
+#define TT_MEM   0  // memory cell, old halvord
+#define TT_IN    1  // input tape, old read offset
+#define TT_UT    2  // output tape, old write offset
+#define TT_DRUM  3  // drum, 8 old bytes at offset
+
+typedef struct
+{
+    uint64_t count;   // instruction number
+    uint32_t addr;    // cell or drum offset
+    uint32_t kind;    // TT_xxx
+    int64_t  old;     // old value
+} tt_delta_t;
+
+typedef struct
+{
+    uint64_t  count;  // instruction number, state before step0
+    helord_t  MD, MR, AR, ARP, BR;
+    oktet_t   AR00, AR40, SI;
+    halvord_t KR, INS;
+    helord_t  Fx, Fy, Fop;
+    int       page;
+    besk_mem_t MEM[NUM_MEM_WORDS];
+} tt_key_t;
+
+typedef struct
+{
+    uint64_t    interval;   // instructions between keyframes
+    uint64_t    next_key;   // count of next keyframe
+    uint64_t    present;    // highest instruction number recorded
+    uint64_t    lost;       // deltas before this count are overwritten
+    uint32_t    key_mask;   // keyframe ring size-1
+    uint64_t    key_first;  // oldest and one past newest keyframe
+    uint64_t    key_last;
+    uint32_t    delta_mask; // delta ring size-1
+    uint64_t    delta_first; // oldest and one past newest delta
+    uint64_t    delta_last;
+    tt_key_t*   key;
+    tt_delta_t* delta;
+} tt_t;
+
+static uint32_t pow2(uint32_t n)
+{
+    uint32_t size = 1;
+    while (size < n) size <<= 1;
+    return size;
+}
+
+// Enable time travel on state with a keyframe every interval
+// instructions, the last keyframes keyframes and deltas log entries.
+// Return 0 or -1 on error.
+int besk_tt_init(besk_t* state, uint64_t interval, uint32_t keyframes,
+		 uint32_t deltas)
+{
+    tt_t* tt;
+
+    tt_destroy(state);
+    if ((interval == 0) || (keyframes == 0) || (deltas == 0))
+	return 0;
+    if ((keyframes > TT_MAX_SIZE) || (deltas > TT_MAX_SIZE))
+	return -1;  // not a power of 2 in 32 bits
+    if ((tt = calloc(1, sizeof(tt_t))) == NULL)
+	return -1;
+    tt->interval   = interval;
+    tt->key_mask   = pow2(keyframes) - 1;
+    tt->delta_mask = pow2(deltas) - 1;
+    tt->next_key   = state->count;
+    tt->present    = state->count;
+    tt->lost       = state->count;
+    tt->key   = malloc((tt->key_mask+1)*sizeof(tt_key_t));
+    tt->delta = malloc((tt->delta_mask+1)*sizeof(tt_delta_t));
+    if ((tt->key == NULL) || (tt->delta == NULL)) {
+	free(tt->key);
+	free(tt->delta);
+	free(tt);
+	return -1;
+    }
+    state->tt = tt;
+    return 0;
+}
+
+void tt_destroy(besk_t* state)
+{
+    tt_t* tt = state->tt;
+
+    if (tt == NULL)
+	return;
+    free(tt->key);
+    free(tt->delta);
+    free(tt);
+    state->tt = NULL;
+}
+
+static void tt_log(besk_t* state, tt_t* tt, int kind, uint32_t addr,
+		   int64_t old)
+{
+    tt_delta_t* e;
+
+    if (tt->delta_last - tt->delta_first > tt->delta_mask) {
+	// overwrite oldest, keyframes up to its instruction are lost
+	e = &tt->delta[tt->delta_first++ & tt->delta_mask];
+	tt->lost = e->count + 1;
+	while ((tt->key_first < tt->key_last) &&
+	       (tt->key[tt->key_first & tt->key_mask].count < tt->lost))
+	    tt->key_first++;
+    }
+    e = &tt->delta[tt->delta_last++ & tt->delta_mask];
+    e->count = state->count;
+    e->kind  = kind;
+    e->addr  = addr;
+    e->old   = old;
+}
+
+static void tt_log_cells(besk_t* state, tt_t* tt, int H, unsigned addr)
+{
+    addr &= 0x7ff;
+    tt_log(state, tt, TT_MEM, addr, mem_get(state->MEM, addr));
+    if (H && (addr+1 < NUM_HALF_CELLS))
+	tt_log(state, tt, TT_MEM, addr+1, mem_get(state->MEM, addr+1));
+}
+
+static void tt_keyframe(besk_t* state, tt_t* tt)
+{
+    tt_key_t* k;
+
+    if (tt->key_last - tt->key_first > tt->key_mask)
+	tt->key_first++;
+    k = &tt->key[tt->key_last++ & tt->key_mask];
+    k->count = state->count;
+    k->MD  = state->MD;
+    k->MR  = state->MR;
+    k->AR  = state->AR;
+    k->ARP = state->ARP;
+    k->BR  = state->BR;
+    k->AR00 = state->AR00;
+    k->AR40 = state->AR40;
+    k->SI  = state->SI;
+    k->KR  = state->KR;
+    k->INS = state->INS;
+    k->Fx  = state->Fx;
+    k->Fy  = state->Fy;
+    k->Fop = state->Fop;
+    k->page = state->page;
+    memcpy(k->MEM, state->MEM, sizeof(k->MEM));
+}
+
+// Called by besk_step0 before the instruction at KR is fetched, take
+// a keyframe when due and log the old values the instruction changes.
+void tt_record(besk_t* state)
+{
+    tt_t* tt = state->tt;
+    besk_decode_t* d = besk_decode(state, state->KR);
+    int H = (d->flags & DECODE_H) != 0;
+    int i;
+
+    if (state->count >= tt->next_key) {
+	tt_keyframe(state, tt);
+	tt->next_key = state->count + tt->interval;
+    }
+    if (state->count >= tt->present)
+	tt->present = state->count + 1;
+    switch(d->n) {
+    case OP_ADDST:
+    case OP_STORA:
+    case OP_STORE:
+	tt_log_cells(state, tt, H, d->addr);
+	break;
+    case OP_READ4x10:
+	if (state->in)
+	    tt_log(state, tt, TT_IN, 0, ftello(state->in));
+	tt_log_cells(state, tt, H, d->addr);
+	break;
+    case OP_RD:
+	for (i = 0; i < DRUM_CHANNEL_SIZE/2; i++)
+	    tt_log_cells(state, tt, H, (d->addr & 0x7FE) + 2*i);
+	break;
+    case OP_WRITE4:
+    case OP_WRITE:
+	if (state->ut)
+	    tt_log(state, tt, TT_UT, 0, ftello(state->ut));
+	break;
+    case OP_WD:
+	if (state->drum) {
+	    long offset = ((W(state->MR) & 0x1FE)>>1)*DRUM_CHANNEL_BYTES;
+	    uint8_t data[DRUM_CHANNEL_BYTES];
+	    fseek(state->drum, offset, SEEK_SET);
+	    memset(data, 0, sizeof(data));
+	    fread(data, 1, DRUM_CHANNEL_BYTES, state->drum);
+	    for (i = 0; i < DRUM_CHANNEL_BYTES; i += 8) {
+		int64_t old;
+		memcpy(&old, data+i, 8);
+		tt_log(state, tt, TT_DRUM, offset+i, old);
+	    }
+	}
+	break;
+    default:
+	break;
+    }
+}
+
+// undo device deltas of instructions >= count, memory is restored
+// from the keyframe
+static void tt_undo(besk_t* state, tt_t* tt, uint64_t count)
+{
+    while ((tt->delta_last > tt->delta_first) &&
+	   (tt->delta[(tt->delta_last-1) & tt->delta_mask].count >= count)) {
+	tt_delta_t* e = &tt->delta[--tt->delta_last & tt->delta_mask];
+	switch(e->kind) {
+	case TT_IN:
+	    fseeko(state->in, e->old, SEEK_SET);
+	    break;
+	case TT_UT:
+	    fflush(state->ut);
+	    if (ftruncate(fileno(state->ut), e->old) == 0)
+		fseeko(state->ut, e->old, SEEK_SET);
+	    break;
+	case TT_DRUM:
+	    fseek(state->drum, e->addr, SEEK_SET);
+	    fwrite(&e->old, 1, 8, state->drum);
+	    fflush(state->drum);
+	    break;
+	default:
+	    break;
+	}
+    }
+}
+
+static void tt_restore(besk_t* state, tt_key_t* k)
+{
+    int i;
+
+    state->MD  = k->MD;
+    state->MR  = k->MR;
+    state->AR  = k->AR;
+    state->ARP = k->ARP;
+    state->BR  = k->BR;
+    state->AR00 = k->AR00;
+    state->AR40 = k->AR40;
+    state->SI  = k->SI;
+    state->KR  = k->KR;
+    state->INS = k->INS;
+    state->Fx  = k->Fx;
+    state->Fy  = k->Fy;
+    state->Fop = k->Fop;
+    state->page = k->page;
+    state->count = k->count;
+    memcpy(state->MEM, k->MEM, sizeof(state->MEM));
+    // memory is rewritten behind the decode cache and translated code
+    jit_destroy(state);
+    for (i = 0; i < NUM_HALF_CELLS; i++)
+	state->DEC[i].flags = 0;
+}
+
+// Move state to before instruction #n. Within the recorded history
+// STOP is passed, beyond it the machine runs until n or STOP. The
+// machine is left stopped. Return 0, or -1 when n is before the oldest
+// reachable keyframe.
+int besk_tt_seek(besk_t* state, uint64_t n)
+{
+    tt_t* tt = state->tt;
+    int trace = state->trace;
+
+    if (tt == NULL)
+	return -1;
+    if (n < state->count) {
+	uint64_t i = tt->key_last;
+	tt_key_t* k;
+	while ((i > tt->key_first) && (tt->key[(i-1) & tt->key_mask].count > n))
+	    i--;
+	if (i == tt->key_first)
+	    return -1;
+	k = &tt->key[(i-1) & tt->key_mask];
+	tt_undo(state, tt, k->count);
+	tt_restore(state, k);
+	tt->key_last = i - 1;  // taken again by the replay
+	tt->next_key = k->count;
+    }
+    state->trace = 0;
+    while (state->count < n) {
+	state->running = 1;
+	besk_step0(state);
+	besk_step(state);
+	if (!state->running && (state->count >= tt->present))
+	    break;
+    }
+    state->trace = trace;
+    state->running = 0;
+    return 0;
+}
+
+// Return the number of the last instruction before the current one
+// that wrote memory cell addr, or -1 when not in the log.
+int64_t besk_tt_last_write(besk_t* state, unsigned addr)
+{
+    tt_t* tt = state->tt;
+    uint64_t i;
+
+    if (tt == NULL)
+	return -1;
+    addr &= 0x7ff;
+    for (i = tt->delta_last; i > tt->delta_first; i--) {
+	tt_delta_t* e = &tt->delta[(i-1) & tt->delta_mask];
+	if ((e->count < state->count) && (e->kind == TT_MEM) &&
+	    (e->addr == addr))
+	    return e->count;
+    }
+    return -1;
+}
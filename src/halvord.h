@@ -22,17 +22,53 @@
 #endif
 
 
+// BESK_CHECKED=1 (default) asserts that halvord and helord arguments
+// are 20 and 40 bits wide, a release build sets BESK_CHECKED=0
+#ifndef BESK_CHECKED
+#define BESK_CHECKED 1
+#endif
+
+#if BESK_CHECKED
+#define BESK_CHECK(e) assert(e)
+#else
+#define BESK_CHECK(e) ((void) 0)
+#endif
+
 typedef int32_t halvord_t;   // 20-bit
 
 #define HALVORD_MASK 0xFFFFF
 #define HALVORD_ADDR 0xFFF00
 #define HALVORD_OP   0x000FF
 
-extern halvord_t halvord_reverse(halvord_t x);
-
+LOCAL inline uint64_t bit_reverse64(uint64_t x) LOCAL_API;
+LOCAL inline halvord_t halvord_reverse(halvord_t x) LOCAL_API;
 LOCAL inline halvord_t halvord_abs(halvord_t x) LOCAL_API;
 LOCAL inline halvord_t halvord_sign_bit(halvord_t x) LOCAL_API;
 
+// reverse the bits of a 64 bit word, the clang builtin or rbit on arm64,
+// otherwise swap the bytes and then nibbles, pairs and bits in each byte
+static inline uint64_t bit_reverse64(uint64_t x)
+{
+#if defined(__clang__)
+    return __builtin_bitreverse64(x);
+#elif defined(__aarch64__)
+    __asm__ ("rbit %0, %1" : "=r" (x) : "r" (x));
+    return x;
+#else
+    x = __builtin_bswap64(x);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    return x;
+#endif
+}
+
+// works on both sign exteded and non sign extened
+static inline halvord_t halvord_reverse(halvord_t x)
+{
+    return bit_reverse64((uint32_t) x) >> 44;
+}
+
 // works for both sign extended and none sign extened data
 static inline int halvord_sign_bit(halvord_t x)
 {
@@ -48,14 +84,15 @@ static inline int is_halvord(halvord_t x)
 // works for sign extended halvord
 static inline halvord_t halvord_neg(halvord_t a)
 {
-    assert(is_halvord(a));
+    BESK_CHECK(is_halvord(a));
     return (~a + 1) & HALVORD_MASK;
 }
 
 static inline halvord_t halvord_abs(halvord_t a)
 {
-    assert(is_halvord(a));
-    return halvord_sign_bit(a) ? halvord_neg(a) : a;
+    halvord_t m = -halvord_sign_bit(a);
+    BESK_CHECK(is_halvord(a));
+    return ((a ^ m) - m) & (HALVORD_MASK | ~m);
 }
 
 #endif
@@ -27,15 +27,3 @@ helord_t helord_from_double(double y)
 	x = helord_neg(((helord_t)((-y)*HELORD_SIGN)) & HELORD_MASK);
     return x;
 }
-
-helord_t helord_reverse(helord_t x)
-{
-    int i;
-    helord_t y = 0;
-    for (i = 0; i < 40; i++) {
-	y = (y<<1) | (x & 1);
-	x >>= 1;
-    }
-    return y;
-//    return helord_sign_extend(y);
-}
@@ -11,6 +11,7 @@
 #define __HELORD_H__
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "halvord.h"
@@ -40,11 +41,22 @@ LOCAL void helord_write(unsigned addr, halvord_t* mem, helord_t value) LOCAL_API
 
 extern double   helord_to_double(helord_t x);
 extern helord_t helord_from_double(double y);
-extern helord_t helord_reverse(helord_t x);
+
+// array at a time (helord_n.c)
+extern int  helord_n_select(const char* isa);
+extern const char* helord_n_isa(void);
+extern void helord_add_n(const helord_t* a, const helord_t* b, helord_t* r,
+			 size_t n);
+extern void helord_mul_n(const helord_t* a, const helord_t* b, helord_t* r,
+			 helord_t* lw, size_t n);
+extern void helord_from_double_n(const double* y, helord_t* r, size_t n);
+extern void helord_to_double_n(const helord_t* x, double* r, size_t n);
+extern void helord_reverse_n(const helord_t* x, helord_t* r, size_t n);
 
 LOCAL inline int64_t helord_to_int64(helord_t x) LOCAL_API;
 LOCAL inline helord_t helord_from_int64(int64_t x) LOCAL_API;
 
+LOCAL inline helord_t helord_reverse(helord_t x) LOCAL_API;
 LOCAL inline int is_helord(helord_t x) LOCAL_API;
 LOCAL inline int helord_sign_bit(helord_t x) LOCAL_API;
 LOCAL inline int64_t helord_sign_extend(helord_t x) LOCAL_API;
@@ -56,6 +68,7 @@ LOCAL inline helord_t helord_shr(helord_t a, unsigned s) LOCAL_API;
 LOCAL inline helord_t helord_shr40(helord_t a, unsigned s, uint8_t* ar40) LOCAL_API;
 LOCAL inline helord_t helord_ashr(helord_t a, unsigned s) LOCAL_API;
 LOCAL inline helord_t helord_ashr40(helord_t a, unsigned s, uint8_t* ar40) LOCAL_API;
+LOCAL inline helord_t helord_norm(helord_t a, int inject, uint8_t* ar40) LOCAL_API;
 LOCAL inline int helord_add(helord_t a, helord_t b, helord_t* rp) LOCAL_API;
 LOCAL inline int helord_add_oflw(helord_t a, helord_t b, helord_t* rp) LOCAL_API; 
 LOCAL inline helord_t helord_mul(helord_t a, helord_t b, helord_t* lwp) LOCAL_API;
@@ -81,7 +94,7 @@ static void helord_write(unsigned addr, halvord_t* mem, helord_t value)
 // works for both sign extended and none sign extened data
 static inline int helord_sign_bit(helord_t x)
 {
-    assert(is_helord(x));
+    BESK_CHECK(is_helord(x));
     return ((x >> 39) & 1);
 }
 
@@ -97,11 +110,10 @@ static inline int64_t helord_sign_extend(helord_t x)
 
 static inline int64_t helord_to_int64(helord_t x)
 {
-    assert(is_helord(x));
-    if (helord_sign_bit(x))
-	return -((~x + 1) & HELORD_FRAC);
-    else
-	return x;
+    int64_t m = -(int64_t)helord_sign_bit(x);
+    BESK_CHECK(is_helord(x));
+    // -((-x) & HELORD_FRAC) when negative
+    return ((((x ^ m) - m) & (HELORD_FRAC | ~m)) ^ m) - m;
 }
     
 static inline int is_helord(helord_t x)
@@ -109,29 +121,36 @@ static inline int is_helord(helord_t x)
     return (((x) & ~HELORD_MASK) == 0);
 }
 
+// reverse bits 39..0, bits above 39 are ignored
+static inline helord_t helord_reverse(helord_t x)
+{
+    return bit_reverse64(x) >> 24;
+}
+
 
 // works for sign extended helord
 static inline helord_t helord_neg(helord_t a)
 {
-    assert(is_helord(a));
+    BESK_CHECK(is_helord(a));
     return (~a + 1) & HELORD_MASK;
 }
 
 static inline helord_t helord_abs(helord_t a)
 {
-    assert(is_helord(a));
-    return helord_sign_bit(a) ? helord_neg(a) : a;
+    helord_t m = -(helord_t)helord_sign_bit(a);
+    BESK_CHECK(is_helord(a));
+    return ((a ^ m) - m) & (HELORD_MASK | ~m);
 }
 
 static inline helord_t helord_shl(helord_t a, unsigned s)
 {
-    assert(is_helord(a));
+    BESK_CHECK(is_helord(a));
     return (a << s) & HELORD_MASK;
 }
 
 static inline helord_t helord_shl00(helord_t a, unsigned s, uint8_t* ar00)
 {
-    assert(is_helord(a));
+    BESK_CHECK(is_helord(a));
     a = a << s;
     *ar00 = (a >> 40) & 1;
     return a & HELORD_MASK;
@@ -144,7 +163,7 @@ static inline helord_t helord_shr(helord_t a, unsigned s)
 
 static inline helord_t helord_shr40(helord_t a, unsigned s, uint8_t* ar40)
 {
-    assert(is_helord(a));
+    BESK_CHECK(is_helord(a));
     *ar40 = (s < 40) ? ((a >> (s-1)) & 1) : 0;
     a = a >> s;
     return a & HELORD_MASK;
@@ -153,25 +172,48 @@ static inline helord_t helord_shr40(helord_t a, unsigned s, uint8_t* ar40)
 // arittmetic shift right, keep signbit intact
 static inline helord_t helord_ashr(helord_t a, unsigned s)
 {
-    assert(is_helord(a));
+    BESK_CHECK(is_helord(a));
     return ((a << 24) >> (24+s)) & HELORD_MASK;
 }
 
 // arittmetic shift right, keep signbit intact
 static inline helord_t helord_ashr40(helord_t a, unsigned s, uint8_t* ar40)
 {
-    assert(is_helord(a));
+    BESK_CHECK(is_helord(a));
     *ar40 = (s < 40) ? ((a >> (s-1)) & 1) : ((a >> 39) & 1);
     return ((a << 24) >> (24+s)) & HELORD_MASK;
 }
 
+// normalize (NORM/NORM40), shift a left until bit 39 and bit 38 differ
+// or a is zero. With inject the first shift brings in *ar40 as bit 0
+// and clears *ar40. Bits shifted past bit 39 are kept (as the bit at a
+// time loop in besk_step did), the distance is found in one step from
+// the first bit that differs from bit 39 in bits 39..0 followed by the
+// injected bit, leading zeros of y^(y<<1) with bit 39 of a at bit 63.
+static inline helord_t helord_norm(helord_t a, int inject, uint8_t* ar40)
+{
+    uint64_t in = inject ? (*ar40 & 1) : 0;
+    uint64_t y = (((a & HELORD_MASK) << 1) | in) << 23;
+    int k;
+
+    if (a == 0)
+	return 0;
+    if (y == 0)  // only bits above 39, shifted out
+	return 0;
+    k = __builtin_clzll(y ^ (y << 1));  // 0..40
+    if (k == 0)
+	return a;
+    if (inject)
+	*ar40 = 0;
+    return (a << k) | (in << (k-1));
+}
 
 // add and return carry out
 static inline int helord_add(helord_t a, helord_t b, helord_t* rp)
 {
     helord_t s;
-    assert(is_helord(a));
-    assert(is_helord(b));
+    BESK_CHECK(is_helord(a));
+    BESK_CHECK(is_helord(b));
     s = a + b;
     *rp = s & HELORD_MASK;
     return (s >> 40) & 1; // carry 
@@ -181,13 +223,13 @@ static inline int helord_add(helord_t a, helord_t b, helord_t* rp)
 static inline int helord_add_oflw(helord_t a, helord_t b, helord_t* rp)
 {
     helord_t s, r;
-    assert(is_helord(a));
-    assert(is_helord(b));
+    BESK_CHECK(is_helord(a));
+    BESK_CHECK(is_helord(b));
     s = a + b;
     r = s & HELORD_MASK;
     *rp = r;
-    return ((a>>39) && (b >> 39) && !(r>>39)) ||
-	(!(a>>39) && !(b>>39) && (r>>39));
+    // a and b have the same sign and r the other
+    return (((a ^ r) & (b ^ r)) >> 39) & 1;
 }
 
 // double word add and return carry out
@@ -197,12 +239,12 @@ static inline int helord_dadd(helord_t a1, helord_t a0,
 {
     helord_t c1, c0;
     
-    assert(is_helord(a1)); assert(is_helord(a0));
-    assert(is_helord(b1)); assert(is_helord(b0));
+    BESK_CHECK(is_helord(a1)); BESK_CHECK(is_helord(a0));
+    BESK_CHECK(is_helord(b1)); BESK_CHECK(is_helord(b0));
     
     c0 = a0 + b0;
     c1 = a1 + b1;
-    if ((c0 >> 40) & 1) c1++;
+    c1 += (c0 >> 40) & 1;
     *rp0 = c0 & HELORD_MASK;
     *rp1 = c1 & HELORD_MASK;
     return (c1 >> 40) & 1; // carry
@@ -244,8 +286,8 @@ static inline helord_t helord_mul(helord_t a, helord_t b, helord_t* lwp)
 {
     __int128 p;
     int64_t aa, bb;
-    assert(is_helord(a));
-    assert(is_helord(b));
+    BESK_CHECK(is_helord(a));
+    BESK_CHECK(is_helord(b));
     aa = helord_sign_extend(a);
     bb = helord_sign_extend(b);
     p = (__int128)aa * bb;
@@ -261,8 +303,8 @@ static inline helord_t helord_muladd(helord_t a, helord_t b,
 {
     int sp;
     helord_t p1, p0;
-    assert(is_helord(a));
-    assert(is_helord(b));    
+    BESK_CHECK(is_helord(a));
+    BESK_CHECK(is_helord(b));    
     p1 = helord_mul(a, b, &p0);
     sp = helord_add(p0, c0, lwp);
     // ignore overflow? (or preserve)
@@ -271,26 +313,41 @@ static inline helord_t helord_muladd(helord_t a, helord_t b,
     return p1;
 }
 
-// calculate *qq = a*b + *rp
-// return quitient and store remainder in *rp
+// Divide the 79 bit a*2^39 by b, return the quotient and store the
+// remainder in *rp, both truncated towards zero and cut to 40 bits as
+// the 128 bit division did. The magnitudes are divided with one 128/64
+// divq on x86-64, the high part is first reduced modulo |b| when the
+// quotient needs more than 64 bits (only its low 40 bits are kept).
+// Elsewhere |a|/|b| is followed by two 64 bit steps bringing in 24 and
+// 15 zero bits, the remainder is below 2^39. b = 0 traps like the 128
+// bit division did.
 static inline helord_t helord_divrem(helord_t a, helord_t b, helord_t* rp)
 {
-    __int128 n128; 
-    int64_t a64, b64, r, q;
-    assert(is_helord(a));
-    assert(is_helord(b));
-    a64 = helord_sign_extend(a);
-    n128 = ((__int128)a64) << 39;
-    /* printf("n128 = %016lX.%016lx\n",
-	   (uint64_t)(n128>>64),
-	   (uint64_t)(n128 & 0xFFFFFFFFFFFFFFFFL)); */
-    b64 = helord_sign_extend(b);
-    q = n128 / b64;
-    // printf("q = %016lX (%f)\n", q, helord_to_double(helord_from_int64(q)));
-    r = n128 % b64;
-    // printf("r = %016lX\n", r);
-    *rp = helord_from_int64(r);
-    return helord_from_int64(q);
+    uint64_t sa, sb, sq, ua, ub, q, r;
+    BESK_CHECK(is_helord(a));
+    BESK_CHECK(is_helord(b));
+    sa = -((a >> 39) & 1);
+    sb = -((b >> 39) & 1);
+    sq = sa ^ sb;
+    ua = ((helord_sign_extend(a) ^ sa) - sa);  // |a| <= 2^39
+    ub = ((helord_sign_extend(b) ^ sb) - sb);  // |b| <= 2^39
+#if defined(__x86_64__)
+    {
+	uint64_t lo = ua << 39, hi = ua >> 25;
+	if (hi >= ub)  // quotient above 64 bits, divq would trap
+	    hi %= ub;
+	__asm__ ("divq %4" : "=a" (q), "=d" (r) : "a" (lo), "d" (hi), "rm" (ub));
+    }
+#else
+    q = ua / ub;
+    r = ua % ub;
+    q = (q << 24) | ((r << 24) / ub);
+    r = (r << 24) % ub;
+    q = (q << 15) | ((r << 15) / ub);
+    r = (r << 15) % ub;
+#endif
+    *rp = ((r ^ sa) - sa) & HELORD_MASK;
+    return ((q ^ sq) - sq) & HELORD_MASK;
 }
 
 #endif
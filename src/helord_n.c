@@ -0,0 +1,297 @@
+//
+//  BESK helord array operations
+//
+//  Array at a time versions of helord_add, helord_mul, helord_from_double,
+//  helord_to_double and helord_reverse for tools converting or post
+//  processing many values. Results are bit identical to the one at a
+//  time operations. Kernels are built for AVX2 (4 values per vector)
+//  and as a scalar loop, the AVX2 kernels are used when the cpu has it.
+//
+#include <stdint.h>
+#include <string.h>
+
+#include "helord.h"
+
+typedef struct
+{
+    const char* name;
+    void (*add)(const helord_t* a, const helord_t* b, helord_t* r, size_t n);
+    void (*mul)(const helord_t* a, const helord_t* b, helord_t* r,
+		helord_t* lw, size_t n);
+    void (*from_double)(const double* y, helord_t* r, size_t n);
+    void (*to_double)(const helord_t* x, double* r, size_t n);
+    void (*reverse)(const helord_t* x, helord_t* r, size_t n);
+} helord_n_t;
+
+static void add_scalar(const helord_t* a, const helord_t* b, helord_t* r,
+		       size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	(void) helord_add(a[i], b[i], &r[i]);
+}
+
+static void mul_scalar(const helord_t* a, const helord_t* b, helord_t* r,
+		       helord_t* lw, size_t n)
+{
+    size_t i;
+    helord_t l;
+    for (i = 0; i < n; i++) {
+	r[i] = helord_mul(a[i], b[i], &l);
+	if (lw) lw[i] = l;
+    }
+}
+
+static void from_double_scalar(const double* y, helord_t* r, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	r[i] = helord_from_double(y[i]);
+}
+
+static void to_double_scalar(const helord_t* x, double* r, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	r[i] = helord_to_double(x[i]);
+}
+
+static void reverse_scalar(const helord_t* x, helord_t* r, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	r[i] = helord_reverse(x[i]);
+}
+
+static const helord_n_t helord_n_scalar = {
+    .name = "scalar",
+    .add = add_scalar,
+    .mul = mul_scalar,
+    .from_double = from_double_scalar,
+    .to_double = to_double_scalar,
+    .reverse = reverse_scalar,
+};
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define HELORD_N_X86 1
+
+#include <immintrin.h>
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+typedef uint64_t vh_t __attribute__((vector_size(32)));
+typedef int64_t  vs_t __attribute__((vector_size(32)));
+typedef double   vd_t __attribute__((vector_size(32)));
+typedef uint8_t  vb_t __attribute__((vector_size(32)));
+
+#define VLEN    4
+#define VLOAD(v, p)   memcpy(&(v), (p), sizeof(v))
+#define VSTORE(p, v)  memcpy((p), &(v), sizeof(v))
+#define VDUP(x)       { (x), (x), (x), (x) }
+#define EXP52   0x4330000000000000ULL  // bits of 2^52
+#define MANT52  0x000FFFFFFFFFFFFFULL
+#define SIGN64  0x8000000000000000ULL
+// select doubles a where mask m is set, otherwise b
+#define VDSELECT(m, a, b) \
+    ((vd_t)(((vh_t)(m) & (vh_t)(a)) | (~(vh_t)(m) & (vh_t)(b))))
+
+// signed 32x32 to 64 bit multiply of the low halves (vpmuldq), the
+// 64x64 vector multiply has no AVX2 instruction
+static inline __attribute__((always_inline)) vs_t vmul32(vs_t a, vs_t b)
+{
+    return (vs_t) _mm256_mul_epi32((__m256i) a, (__m256i) b);
+}
+
+static void add_avx2(const helord_t* a, const helord_t* b, helord_t* r,
+		     size_t n)
+{
+    size_t i;
+    for (i = 0; i + VLEN <= n; i += VLEN) {
+	vh_t va, vb, vr;
+	VLOAD(va, a+i);
+	VLOAD(vb, b+i);
+	vr = (va + vb) & HELORD_MASK;
+	VSTORE(r+i, vr);
+    }
+    add_scalar(a+i, b+i, r+i, n-i);
+}
+
+// product of the sign extended operands from 20 bit limbs, as
+// vhelord_muladd in besk_simd_group.h, the limbs fit in 32 bits
+static void mul_avx2(const helord_t* a, const helord_t* b, helord_t* r,
+		     helord_t* lw, size_t n)
+{
+    size_t i;
+    for (i = 0; i + VLEN <= n; i += VLEN) {
+	vh_t va, vb, p0, p1;
+	vs_t sa, sb, al, ah, bl, bh, t0, t1, t2, mid, hi;
+	VLOAD(va, a+i);
+	VLOAD(vb, b+i);
+	sa = ((vs_t)(va << 24)) >> 24;
+	sb = ((vs_t)(vb << 24)) >> 24;
+	al = sa & 0xFFFFF; ah = sa >> 20;
+	bl = sb & 0xFFFFF; bh = sb >> 20;
+	t0  = vmul32(al, bl);
+	t1  = vmul32(ah, bl) + vmul32(al, bh);
+	t2  = vmul32(ah, bh);
+	mid = t0 + ((t1 & 0xFFFFF) << 20);
+	hi  = t2 + (t1 >> 20) + (mid >> 40);
+	p0  = (vh_t) mid & HELORD_MASK;
+	p1  = (((vh_t) hi << 1) | (((vh_t) mid >> 39) & 1)) & HELORD_MASK;
+	VSTORE(r+i, p1);
+	if (lw) VSTORE(lw+i, p0);
+    }
+    mul_scalar(a+i, b+i, r+i, lw ? lw+i : NULL, n-i);
+}
+
+// y is clamped as by helord_from_double, |y|*2^39 is at most 2^39 and
+// truncated by adding 2^52 (rounds to nearest) and stepping down when
+// that rounded up. NaN gives 0 as helord_from_double does.
+static void from_double_avx2(const double* y, helord_t* r, size_t n)
+{
+    const vd_t lo  = VDUP(-1.0);
+    const vd_t one = VDUP(1.0);
+    const vd_t hi  = VDUP(1.0 - 0x1p-39);
+    const vd_t e52 = VDUP(0x1p52);
+    size_t i;
+
+    for (i = 0; i + VLEN <= n; i += VLEN) {
+	vd_t vy, m, t;
+	vh_t x, neg;
+	VLOAD(vy, y+i);
+	vy = VDSELECT(vy < lo, lo, vy);
+	vy = VDSELECT(vy >= one, hi, vy);
+	neg = (vh_t) ~(vy >= 0.0);
+	m = (vd_t)((vh_t) vy & ~SIGN64) * 0x1p39;
+	t = m + e52;
+	x = ((vh_t) t & MANT52) + (vh_t)((t - e52) > m);
+	x &= (vh_t)(m == m) & HELORD_MASK;
+	x = ((x ^ neg) - neg) & HELORD_MASK;
+	VSTORE(r+i, x);
+    }
+    from_double_scalar(y+i, r+i, n-i);
+}
+
+// magnitude and sign as helord_to_double takes them, the magnitude is
+// below 2^40 and converted exactly in the mantissa of 2^52
+static void to_double_avx2(const helord_t* x, double* r, size_t n)
+{
+    const vd_t e52  = VDUP(0x1p52);
+    const vd_t frac = VDUP((double) HELORD_FRAC);
+    size_t i;
+
+    for (i = 0; i + VLEN <= n; i += VLEN) {
+	vh_t vx, s, m;
+	vd_t d;
+	VLOAD(vx, x+i);
+	s = -((vx >> 39) & 1);
+	m = ((vx ^ s) - s) & (HELORD_FRAC | ~s);
+	d = ((vd_t)(m | EXP52) - e52) / frac;
+	d = (vd_t)((vh_t) d ^ (s & SIGN64));
+	VSTORE(r+i, d);
+    }
+    to_double_scalar(x+i, r+i, n-i);
+}
+
+// bytes swapped with a shuffle, then nibbles, pairs and bits
+static void reverse_avx2(const helord_t* x, helord_t* r, size_t n)
+{
+    const vb_t bswap = { 7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8,
+			 23,22,21,20,19,18,17,16, 31,30,29,28,27,26,25,24 };
+    size_t i;
+
+    for (i = 0; i + VLEN <= n; i += VLEN) {
+	vh_t v;
+	VLOAD(v, x+i);
+	v = (vh_t) __builtin_shuffle((vb_t) v, bswap);
+	v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+	v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+	v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+	v >>= 24;
+	VSTORE(r+i, v);
+    }
+    reverse_scalar(x+i, r+i, n-i);
+}
+
+#pragma GCC pop_options
+
+static const helord_n_t helord_n_avx2 = {
+    .name = "avx2",
+    .add = add_avx2,
+    .mul = mul_avx2,
+    .from_double = from_double_avx2,
+    .to_double = to_double_avx2,
+    .reverse = reverse_avx2,
+};
+#endif
+
+// kernels in use, set on first use or by helord_n_select. Accessed
+// atomically, threads may make the first call at the same time (they
+// store the same kernels).
+static const helord_n_t* helord_n_impl = NULL;
+
+static const helord_n_t* helord_n(void)
+{
+    const helord_n_t* impl = __atomic_load_n(&helord_n_impl, __ATOMIC_ACQUIRE);
+    if (impl == NULL) {
+	impl = &helord_n_scalar;
+#ifdef HELORD_N_X86
+	if (__builtin_cpu_supports("avx2"))
+	    impl = &helord_n_avx2;
+#endif
+	__atomic_store_n(&helord_n_impl, impl, __ATOMIC_RELEASE);
+    }
+    return impl;
+}
+
+// Use the kernels for isa, "scalar" or "avx2", return 0 or -1 when
+// not built or not supported by the cpu.
+int helord_n_select(const char* isa)
+{
+    if (strcmp(isa, "scalar") == 0) {
+	__atomic_store_n(&helord_n_impl, &helord_n_scalar, __ATOMIC_RELEASE);
+	return 0;
+    }
+#ifdef HELORD_N_X86
+    if ((strcmp(isa, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+	__atomic_store_n(&helord_n_impl, &helord_n_avx2, __ATOMIC_RELEASE);
+	return 0;
+    }
+#endif
+    return -1;
+}
+
+// name of the kernels in use
+const char* helord_n_isa(void)
+{
+    return helord_n()->name;
+}
+
+// r[i] = a[i] + b[i], the carry is dropped
+void helord_add_n(const helord_t* a, const helord_t* b, helord_t* r, size_t n)
+{
+    helord_n()->add(a, b, r, n);
+}
+
+// r[i] = a[i] * b[i] and the low part in lw[i] unless lw is NULL
+void helord_mul_n(const helord_t* a, const helord_t* b, helord_t* r,
+		  helord_t* lw, size_t n)
+{
+    helord_n()->mul(a, b, r, lw, n);
+}
+
+void helord_from_double_n(const double* y, helord_t* r, size_t n)
+{
+    helord_n()->from_double(y, r, n);
+}
+
+void helord_to_double_n(const helord_t* x, double* r, size_t n)
+{
+    helord_n()->to_double(x, r, n);
+}
+
+void helord_reverse_n(const helord_t* x, helord_t* r, size_t n)
+{
+    helord_n()->reverse(x, r, n);
+}